@@ -9,17 +9,54 @@ load(qt_module)
 CONFIG      -= create_cmake
 
 SOURCES += \
+        dqmldelta.cpp \
+        dqmlcodec.cpp \
+        dqmlfilefilter.cpp \
         dqmlfiletracker.cpp \
         dqmlglobal.cpp \
+        dqmlhash.cpp \
         dqmllocalserver.cpp \
+        dqmlmanifest.cpp \
+        dqmlmetrics.cpp \
         dqmlmonitor.cpp \
+        dqmlmonitortarget.cpp \
+        dqmloverlay.cpp \
+        dqmlprotocol.cpp \
+        dqmlreadjob.cpp \
         dqmlserver.cpp \
+        dqmlserverconnection.cpp \
+        dqmltransport.cpp \
+        dqmlwritejob.cpp \
 
 HEADERS += \
+        dqmlcodec.h \
+        dqmldelta_p.h \
+        dqmlfilefilter.h \
         dqmlfiletracker.h \
         dqmlglobal.h \
+        dqmlhash_p.h \
         dqmllocalserver.h \
+        dqmlmanifest_p.h \
+        dqmlmetrics.h \
         dqmlmonitor.h \
+        dqmlmonitortarget_p.h \
+        dqmloverlay_p.h \
+        dqmlprotocol_p.h \
+        dqmlreadjob_p.h \
         dqmlserver.h \
+        dqmlserverconnection_p.h \
+        dqmltransport_p.h \
+        dqmlwritejob_p.h \
+
+linux {
+    SOURCES += dqmlinotifywatcher.cpp
+    HEADERS += dqmlinotifywatcher_p.h
+}
+
+packagesExist(liblz4) {
+    DEFINES += DQML_HAVE_LZ4
+    CONFIG += link_pkgconfig
+    PKGCONFIG += liblz4
+}
 
 DEFINES += DQML_BUILD_LIB=1
@@ -0,0 +1,140 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlcodec.h"
+
+#include <QtCore/QMutex>
+
+#ifdef DQML_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+class DQmlZlibCodec : public DQmlCodec
+{
+public:
+    QByteArray name() const { return QByteArrayLiteral("zlib"); }
+
+    QByteArray compress(const QByteArray &data, int level) const
+    {
+        return qCompress(data, level);
+    }
+
+    QByteArray decompress(const QByteArray &data, int size) const
+    {
+        QByteArray result = qUncompress(data);
+        return result.size() == size ? result : QByteArray();
+    }
+};
+
+#ifdef DQML_HAVE_LZ4
+// Several times faster than zlib on both ends, for a bit less compression.
+// The level is ignored.
+class DQmlLz4Codec : public DQmlCodec
+{
+public:
+    QByteArray name() const { return QByteArrayLiteral("lz4"); }
+
+    QByteArray compress(const QByteArray &data, int) const
+    {
+        QByteArray result(LZ4_compressBound(data.size()), Qt::Uninitialized);
+        int size = LZ4_compress_default(data.constData(), result.data(), data.size(), result.size());
+        if (size <= 0)
+            return QByteArray();
+        result.resize(size);
+        return result;
+    }
+
+    QByteArray decompress(const QByteArray &data, int size) const
+    {
+        if (size < 0)
+            return QByteArray();
+        QByteArray result(size, Qt::Uninitialized);
+        int actual = LZ4_decompress_safe(data.constData(), result.data(), data.size(), size);
+        return actual == size ? result : QByteArray();
+    }
+};
+#endif
+
+struct DQmlCodecRegistry
+{
+    DQmlCodecRegistry()
+    {
+#ifdef DQML_HAVE_LZ4
+        codecs << new DQmlLz4Codec();
+#endif
+        codecs << new DQmlZlibCodec();
+    }
+    ~DQmlCodecRegistry()
+    {
+        qDeleteAll(codecs);
+        qDeleteAll(replaced);
+    }
+
+    QMutex mutex;
+    QList<DQmlCodec *> codecs;
+    // Jobs and connections may still be using them
+    QList<DQmlCodec *> replaced;
+};
+
+Q_GLOBAL_STATIC(DQmlCodecRegistry, dqml_codecs)
+
+void DQmlCodec::registerCodec(DQmlCodec *codec)
+{
+    DQmlCodecRegistry *r = dqml_codecs();
+    QMutexLocker lock(&r->mutex);
+    QByteArray name = codec->name();
+    for (int i = 0; i < r->codecs.size(); ++i) {
+        if (r->codecs.at(i)->name() == name) {
+            r->replaced << r->codecs.at(i);
+            r->codecs[i] = codec;
+            return;
+        }
+    }
+    // Codecs added by the application are assumed to be preferred
+    r->codecs.prepend(codec);
+}
+
+DQmlCodec *DQmlCodec::codec(const QByteArray &name)
+{
+    DQmlCodecRegistry *r = dqml_codecs();
+    QMutexLocker lock(&r->mutex);
+    foreach (DQmlCodec *c, r->codecs) {
+        if (c->name() == name)
+            return c;
+    }
+    return 0;
+}
+
+// In order of preference
+QList<QByteArray> DQmlCodec::codecNames()
+{
+    DQmlCodecRegistry *r = dqml_codecs();
+    QMutexLocker lock(&r->mutex);
+    QList<QByteArray> names;
+    foreach (DQmlCodec *c, r->codecs)
+        names << c->name();
+    return names;
+}
@@ -0,0 +1,64 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLCODEC_H
+#define DQMLCODEC_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+
+QT_BEGIN_NAMESPACE
+
+// A compression scheme for messages between monitor and server. zlib is
+// always available, lz4 when dqml was built with it. Applications can add
+// their own with registerCodec(), on both sides, before connecting.
+class DQML_EXPORT DQmlCodec
+{
+public:
+    virtual ~DQmlCodec() { }
+
+    // The name the codec is negotiated with, like "zlib"
+    virtual QByteArray name() const = 0;
+
+    // 'level' is from 0 to 9 with -1 as the codec's default. Codecs without
+    // levels are free to ignore it.
+    virtual QByteArray compress(const QByteArray &data, int level) const = 0;
+    // Returns a null array if 'data' isn't valid or doesn't decompress to
+    // 'size' bytes.
+    virtual QByteArray decompress(const QByteArray &data, int size) const = 0;
+
+    // Takes ownership of 'codec'. A codec with the same name is replaced, but
+    // kept alive until exit since messages in flight may still use it.
+    static void registerCodec(DQmlCodec *codec);
+    static DQmlCodec *codec(const QByteArray &name);
+    static QList<QByteArray> codecNames();
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLCODEC_H
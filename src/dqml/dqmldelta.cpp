@@ -0,0 +1,216 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmldelta_p.h"
+
+#include <QtCore/QMultiHash>
+#include <QtCore/qendian.h>
+
+#include <math.h>
+#include <string.h>
+
+// Only send a delta if it saves at least a tenth of the file
+static const double DQML_DELTA_MAX_RATIO = 0.9;
+
+static inline void dqml_append32(QByteArray *data, quint32 value)
+{
+    value = qToLittleEndian(value);
+    data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static inline quint32 dqml_read32(const char *p)
+{
+    quint32 v;
+    memcpy(&v, p, sizeof(v));
+    return qFromLittleEndian(v);
+}
+
+// Blocks of about the square root of the file size balance the size of the
+// checksum index against how much a change costs to resend.
+static int dqml_blockSize(int size)
+{
+    int blockSize = (int(sqrt(double(size))) + 15) & ~15;
+    return qBound(64, blockSize, 8192);
+}
+
+static inline quint32 dqml_weakChecksum(quint32 a, quint32 b)
+{
+    return (a & 0xffff) | (b << 16);
+}
+
+static void dqml_checksum(const uchar *data, int length, quint32 *a, quint32 *b)
+{
+    quint32 sa = 0;
+    quint32 sb = 0;
+    for (int i = 0; i < length; ++i) {
+        sa += data[i];
+        sb += quint32(length - i) * data[i];
+    }
+    *a = sa;
+    *b = sb;
+}
+
+struct DQmlDeltaWriter
+{
+    DQmlDeltaWriter(const char *t) : target(t), copyOffset(0), copyLength(0) { }
+
+    void copy(int offset, int length) {
+        if (copyLength > 0 && copyOffset + copyLength == offset) {
+            copyLength += length;
+            return;
+        }
+        flushCopy();
+        copyOffset = offset;
+        copyLength = length;
+    }
+
+    void literal(int from, int to) {
+        if (from >= to)
+            return;
+        flushCopy();
+        delta.append('L');
+        dqml_append32(&delta, to - from);
+        delta.append(target + from, to - from);
+    }
+
+    void flushCopy() {
+        if (copyLength == 0)
+            return;
+        delta.append('C');
+        dqml_append32(&delta, copyOffset);
+        dqml_append32(&delta, copyLength);
+        copyLength = 0;
+    }
+
+    const char *target;
+    QByteArray delta;
+    int copyOffset;
+    int copyLength;
+};
+
+QByteArray dqml_makeDelta(const QByteArray &base, const QByteArray &target)
+{
+    int blockSize = dqml_blockSize(base.size());
+    int blockCount = base.size() / blockSize;
+    if (blockCount == 0 || target.size() < blockSize)
+        return QByteArray();
+
+    const uchar *b = reinterpret_cast<const uchar *>(base.constData());
+    QMultiHash<quint32, int> blocks;
+    blocks.reserve(blockCount);
+    for (int i = 0; i < blockCount; ++i) {
+        quint32 sa, sb;
+        dqml_checksum(b + i * blockSize, blockSize, &sa, &sb);
+        blocks.insert(dqml_weakChecksum(sa, sb), i);
+    }
+
+    const uchar *t = reinterpret_cast<const uchar *>(target.constData());
+    int size = target.size();
+    DQmlDeltaWriter writer(target.constData());
+    int literalStart = 0;
+    int pos = 0;
+    quint32 sa = 0;
+    quint32 sb = 0;
+    bool haveChecksum = false;
+    while (pos + blockSize <= size) {
+        if (!haveChecksum) {
+            dqml_checksum(t + pos, blockSize, &sa, &sb);
+            haveChecksum = true;
+        }
+
+        // The checksum is weak, so candidates are compared in full. We have
+        // the base at hand, so that is cheaper than a strong hash.
+        int match = -1;
+        quint32 weak = dqml_weakChecksum(sa, sb);
+        QMultiHash<quint32, int>::const_iterator it = blocks.constFind(weak);
+        for (; it != blocks.constEnd() && it.key() == weak; ++it) {
+            if (memcmp(b + it.value() * blockSize, t + pos, blockSize) == 0) {
+                match = it.value();
+                // Prefer the block which continues the current copy
+                if (match * blockSize == writer.copyOffset + writer.copyLength)
+                    break;
+            }
+        }
+
+        if (match >= 0) {
+            writer.literal(literalStart, pos);
+            writer.copy(match * blockSize, blockSize);
+            pos += blockSize;
+            literalStart = pos;
+            haveChecksum = false;
+        } else {
+            if (pos + blockSize < size) {
+                quint32 out = t[pos];
+                quint32 in = t[pos + blockSize];
+                sa += in - out;
+                sb += sa - quint32(blockSize) * out;
+            }
+            ++pos;
+        }
+
+        // Give up early when it is clear the delta won't pay off
+        if (writer.delta.size() > DQML_DELTA_MAX_RATIO * size)
+            return QByteArray();
+    }
+    writer.literal(literalStart, size);
+    writer.flushCopy();
+
+    if (writer.delta.size() > DQML_DELTA_MAX_RATIO * size)
+        return QByteArray();
+    return writer.delta;
+}
+
+bool dqml_applyDelta(const QByteArray &base, const QByteArray &delta, QByteArray *result)
+{
+    result->clear();
+    const char *p = delta.constData();
+    const char *end = p + delta.size();
+    while (p < end) {
+        char op = *p++;
+        if (op == 'C') {
+            if (end - p < 8)
+                return false;
+            quint32 offset = dqml_read32(p);
+            quint32 length = dqml_read32(p + 4);
+            p += 8;
+            if (offset > quint32(base.size()) || length > quint32(base.size()) - offset)
+                return false;
+            result->append(base.constData() + offset, length);
+        } else if (op == 'L') {
+            if (end - p < 4)
+                return false;
+            quint32 length = dqml_read32(p);
+            p += 4;
+            if (length > quint32(end - p))
+                return false;
+            result->append(p, length);
+            p += length;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLDELTA_P_H
+#define DQMLDELTA_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+
+QT_BEGIN_NAMESPACE
+
+// rsync style deltas. 'base' is cut into blocks which are indexed on a
+// rolling checksum, a window is then rolled over 'target' one byte at a
+// time to find the blocks it still contains. The delta is a sequence of
+// operations, all little endian:
+//
+//   copy:    'C', quint32 offset in base, quint32 length
+//   literal: 'L', quint32 length, the bytes
+//
+// Returns an empty array if the delta would not be much smaller than
+// 'target', in which case it is better sent as it is.
+QByteArray dqml_makeDelta(const QByteArray &base, const QByteArray &target);
+
+// Rebuilds the target from 'base' and 'delta'. Returns false if the delta
+// is malformed or refers outside of 'base'.
+bool dqml_applyDelta(const QByteArray &base, const QByteArray &delta, QByteArray *result);
+
+QT_END_NAMESPACE
+
+#endif // DQMLDELTA_P_H
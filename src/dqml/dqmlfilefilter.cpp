@@ -0,0 +1,215 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlfilefilter.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QTextStream>
+
+// Translates a glob into a regular expression. '*' and '?' stop at '/',
+// '**' does not.
+static QString dqml_globToRegExp(const QString &glob)
+{
+    QString rx;
+    rx.reserve(glob.size() * 2 + 4);
+    rx += QLatin1Char('^');
+    for (int i = 0; i < glob.size(); ++i) {
+        QChar c = glob.at(i);
+        if (c == QLatin1Char('*')) {
+            if (i + 1 < glob.size() && glob.at(i + 1) == QLatin1Char('*')) {
+                ++i;
+                if (i + 1 < glob.size() && glob.at(i + 1) == QLatin1Char('/')) {
+                    ++i;
+                    rx += QStringLiteral("(?:.*/)?");
+                } else {
+                    rx += QStringLiteral(".*");
+                }
+            } else {
+                rx += QStringLiteral("[^/]*");
+            }
+        } else if (c == QLatin1Char('?')) {
+            rx += QStringLiteral("[^/]");
+        } else if (c == QLatin1Char('[')) {
+            int end = glob.indexOf(QLatin1Char(']'), i + 1);
+            if (end < 0) {
+                rx += QStringLiteral("\\[");
+            } else {
+                QString set = glob.mid(i + 1, end - i - 1);
+                if (set.startsWith(QLatin1Char('!')))
+                    set[0] = QLatin1Char('^');
+                rx += QLatin1Char('[') + set + QLatin1Char(']');
+                i = end;
+            }
+        } else {
+            rx += QRegularExpression::escape(QString(c));
+        }
+    }
+    rx += QLatin1Char('$');
+    return rx;
+}
+
+static bool dqml_hasWildcards(const QString &pattern)
+{
+    for (int i = 0; i < pattern.size(); ++i) {
+        QChar c = pattern.at(i);
+        if (c == QLatin1Char('*') || c == QLatin1Char('?') || c == QLatin1Char('['))
+            return true;
+    }
+    return false;
+}
+
+DQmlFileFilter::DQmlFileFilter()
+{
+    addRule(QStringLiteral("!*.qml"));
+    addRule(QStringLiteral("!*.js"));
+    addRule(QStringLiteral("!*.png"));
+    addRule(QStringLiteral("!*.jpg"));
+    addRule(QStringLiteral("!*.jpeg"));
+    addRule(QStringLiteral("!*.gif"));
+}
+
+void DQmlFileFilter::addRule(const QString &r)
+{
+    QString rule = r.trimmed();
+    if (rule.isEmpty() || rule.startsWith(QLatin1Char('#')))
+        return;
+
+    bool include = false;
+    if (rule.startsWith(QLatin1Char('!'))) {
+        include = true;
+        rule.remove(0, 1);
+    }
+    bool directoryOnly = false;
+    if (rule.endsWith(QLatin1Char('/'))) {
+        directoryOnly = true;
+        rule.chop(1);
+    }
+    bool anchored = rule.contains(QLatin1Char('/'));
+    if (rule.startsWith(QLatin1Char('/')))
+        rule.remove(0, 1);
+    if (rule.isEmpty())
+        return;
+
+    int index = m_includes.size();
+    m_includes << include;
+
+    if (!anchored && !directoryOnly && rule.startsWith(QStringLiteral("*."))
+            && !dqml_hasWildcards(rule.mid(2))) {
+        SuffixRule s;
+        s.suffix = rule.mid(1);
+        s.rule = index;
+        m_suffixRules << s;
+    } else if (!anchored && !dqml_hasWildcards(rule)) {
+        if (directoryOnly)
+            m_directoryNameRules.insert(rule, index);
+        else
+            m_nameRules.insert(rule, index);
+    } else {
+        PatternRule p;
+        p.pattern = QRegularExpression(dqml_globToRegExp(rule));
+        p.anchored = anchored;
+        p.directoryOnly = directoryOnly;
+        p.rule = index;
+        if (!p.pattern.isValid()) {
+            qCWarning(DQML_LOG) << "invalid rule" << r << p.pattern.errorString();
+            m_includes.removeLast();
+            return;
+        }
+        p.pattern.optimize();
+        m_patternRules << p;
+    }
+}
+
+void DQmlFileFilter::addRules(const QStringList &rules)
+{
+    foreach (const QString &rule, rules)
+        addRule(rule);
+}
+
+bool DQmlFileFilter::loadRules(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly | QFile::Text))
+        return false;
+    qCDebug(DQML_LOG) << "loading rules from" << fileName;
+    QTextStream stream(&file);
+    while (!stream.atEnd())
+        addRule(stream.readLine());
+    return true;
+}
+
+bool DQmlFileFilter::acceptsFile(const QString &dir, const QString &name) const
+{
+    return accepts(dir, name, false);
+}
+
+bool DQmlFileFilter::acceptsDirectory(const QString &dir, const QString &name) const
+{
+    return accepts(dir, name, true);
+}
+
+bool DQmlFileFilter::accepts(const QString &dir, const QString &name, bool isDir) const
+{
+    int match = -1;
+
+    // "*.qml" style rules, which is most of them, compare in place
+    for (int i = 0; i < m_suffixRules.size(); ++i) {
+        const SuffixRule &s = m_suffixRules.at(i);
+        if (s.rule > match && name.size() > s.suffix.size()
+                && name.endsWith(s.suffix, Qt::CaseInsensitive)) {
+            match = s.rule;
+        }
+    }
+
+    QHash<QString, int>::const_iterator it = m_nameRules.constFind(name);
+    if (it != m_nameRules.constEnd())
+        match = qMax(match, it.value());
+    if (isDir) {
+        it = m_directoryNameRules.constFind(name);
+        if (it != m_directoryNameRules.constEnd())
+            match = qMax(match, it.value());
+    }
+
+    // Only patterns added after the best match so far can change the outcome
+    QString path;
+    for (int i = m_patternRules.size() - 1; i >= 0; --i) {
+        const PatternRule &p = m_patternRules.at(i);
+        if (p.rule <= match)
+            break;
+        if (p.directoryOnly && !isDir)
+            continue;
+        if (p.anchored && path.isEmpty())
+            path = dir.isEmpty() ? name : dir + QLatin1Char('/') + name;
+        if (p.pattern.match(p.anchored ? path : name).hasMatch()) {
+            match = p.rule;
+            break;
+        }
+    }
+
+    if (match < 0)
+        return isDir;
+    return m_includes.at(match);
+}
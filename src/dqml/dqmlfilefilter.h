@@ -0,0 +1,91 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLFILEFILTER_H
+#define DQMLFILEFILTER_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
+
+QT_BEGIN_NAMESPACE
+
+// Decides which files and directories below a tracked root are tracked.
+//
+// Rules follow the .gitignore syntax: a pattern excludes what it matches, a
+// leading '!' includes it again, a trailing '/' makes it match directories
+// only and a pattern containing a '/' is matched against the path relative
+// to the root rather than the name. When several rules match, the last one
+// wins. Files start out excluded, except for the QML, JS and image files
+// included by the built-in rules, and directories start out included, so
+// "!*.svg" adds SVG files and "build/" prunes every directory named build.
+//
+// Rules are compiled on the way in: '*.suffix' and plain name rules are
+// looked up without matching any patterns, only the rest go through
+// regular expressions.
+class DQML_EXPORT DQmlFileFilter
+{
+public:
+    DQmlFileFilter();
+
+    void addRule(const QString &rule);
+    void addRules(const QStringList &rules);
+    bool loadRules(const QString &fileName);
+
+    // 'dir' is relative to the tracked root, empty for the root itself
+    bool acceptsFile(const QString &dir, const QString &name) const;
+    bool acceptsDirectory(const QString &dir, const QString &name) const;
+
+private:
+    struct SuffixRule {
+        QString suffix;
+        int rule;
+    };
+
+    struct PatternRule {
+        QRegularExpression pattern;
+        bool anchored;
+        bool directoryOnly;
+        int rule;
+    };
+
+    bool accepts(const QString &dir, const QString &name, bool isDir) const;
+
+    // Whether each rule, in order, includes or excludes
+    QVector<bool> m_includes;
+
+    QVector<SuffixRule> m_suffixRules;
+    QHash<QString, int> m_nameRules;
+    QHash<QString, int> m_directoryNameRules;
+    QVector<PatternRule> m_patternRules;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLFILEFILTER_H
@@ -25,26 +25,183 @@
 */
 
 #include "dqmlfiletracker.h"
+#include "dqmlhash_p.h"
+#include "dqmlmanifest_p.h"
+#include "dqmlmetrics.h"
+
+#ifdef Q_OS_LINUX
+#include "dqmlinotifywatcher_p.h"
+#endif
 
 #include <QtCore/QDir>
 #include <QtCore/QDirIterator>
+#include <QtCore/QFile>
 #include <QtCore/QDateTime>
+#include <QtCore/QTimerEvent>
+
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The number of stat() calls one poll may spend, across all polled roots
+static const int DQML_POLL_BUDGET = 2048;
+
+// The number of directories of a polled root its rescan lists per poll
+static const int DQML_RELIST_BUDGET = 8;
+
+// Some filesystems, like FAT, sshfs and some NFS exports, keep timestamps in
+// whole seconds, so a directory listed within that much of its timestamp
+// may have changed since without the timestamp showing it
+static const qint64 DQML_TIMESTAMP_GRANULARITY = 2000;
 
-DQmlFileTracker::DQmlFileTracker(QObject *parent) :
-    QObject(parent)
+// Joins a relative directory and a name, both relative to the tracked root
+static inline QString dqml_joinPath(const QString &dir, const QString &name)
 {
-    connect(&m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(onDirChange(QString)));
-    connect(&m_watcher, SIGNAL(fileChanged(QString)), this, SLOT(onFileChange(QString)));
+    return dir.isEmpty() ? name : dir + QLatin1Char('/') + name;
+}
 
-    m_suffixes << QStringLiteral("qml");
-    m_suffixes << QStringLiteral("js");
-    m_suffixes << QStringLiteral("png");
-    m_suffixes << QStringLiteral("jpg");
-    m_suffixes << QStringLiteral("jpeg");
-    m_suffixes << QStringLiteral("gif");
+// Returns the absolute path of the relative directory 'dir'
+static inline QString dqml_absolutePath(const QString &root, const QString &dir)
+{
+    return dir.isEmpty() ? root : root + QLatin1Char('/') + dir;
+}
+
+static void dqml_splitPath(const QString &path, QString *dir, QString *name)
+{
+    int slash = path.lastIndexOf(QLatin1Char('/'));
+    *dir = slash < 0 ? QString() : path.left(slash);
+    *name = path.mid(slash + 1);
 }
 
-bool DQmlFileTracker::track(const QString &id, const QString &path)
+static bool dqml_fileLessThan(const DQmlFileTracker::File &a, const DQmlFileTracker::File &b)
+{
+    return a.name < b.name;
+}
+
+struct DQmlTrackerMetrics
+{
+    DQmlTrackerMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        watchedDirectories = m->counter(QStringLiteral("tracker.watchedDirectories"));
+        events = m->counter(QStringLiteral("tracker.events"));
+        eventsCoalesced = m->counter(QStringLiteral("tracker.eventsCoalesced"));
+        changeSets = m->counter(QStringLiteral("tracker.changeSets"));
+        changeSetSize = m->histogram(QStringLiteral("tracker.changeSetSize"));
+        scanUsecs = m->histogram(QStringLiteral("tracker.scanUsecs"));
+        rescanUsecs = m->histogram(QStringLiteral("tracker.rescanUsecs"));
+        pollUsecs = m->histogram(QStringLiteral("tracker.pollUsecs"));
+    }
+
+    DQmlCounter *watchedDirectories;
+    DQmlCounter *events;
+    DQmlCounter *eventsCoalesced;
+    DQmlCounter *changeSets;
+    DQmlHistogram *changeSetSize;
+    DQmlHistogram *scanUsecs;
+    DQmlHistogram *rescanUsecs;
+    DQmlHistogram *pollUsecs;
+};
+
+Q_GLOBAL_STATIC(DQmlTrackerMetrics, dqml_metrics)
+
+static quint64 dqml_directoryModified(const QFileInfo &info)
+{
+    return info.exists() ? info.lastModified().toMSecsSinceEpoch() : 0;
+}
+
+// Returns the names of the files in 'd' whose size or timestamp is no longer
+// what we know, including the ones which are gone. On Unix the files are
+// stat'ed relative to the opened directory, which saves resolving the whole
+// path for each of them, something network filesystems are slow at.
+static QStringList dqml_staleFiles(const QString &absDir, const DQmlFileTracker::Directory &d)
+{
+    QStringList stale;
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(absDir).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        foreach (const DQmlFileTracker::File &f, d.files)
+            stale << f.name;
+        return stale;
+    }
+    foreach (const DQmlFileTracker::File &f, d.files) {
+        struct stat st;
+        if (::fstatat(fd, QFile::encodeName(f.name).constData(), &st, 0) != 0) {
+            stale << f.name;
+            continue;
+        }
+#if defined(Q_OS_DARWIN)
+        quint64 modified = quint64(st.st_mtimespec.tv_sec) * 1000 + st.st_mtimespec.tv_nsec / 1000000;
+#else
+        quint64 modified = quint64(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+#endif
+        if (modified != f.state.modified || qint64(st.st_size) != f.state.size)
+            stale << f.name;
+    }
+    ::close(fd);
+#else
+    foreach (const DQmlFileTracker::File &f, d.files) {
+        QFileInfo i(absDir + QLatin1Char('/') + f.name);
+        if (!i.exists()
+                || quint64(i.lastModified().toMSecsSinceEpoch()) != f.state.modified
+                || i.size() != f.state.size)
+            stale << f.name;
+    }
+#endif
+    return stale;
+}
+
+DQmlFileTracker::DQmlFileTracker(QObject *parent)
+    : QObject(parent)
+    , m_rescanInterval(0)
+    , m_minPollInterval(250)
+    , m_maxPollInterval(4000)
+    , m_pollInterval(250)
+    , m_pollTimer(0)
+    , m_rescanTimer(0)
+    , m_hashContent(false)
+    , m_coalesceInterval(50)
+    , m_coalesceTimer(0)
+    , m_manifestTimer(0)
+    , m_watcher(0)
+#ifdef Q_OS_LINUX
+    , m_inotify(0)
+#endif
+{
+    qRegisterMetaType<DQmlFileTracker::ChangeSet>();
+
+    setRescanInterval(60000);
+
+#ifdef Q_OS_LINUX
+    m_inotify = new DQmlInotifyWatcher(this);
+    if (m_inotify->isValid()) {
+        connect(m_inotify, SIGNAL(filesChanged(QString,QStringList)), this, SLOT(onFilesChanged(QString,QStringList)));
+        connect(m_inotify, SIGNAL(directoryChanged(QString)), this, SLOT(onDirChange(QString)));
+        connect(m_inotify, SIGNAL(overflow()), this, SLOT(rescan()));
+        return;
+    }
+    qCDebug(DQML_LOG) << "inotify is not available, falling back to QFileSystemWatcher";
+    delete m_inotify;
+    m_inotify = 0;
+#endif
+
+    m_watcher = new QFileSystemWatcher(this);
+    connect(m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(onDirChange(QString)));
+    connect(m_watcher, SIGNAL(fileChanged(QString)), this, SLOT(onFileChange(QString)));
+}
+
+DQmlFileTracker::~DQmlFileTracker()
+{
+    // Don't lose the changes that have not been written out yet
+    if (m_manifestTimer)
+        saveManifest();
+}
+
+bool DQmlFileTracker::track(const QString &id, const QString &path, const QStringList &rules, WatchMode mode)
 {
     QFileInfo i(path);
     if (!i.exists()) {
@@ -55,10 +212,26 @@ bool DQmlFileTracker::track(const QString &id, const QString &path)
         qCDebug(DQML_LOG) << "path is not a directory" << path;
         return false;
     }
-    QString cp = i.canonicalFilePath();
-    qCDebug(DQML_LOG) << "tracking" << id << cp;
-    m_set[id] = createEntry(i);
-    m_watcher.addPath(cp);
+    if (m_set.contains(id))
+        untrack(id);
+    qCDebug(DQML_LOG) << (mode == Poll ? "polling" : "tracking") << id << i.canonicalFilePath();
+
+    DQmlFileFilter filter;
+    filter.loadRules(i.canonicalFilePath() + QStringLiteral("/.dqmlignore"));
+    filter.addRules(rules);
+
+    QHash<QString, FileState> baseline;
+    if (!m_manifestFile.isEmpty()
+            && dqml_readManifest(m_manifestFile, id, i.canonicalFilePath(), &baseline)) {
+        qCDebug(DQML_LOG) << " - comparing with manifest" << m_manifestFile;
+        m_set[id] = createEntry(id, i, filter, mode, &baseline);
+        compareWithManifest(id, baseline);
+    } else {
+        m_set[id] = createEntry(id, i, filter, mode);
+    }
+    scheduleManifestSave();
+    if (mode == Poll)
+        updatePollTimer(true);
     return true;
 }
 
@@ -66,114 +239,749 @@ bool DQmlFileTracker::untrack(const QString &id)
 {
     qCDebug(DQML_LOG) << "untracking" << id;
     if (m_set.contains(id)) {
-        QString path = m_set.take(id).path;
-        m_watcher.removePath(path);
+        Entry e = m_set.take(id);
+        if (e.mode == Poll) {
+            updatePollTimer(false);
+            return true;
+        }
+        foreach (const Directory &d, e.dirs) {
+            unwatchDirectory(id, dqml_absolutePath(e.path, d.path));
+#ifdef Q_OS_LINUX
+            if (m_watcher) {
+                foreach (const File &f, d.files)
+                    unwatchFile(e.path + QLatin1Char('/') + d.filePath(f.name));
+            }
+#endif
+        }
         return true;
     }
     qCWarning(DQML_LOG) << "unknown id";
     return false;
 }
 
-QHash<QString, DQmlFileTracker::Entry> DQmlFileTracker::trackingSet() const
+void DQmlFileTracker::setRescanInterval(int msecs)
 {
-    return m_set;
+    if (m_rescanTimer) {
+        killTimer(m_rescanTimer);
+        m_rescanTimer = 0;
+    }
+    m_rescanInterval = msecs;
+    if (m_rescanInterval > 0)
+        m_rescanTimer = startTimer(m_rescanInterval);
 }
 
-QString DQmlFileTracker::idFromPath(const QString &path) const
+void DQmlFileTracker::setPollInterval(int minimum, int maximum)
 {
-    for (QHash<QString, Entry>::const_iterator it = m_set.constBegin();
-         it != m_set.constEnd(); ++it) {
-        if (it.value().path == path)
-            return it.key();
+    m_minPollInterval = qMax(1, minimum);
+    m_maxPollInterval = qMax(m_minPollInterval, maximum);
+    if (m_pollTimer)
+        updatePollTimer(true);
+}
+
+// Starts, stops or resets the poll timer. After activity the interval drops
+// to the minimum, while idle it doubles up to the maximum.
+void DQmlFileTracker::updatePollTimer(bool active)
+{
+    bool polling = false;
+    for (QHash<QString, Entry>::const_iterator it = m_set.constBegin(); it != m_set.constEnd(); ++it) {
+        if (it->mode == Poll) {
+            polling = true;
+            break;
+        }
+    }
+
+    int interval = active ? m_minPollInterval : qMin(m_pollInterval * 2, m_maxPollInterval);
+    if (m_pollTimer && (!polling || interval != m_pollInterval)) {
+        killTimer(m_pollTimer);
+        m_pollTimer = 0;
     }
-    return QString();
+    m_pollInterval = interval;
+    if (polling && !m_pollTimer)
+        m_pollTimer = startTimer(m_pollInterval);
 }
 
-void DQmlFileTracker::onDirChange(const QString &path)
+void DQmlFileTracker::timerEvent(QTimerEvent *e)
 {
-    qCDebug(DQML_LOG) << "change in directory" << path;
-    QString id = idFromPath(path);
-    if (id.isEmpty()) {
-        untrack(id);
-        qCDebug(DQML_LOG) << " - no entry, cancel tracking...";
+    if (e->timerId() == m_rescanTimer) {
+        // Listing a polled root in one go is what polling tries to avoid,
+        // the polls list it a few directories at a time instead
+        foreach (const QString &id, m_set.keys()) {
+            Entry &entry = m_set[id];
+            if (entry.mode == Notify)
+                rescanEntry(id);
+            else if (entry.relistCursor < 0)
+                entry.relistCursor = 0;
+        }
+    } else if (e->timerId() == m_pollTimer) {
+        poll();
+    } else if (e->timerId() == m_manifestTimer) {
+        saveManifest();
+    } else if (e->timerId() == m_coalesceTimer) {
+        killTimer(m_coalesceTimer);
+        m_coalesceTimer = 0;
+        flushChanges();
+    }
+}
+
+void DQmlFileTracker::queueChange(Change::Type type, const QString &id, const QString &path, const QString &file)
+{
+    QString key = id + QLatin1Char('/') + file;
+    QHash<QString, Change>::iterator it = m_pendingChanges.find(key);
+    if (it == m_pendingChanges.end()) {
+        Change c;
+        c.type = type;
+        c.id = id;
+        c.path = path;
+        c.fileName = file;
+        m_pendingChanges.insert(key, c);
+        m_pendingOrder << key;
+    } else {
+        dqml_metrics()->eventsCoalesced->add();
+        if (it->type == Change::Added) {
+            // Added and then removed is nothing at all, added and then
+            // changed is still just added.
+            if (type == Change::Removed)
+                m_pendingChanges.erase(it);
+        } else if (it->type == Change::Removed) {
+            // Removed and then back again is a change
+            it->type = Change::Changed;
+        } else {
+            it->type = type;
+        }
+    }
+
+    if (m_coalesceTimer) {
+        // Restart the quiet period, unless changes have kept coming in for
+        // so long that the set should go out anyway.
+        if (m_coalesceAge.elapsed() >= 10 * m_coalesceInterval)
+            return;
+        killTimer(m_coalesceTimer);
+    } else {
+        m_coalesceAge.start();
+    }
+    m_coalesceTimer = startTimer(m_coalesceInterval);
+}
+
+void DQmlFileTracker::flushChanges()
+{
+    ChangeSet changes;
+    foreach (const QString &key, m_pendingOrder) {
+        QHash<QString, Change>::iterator it = m_pendingChanges.find(key);
+        // A file can appear more than once in the order, if it was added and
+        // removed and then added again, so take it out once delivered.
+        if (it != m_pendingChanges.end()) {
+            changes << it.value();
+            m_pendingChanges.erase(it);
+        }
+    }
+    m_pendingOrder.clear();
+
+    if (!changes.isEmpty()) {
+        qCDebug(DQML_LOG) << "delivering" << changes.size() << "changes";
+        dqml_metrics()->changeSets->add();
+        dqml_metrics()->changeSetSize->record(changes.size());
+        scheduleManifestSave();
+        emit changeSetReady(changes);
+    }
+}
+
+void DQmlFileTracker::scheduleManifestSave()
+{
+    // Writing the manifest is not free on large trees, so let changes settle
+    if (!m_manifestFile.isEmpty() && m_manifestTimer == 0)
+        m_manifestTimer = startTimer(2000);
+}
+
+QStringList DQmlFileTracker::idsFromPath(const QString &path) const
+{
+    return m_dirIds.values(path);
+}
+
+void DQmlFileTracker::watchDirectory(const QString &id, const QString &path)
+{
+    if (m_dirIds.contains(path, id))
         return;
+    bool watched = m_dirIds.contains(path);
+    m_dirIds.insert(path, id);
+    if (watched)
+        return;
+    bool added;
+#ifdef Q_OS_LINUX
+    if (m_inotify)
+        added = m_inotify->addPath(path);
+    else
+#endif
+        added = m_watcher->addPath(path);
+    // Only what's really watched is counted
+    if (added) {
+        m_watchedDirectories.insert(path);
+        dqml_metrics()->watchedDirectories->add();
     }
+}
+
+void DQmlFileTracker::unwatchDirectory(const QString &id, const QString &path)
+{
+    // Another root may still have it
+    if (!m_dirIds.remove(path, id) || m_dirIds.contains(path))
+        return;
+    if (m_watchedDirectories.remove(path))
+        dqml_metrics()->watchedDirectories->add(-1);
+#ifdef Q_OS_LINUX
+    if (m_inotify) {
+        m_inotify->removePath(path);
+        return;
+    }
+#endif
+    m_watcher->removePath(path);
+}
+
+void DQmlFileTracker::watchFile(const QString &path)
+{
+    if (m_fileWatches[path]++ == 0)
+        m_watcher->addPath(path);
+}
+
+void DQmlFileTracker::unwatchFile(const QString &path)
+{
+    QHash<QString, int>::iterator it = m_fileWatches.find(path);
+    if (it == m_fileWatches.end() || --it.value() > 0)
+        return;
+    m_fileWatches.erase(it);
+    m_watcher->removePath(path);
+}
+
+bool DQmlFileTracker::isTrackedFile(const Entry &entry, const QString &dir, const QFileInfo &info)
+{
+    // Names are cheaper to check than types, which may need a stat()
+    return entry.filter.acceptsFile(dir, info.fileName()) && info.isFile();
+}
+
+// Following links could take us in circles, so they are never tracked
+bool DQmlFileTracker::isTrackedDirectory(const Entry &entry, const QString &dir, const QFileInfo &info)
+{
+    return info.isDir() && !info.isSymLink() && entry.filter.acceptsDirectory(dir, info.fileName());
+}
+
+void DQmlFileTracker::insertFile(const QString &id, Entry &entry, int dir, int index, const File &file, bool emitAdded)
+{
+    QString fileName = entry.dirs.at(dir).filePath(file.name);
+    QString absPath = entry.path + QLatin1Char('/') + fileName;
+
+    File f = file;
+    if (m_hashContent)
+        f.state.hash = dqml_hashFile(absPath);
+    entry.dirs[dir].files.insert(index, f);
+    ++entry.fileCount;
 
-    Entry &entry = m_set[id];
-    QDir dir(path);
-    QDirIterator iterator(dir);
-    QHash<QString, quint64> currentContent;
-    while (iterator.hasNext()) {
-        iterator.next();
-        QFileInfo i = iterator.fileInfo();
-        if (i.isFile() && m_suffixes.contains(i.suffix().toLower())) {
-            QString name = i.fileName();
-            quint64 time = i.lastModified().toMSecsSinceEpoch();
-            currentContent[name] = time;
-        }
-    }
-
-    QSet<QString> allPaths = QSet<QString>::fromList(currentContent.keys()).unite(QSet<QString>::fromList(entry.content.keys()));
-    foreach (QString p, allPaths) {
-        bool was = entry.content.contains(p);
-        bool is = currentContent.contains(p);
-        if (was && is) {
-            // If file was there before and is still there, check match the last modified
-            // timestamp and emit fileChange if it has been modified..
-            if (currentContent.value(p) > entry.content.value(p)) {
-                qCDebug(DQML_LOG) << " - changed:" << id << p;
-                emit fileChanged(id, path, p);
-            }
-        } else if (is) {
-            // File is there now, but wasn't before -> added..
-            qCDebug(DQML_LOG) << " - added:" << id << p;
 #ifdef Q_OS_LINUX
-            m_watcher.addPath(QFileInfo(path + QStringLiteral("/") + p).canonicalFilePath());
+    // QFileSystemWatcher does not report content changes through the
+    // directory on Linux, so files need watching too.
+    if (m_watcher && entry.mode == Notify)
+        watchFile(absPath);
 #endif
-            emit fileAdded(id, path, p);
-        } else if (was) {
-            // file was there, but isn't anymore -> removed
-            qCDebug(DQML_LOG) << " - removed:" << id << p;
+    if (emitAdded) {
+        qCDebug(DQML_LOG) << " - added:" << id << fileName;
+        notify(Change::Added, id, entry.path, fileName);
+    } else {
+        qCDebug(DQML_LOG) << " - tracking file" << fileName << f.state.modified;
+    }
+}
+
+void DQmlFileTracker::removeFile(const QString &id, Entry &entry, int dir, int index)
+{
+    Directory &d = entry.dirs[dir];
+    QString fileName = d.filePath(d.files.at(index).name);
+    d.files.remove(index);
+    --entry.fileCount;
+
+    qCDebug(DQML_LOG) << " - removed:" << id << fileName;
 #ifdef Q_OS_LINUX
-            // Need to use absoluteFilePath here as the file is gone and
-            // canonicalFilePath() will return a null string.
-            m_watcher.removePath(QFileInfo(path + QStringLiteral("/") + p).absoluteFilePath());
+    if (m_watcher && entry.mode == Notify)
+        unwatchFile(entry.path + QLatin1Char('/') + fileName);
 #endif
-            emit fileRemoved(id, path, p);
+    notify(Change::Removed, id, entry.path, fileName);
+}
+
+DQmlFileTracker::FileState DQmlFileTracker::fileState(const QFileInfo &info)
+{
+    FileState state;
+    state.modified = info.lastModified().toMSecsSinceEpoch();
+    state.size = info.size();
+    return state;
+}
+
+// Updates 'known' to 'current' and returns true if the file has changed. A
+// file renamed into place by an editor may well have an older timestamp, so
+// any difference counts, but when hashing only a different content does.
+bool DQmlFileTracker::refreshFile(const QString &id, const Entry &entry, const QString &file, FileState *known, FileState current)
+{
+    if (current.modified == known->modified && current.size == known->size)
+        return false;
+
+    if (m_hashContent) {
+        current.hash = dqml_hashFile(entry.path + QLatin1Char('/') + file);
+        if (current.size == known->size && current.hash == known->hash) {
+            qCDebug(DQML_LOG) << " - touched, but not changed:" << id << file;
+            *known = current;
+            return false;
         }
     }
 
-    // use the new content set from now on..
-    entry.content = currentContent;
+    qCDebug(DQML_LOG) << " - changed:" << id << file;
+    *known = current;
+    return true;
 }
 
-void DQmlFileTracker::onFileChange(const QString &path)
+void DQmlFileTracker::notify(Change::Type type, const QString &id, const QString &path, const QString &file)
 {
-    QFileInfo info(path);
-    onDirChange(info.canonicalPath());
+    dqml_metrics()->events->add();
+    switch (type) {
+    case Change::Added: emit fileAdded(id, path, file); break;
+    case Change::Changed: emit fileChanged(id, path, file); break;
+    case Change::Removed: emit fileRemoved(id, path, file); break;
+    }
+    queueChange(type, id, path, file);
 }
 
-DQmlFileTracker::Entry DQmlFileTracker::createEntry(const QFileInfo &info)
+void DQmlFileTracker::updateFile(const QString &id, Entry &entry, const QString &file)
 {
-    Entry e;
-    e.path = info.canonicalFilePath();
-    Q_ASSERT(info.isDir());
-    QDir dir(e.path);
-    QDirIterator iterator(dir);
+    QString dir, name;
+    dqml_splitPath(file, &dir, &name);
+    QFileInfo i(entry.path + QLatin1Char('/') + file);
+
+    if (isTrackedDirectory(entry, dir, i)) {
+        int d = entry.dirIndex.value(dir, -1);
+        int index = d >= 0 ? entry.dirs.at(d).indexOf(name) : -1;
+        if (index >= 0)
+            removeFile(id, entry, d, index);
+        // New directories, including ones moved in from elsewhere, are
+        // scanned in full and everything inside them is reported as added.
+        if (!entry.dirIndex.contains(file))
+            scanDirectory(id, entry, file, true);
+        return;
+    }
+
+    if (entry.dirIndex.contains(file))
+        removeDirectory(id, entry, file);
+
+    int d = entry.dirIndex.value(dir, -1);
+    if (d < 0)
+        return;
+
+    Directory &directory = entry.dirs[d];
+    int index = directory.lowerBound(name);
+    bool known = index < directory.files.size() && directory.files.at(index).name == name;
+    if (isTrackedFile(entry, dir, i)) {
+        File f;
+        f.name = name;
+        f.state = fileState(i);
+        if (!known)
+            insertFile(id, entry, d, index, f, true);
+        else if (refreshFile(id, entry, file, &directory.files[index].state, f.state))
+            notify(Change::Changed, id, entry.path, file);
+    } else if (known) {
+        removeFile(id, entry, d, index);
+    }
+}
+
+int DQmlFileTracker::addDirectory(const QString &id, Entry &entry, const QString &dir)
+{
+    int index = entry.dirs.size();
+    Directory d;
+    d.path = dir;
+    entry.dirs << d;
+    entry.dirIndex.insert(dir, index);
+
+    QString absDir = dqml_absolutePath(entry.path, dir);
+    if (entry.mode == Poll) {
+        // Taken before the listing, so that a change during it is seen
+        entry.dirs[index].modified = dqml_directoryModified(QFileInfo(absDir));
+        entry.dirs[index].listed = QDateTime::currentMSecsSinceEpoch();
+    }
+
+    if (!dir.isEmpty()) {
+        QString parent, name;
+        dqml_splitPath(dir, &parent, &name);
+        QHash<QString, int>::const_iterator it = entry.dirIndex.constFind(parent);
+        if (it != entry.dirIndex.constEnd())
+            entry.dirs[it.value()].subdirs << name;
+    }
+
+    if (entry.mode == Notify)
+        watchDirectory(id, absDir);
+    return index;
+}
+
+void DQmlFileTracker::scanDirectory(const QString &id, Entry &entry, const QString &dir, bool emitAdded,
+                                    const QHash<QString, FileState> *baseline)
+{
+    // Watch before listing so that files created while we scan are not lost
+    int index = addDirectory(id, entry, dir);
+
+    QVector<File> files;
+    QStringList subdirs;
+    QDirIterator iterator(dqml_absolutePath(entry.path, dir), QDir::AllEntries | QDir::NoDotAndDotDot);
     while (iterator.hasNext()) {
         iterator.next();
         QFileInfo i = iterator.fileInfo();
-        if (i.isFile() && m_suffixes.contains(i.suffix().toLower())) {
-            QString name = i.fileName();
-            quint64 time = i.lastModified().toMSecsSinceEpoch();
-            qCDebug(DQML_LOG) << " - tracking file" << name << time;
-            e.content[name] = time;
+        if (isTrackedDirectory(entry, dir, i)) {
+            subdirs << i.fileName();
+        } else if (isTrackedFile(entry, dir, i)) {
+            File f;
+            f.name = i.fileName();
+            f.state = fileState(i);
+            if (m_hashContent) {
+                // Trust the hash from the manifest if the file looks the same
+                const FileState *known = 0;
+                if (baseline) {
+                    QHash<QString, FileState>::const_iterator b = baseline->constFind(dqml_joinPath(dir, f.name));
+                    if (b != baseline->constEnd())
+                        known = &b.value();
+                }
+                if (known && known->hash != 0 && known->size == f.state.size && known->modified == f.state.modified)
+                    f.state.hash = known->hash;
+                else
+                    f.state.hash = dqml_hashFile(i.filePath());
+            }
+            files << f;
+        } else {
+            qCDebug(DQML_LOG) << " - ignoring" << dqml_joinPath(dir, i.fileName());
+        }
+    }
+
+    std::sort(files.begin(), files.end(), dqml_fileLessThan);
+    entry.dirs[index].files = files;
+    entry.fileCount += files.size();
+
+    foreach (const File &f, files) {
+        QString fileName = dqml_joinPath(dir, f.name);
 #ifdef Q_OS_LINUX
-            m_watcher.addPath(i.canonicalFilePath());
+        // QFileSystemWatcher does not report content changes through the
+        // directory on Linux, so files need watching too.
+        if (m_watcher && entry.mode == Notify)
+            watchFile(entry.path + QLatin1Char('/') + fileName);
 #endif
+        if (emitAdded) {
+            qCDebug(DQML_LOG) << " - added:" << id << fileName;
+            notify(Change::Added, id, entry.path, fileName);
         } else {
-            qCDebug(DQML_LOG) << " - ignoring" << i.fileName();
+            qCDebug(DQML_LOG) << " - tracking file" << fileName << f.state.modified;
+        }
+    }
+
+    foreach (const QString &subdir, subdirs)
+        scanDirectory(id, entry, dqml_joinPath(dir, subdir), emitAdded, baseline);
+}
+
+// Brings the directory 'dir' up to date with the file system by merging a
+// sorted listing of it with the sorted files we know about.
+void DQmlFileTracker::syncDirectory(const QString &id, Entry &entry, const QString &dir, bool recursive)
+{
+    QString absDir = dqml_absolutePath(entry.path, dir);
+    QFileInfo dirInfo(absDir);
+    quint64 listed = QDateTime::currentMSecsSinceEpoch();
+    if (!dirInfo.isDir()) {
+        if (dir.isEmpty())
+            qCWarning(DQML_LOG) << "tracked directory was removed" << id << absDir;
+        removeDirectory(id, entry, dir);
+        return;
+    }
+    if (!entry.dirIndex.contains(dir)) {
+        scanDirectory(id, entry, dir, true);
+        return;
+    }
+
+    QVector<File> current;
+    QSet<QString> currentDirs;
+    QDirIterator iterator(absDir, QDir::AllEntries | QDir::NoDotAndDotDot);
+    while (iterator.hasNext()) {
+        iterator.next();
+        QFileInfo i = iterator.fileInfo();
+        if (isTrackedDirectory(entry, dir, i)) {
+            currentDirs << i.fileName();
+        } else if (isTrackedFile(entry, dir, i)) {
+            File f;
+            f.name = i.fileName();
+            f.state = fileState(i);
+            current << f;
+        }
+    }
+    std::sort(current.begin(), current.end(), dqml_fileLessThan);
+
+    int d = entry.dirIndex.value(dir);
+    if (entry.mode == Poll) {
+        entry.dirs[d].modified = dqml_directoryModified(dirInfo);
+        entry.dirs[d].listed = listed;
+    }
+    int known = 0;
+    int i = 0;
+    while (i < current.size() || known < entry.dirs.at(d).files.size()) {
+        const QVector<File> &files = entry.dirs.at(d).files;
+        if (known < files.size() && (i >= current.size() || files.at(known).name < current.at(i).name)) {
+            removeFile(id, entry, d, known);
+        } else if (known >= files.size() || current.at(i).name < files.at(known).name) {
+            insertFile(id, entry, d, known, current.at(i), true);
+            ++known;
+            ++i;
+        } else {
+            QString fileName = dqml_joinPath(dir, current.at(i).name);
+            if (refreshFile(id, entry, fileName, &entry.dirs[d].files[known].state, current.at(i).state))
+                notify(Change::Changed, id, entry.path, fileName);
+            ++known;
+            ++i;
+        }
+    }
+
+    foreach (const QString &subdir, entry.dirs.at(d).subdirs) {
+        if (!currentDirs.contains(subdir))
+            removeDirectory(id, entry, dqml_joinPath(dir, subdir));
+    }
+    foreach (const QString &subdir, currentDirs) {
+        QString path = dqml_joinPath(dir, subdir);
+        if (!entry.dirIndex.contains(path))
+            scanDirectory(id, entry, path, true);
+        else if (recursive)
+            syncDirectory(id, entry, path, true);
+    }
+}
+
+void DQmlFileTracker::removeDirectory(const QString &id, Entry &entry, const QString &dir)
+{
+    QHash<QString, int>::const_iterator it = entry.dirIndex.constFind(dir);
+    if (it == entry.dirIndex.constEnd())
+        return;
+
+    foreach (const QString &subdir, entry.dirs.at(it.value()).subdirs)
+        removeDirectory(id, entry, dqml_joinPath(dir, subdir));
+
+    // Removing the subdirectories may have moved us around
+    int index = entry.dirIndex.value(dir);
+    while (!entry.dirs.at(index).files.isEmpty())
+        removeFile(id, entry, index, entry.dirs.at(index).files.size() - 1);
+
+    if (entry.mode == Notify)
+        unwatchDirectory(id, dqml_absolutePath(entry.path, dir));
+
+    // Move the last directory into the hole to keep the vector packed
+    entry.dirIndex.remove(dir);
+    int last = entry.dirs.size() - 1;
+    if (index != last) {
+        entry.dirs[index] = entry.dirs.at(last);
+        entry.dirIndex[entry.dirs.at(index).path] = index;
+    }
+    entry.dirs.removeLast();
+
+    if (!dir.isEmpty()) {
+        QString parent, name;
+        dqml_splitPath(dir, &parent, &name);
+        QHash<QString, int>::const_iterator p = entry.dirIndex.constFind(parent);
+        if (p != entry.dirIndex.constEnd())
+            entry.dirs[p.value()].subdirs.removeOne(name);
+    }
+}
+
+void DQmlFileTracker::onFilesChanged(const QString &path, const QStringList &names)
+{
+    qCDebug(DQML_LOG) << "change in directory" << path << names;
+    foreach (const QString &id, idsFromPath(path)) {
+        foreach (const QString &name, names) {
+            // A slot connected to one of our signals may have tracked or
+            // untracked something, which moves the entries around
+            QHash<QString, Entry>::iterator it = m_set.find(id);
+            if (it == m_set.end())
+                break;
+            Entry &entry = it.value();
+            QString dir = path.size() > entry.path.size() ? path.mid(entry.path.size() + 1) : QString();
+            updateFile(id, entry, dqml_joinPath(dir, name));
         }
     }
+}
+
+void DQmlFileTracker::onDirChange(const QString &path)
+{
+    qCDebug(DQML_LOG) << "change in directory" << path;
+    QStringList ids = idsFromPath(path);
+    if (ids.isEmpty()) {
+        qCDebug(DQML_LOG) << " - no entry, ignoring...";
+        return;
+    }
+
+    // We don't know what changed, so compare the whole directory
+    foreach (const QString &id, ids) {
+        // A slot connected to one of our signals may have untracked it
+        QHash<QString, Entry>::iterator it = m_set.find(id);
+        if (it == m_set.end())
+            continue;
+        Entry &entry = it.value();
+        QString dir = path.size() > entry.path.size() ? path.mid(entry.path.size() + 1) : QString();
+        syncDirectory(id, entry, dir, false);
+    }
+}
+
+void DQmlFileTracker::onFileChange(const QString &path)
+{
+    QFileInfo info(path);
+    onDirChange(info.absolutePath());
+}
+
+void DQmlFileTracker::rescan()
+{
+    foreach (const QString &id, m_set.keys())
+        rescanEntry(id);
+}
+
+void DQmlFileTracker::rescanEntry(const QString &id)
+{
+    // A slot connected to one of our signals may have untracked it
+    if (!m_set.contains(id))
+        return;
+
+    DQmlScopedTimer timer(dqml_metrics()->rescanUsecs);
+    syncDirectory(id, m_set[id], QString(), true);
+}
+
+void DQmlFileTracker::poll()
+{
+    DQmlScopedTimer timer(dqml_metrics()->pollUsecs);
+    QStringList ids;
+    for (QHash<QString, Entry>::const_iterator it = m_set.constBegin(); it != m_set.constEnd(); ++it) {
+        if (it->mode == Poll)
+            ids << it.key();
+    }
+
+    bool active = false;
+    foreach (const QString &id, ids)
+        active |= pollEntry(id, DQML_POLL_BUDGET / ids.size());
+    updatePollTimer(active);
+}
+
+// Checks directories of a polled root, starting where the last poll stopped,
+// until 'budget' stat() calls are spent. A directory whose timestamp is the
+// same can't have had files added, removed or renamed, so only the files we
+// know in it are stat'ed. Otherwise, or if its timestamp is too close to
+// when it was listed to tell, it is listed again. A rescan in progress
+// lists a few more. Returns true if anything changed.
+bool DQmlFileTracker::pollEntry(const QString &id, int budget)
+{
+    // A slot connected to one of our signals may have untracked it
+    if (!m_set.contains(id))
+        return false;
+
+    Entry &entry = m_set[id];
+    bool active = false;
+
+    for (int relisted = 0; entry.relistCursor >= 0 && relisted < DQML_RELIST_BUDGET && budget > 0; ++relisted) {
+        if (entry.relistCursor >= entry.dirs.size()) {
+            entry.relistCursor = -1;
+            break;
+        }
+        const Directory &d = entry.dirs.at(entry.relistCursor++);
+        budget -= d.files.size() + 1;
+        // Syncing may add or remove directories, d goes with them
+        QString dir = d.path;
+        syncDirectory(id, entry, dir, false);
+        // Untracked by a slot connected to one of our signals
+        if (!m_set.contains(id))
+            return active;
+    }
+
+    int count = entry.dirs.size();
+    for (int visited = 0; visited < count && budget > 0 && !entry.dirs.isEmpty(); ++visited) {
+        if (entry.pollCursor >= entry.dirs.size())
+            entry.pollCursor = 0;
+        const Directory &d = entry.dirs.at(entry.pollCursor++);
+        QString dir = d.path;
+        QString absDir = dqml_absolutePath(entry.path, dir);
+
+        --budget;
+        quint64 modified = dqml_directoryModified(QFileInfo(absDir));
+        if (modified != d.modified) {
+            qCDebug(DQML_LOG) << "polled change in directory" << absDir;
+            budget -= d.files.size();
+            syncDirectory(id, entry, dir, false);
+            active = true;
+            continue;
+        }
+        if (qint64(d.listed - modified) < DQML_TIMESTAMP_GRANULARITY) {
+            budget -= d.files.size();
+            syncDirectory(id, entry, dir, false);
+            continue;
+        }
+
+        budget -= d.files.size();
+        QStringList stale = dqml_staleFiles(absDir, d);
+        foreach (const QString &name, stale)
+            updateFile(id, entry, dqml_joinPath(dir, name));
+        active |= !stale.isEmpty();
+    }
+    return active;
+}
+
+DQmlFileTracker::Entry DQmlFileTracker::createEntry(const QString &id, const QFileInfo &info, const DQmlFileFilter &filter,
+                                                    WatchMode mode, const QHash<QString, FileState> *baseline)
+{
+    Entry e;
+    e.path = info.canonicalFilePath();
+    e.filter = filter;
+    e.mode = mode;
+    Q_ASSERT(info.isDir());
+    DQmlScopedTimer timer(dqml_metrics()->scanUsecs);
+    scanDirectory(id, e, QString(), false, baseline);
     return e;
 }
+
+// Reports the difference between what was just scanned and the state the
+// manifest had for it, so changes made while we weren't running are seen.
+void DQmlFileTracker::compareWithManifest(const QString &id, QHash<QString, FileState> baseline)
+{
+    const Entry &entry = m_set[id];
+    int added = 0;
+    int changed = 0;
+    QList<QPair<Change::Type, QString> > changes;
+    foreach (const Directory &d, entry.dirs) {
+        foreach (const File &f, d.files) {
+            QString fileName = d.filePath(f.name);
+            QHash<QString, FileState>::iterator b = baseline.find(fileName);
+            if (b == baseline.end()) {
+                changes << qMakePair(Change::Added, fileName);
+                ++added;
+                continue;
+            }
+            const FileState &known = b.value();
+            bool same = known.size == f.state.size
+                    && (known.modified == f.state.modified
+                        || (known.hash != 0 && known.hash == f.state.hash));
+            if (!same) {
+                changes << qMakePair(Change::Changed, fileName);
+                ++changed;
+            }
+            baseline.erase(b);
+        }
+    }
+    for (QHash<QString, FileState>::const_iterator it = baseline.constBegin(); it != baseline.constEnd(); ++it)
+        changes << qMakePair(Change::Removed, it.key());
+
+    qCDebug(DQML_LOG) << " - since last run:" << added << "added," << changed << "changed,"
+                      << baseline.size() << "removed";
+
+    QString path = entry.path;
+    for (int i = 0; i < changes.size(); ++i)
+        notify(changes.at(i).first, id, path, changes.at(i).second);
+}
+
+void DQmlFileTracker::setManifestFile(const QString &fileName)
+{
+    m_manifestFile = fileName;
+}
+
+bool DQmlFileTracker::saveManifest()
+{
+    if (m_manifestTimer) {
+        killTimer(m_manifestTimer);
+        m_manifestTimer = 0;
+    }
+    if (m_manifestFile.isEmpty())
+        return false;
+    qCDebug(DQML_LOG) << "saving manifest" << m_manifestFile;
+    return dqml_writeManifest(m_manifestFile, m_set);
+}
@@ -28,50 +28,254 @@
 #define DQMLFILETRACKER_H
 
 #include <dqml/dqmlglobal.h>
+#include <dqml/dqmlfilefilter.h>
 
 #include <QtCore/QObject>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QHash>
 #include <QtCore/QSet>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
 #include <QtCore/QFileInfo>
 #include <QtCore/QFileSystemWatcher>
 
 QT_BEGIN_NAMESPACE
 
+#ifdef Q_OS_LINUX
+class DQmlInotifyWatcher;
+#endif
+
 class DQML_EXPORT DQmlFileTracker : public QObject
 {
     Q_OBJECT
 public:
+    enum WatchMode {
+        // Rely on change notifications, from inotify or QFileSystemWatcher
+        Notify,
+        // Poll with stat(), for NFS, sshfs and other filesystems which
+        // don't deliver change notifications
+        Poll
+    };
+
+    struct FileState {
+        FileState() : modified(0), size(0), hash(0) { }
+        quint64 modified;
+        qint64 size;
+        // Only set when content hashing is enabled
+        quint64 hash;
+    };
+
+    struct File {
+        QString name;
+        FileState state;
+    };
+
+    struct Directory {
+        Directory() : modified(0), listed(0) { }
+
+        // Relative to the tracked root, empty for the root itself
+        QString path;
+        // Timestamp of the directory itself, only kept when polling
+        quint64 modified;
+        // When it was last listed, only kept when polling
+        quint64 listed;
+        // Sorted on name
+        QVector<File> files;
+        QStringList subdirs;
+
+        int lowerBound(const QString &name) const {
+            int low = 0;
+            int high = files.size();
+            while (low < high) {
+                int mid = (low + high) / 2;
+                if (files.at(mid).name < name)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            return low;
+        }
+        int indexOf(const QString &name) const {
+            int i = lowerBound(name);
+            return i < files.size() && files.at(i).name == name ? i : -1;
+        }
+        QString filePath(const QString &name) const {
+            return path.isEmpty() ? name : path + QLatin1Char('/') + name;
+        }
+    };
+
+    // The files of a tracked root, grouped on directory so that each
+    // directory path is stored once rather than once per file.
     struct Entry {
+        Entry() : mode(Notify), fileCount(0), pollCursor(0), relistCursor(-1) { }
+
+        QString path;
+        DQmlFileFilter filter;
+        WatchMode mode;
+        QVector<Directory> dirs;
+        QHash<QString, int> dirIndex;
+        int fileCount;
+        // The directory the next poll starts at
+        int pollCursor;
+        // The directory the rescan of a polled root continues at, -1 when
+        // it's not rescanning
+        int relistCursor;
+
+        const Directory *directory(const QString &dir) const {
+            QHash<QString, int>::const_iterator it = dirIndex.constFind(dir);
+            return it != dirIndex.constEnd() ? &dirs.at(it.value()) : 0;
+        }
+        // 'fileName' is relative to 'path', like "images/icon.png"
+        const File *file(const QString &fileName) const {
+            int slash = fileName.lastIndexOf(QLatin1Char('/'));
+            const Directory *d = directory(slash < 0 ? QString() : fileName.left(slash));
+            if (!d)
+                return 0;
+            int i = d->indexOf(fileName.mid(slash + 1));
+            return i >= 0 ? &d->files.at(i) : 0;
+        }
+    };
+
+    struct Change {
+        enum Type { Added, Changed, Removed };
+        Type type;
+        QString id;
         QString path;
-        QHash<QString, quint64> content;
+        QString fileName;
     };
+    typedef QList<Change> ChangeSet;
 
     explicit DQmlFileTracker(QObject *parent = Q_NULLPTR);
+    ~DQmlFileTracker();
 
-    QHash<QString, Entry> trackingSet() const;
+    const QHash<QString, Entry> &trackingSet() const { return m_set; }
 
-    bool track(const QString &id, const QString &path);
+    // Tracks 'path' and everything below it which passes the rules of the
+    // .dqmlignore file in 'path', if any, followed by 'rules'.
+    bool track(const QString &id, const QString &path, const QStringList &rules = QStringList(),
+               WatchMode mode = Notify);
     bool untrack(const QString &id);
 
+    // Interval of the full rescan which catches anything the change
+    // notifications missed. 0 disables it.
+    void setRescanInterval(int msecs);
+    int rescanInterval() const { return m_rescanInterval; }
+
+    // Polled roots are checked every 'minimum' msecs after something has
+    // changed, backing off to every 'maximum' msecs while nothing does.
+    // Each poll stats a bounded number of files, so on large trees it can
+    // take several polls to get around.
+    void setPollInterval(int minimum, int maximum);
+    int minimumPollInterval() const { return m_minPollInterval; }
+    int maximumPollInterval() const { return m_maxPollInterval; }
+
+    // When enabled, a file with a new timestamp is only reported as changed
+    // if its content is different too. Touching files is then harmless.
+    void setContentHashing(bool enabled) { m_hashContent = enabled; }
+    bool contentHashing() const { return m_hashContent; }
+
+    // Changes are collected until nothing has happened for 'msecs' and then
+    // delivered as one changeSetReady(). Adding and removing the same file
+    // in one set cancel out.
+    void setCoalesceInterval(int msecs) { m_coalesceInterval = msecs; }
+    int coalesceInterval() const { return m_coalesceInterval; }
+
+    // Keeps the state of all tracked files in 'fileName'. When set before
+    // track(), files are compared against the state saved by the previous
+    // run and whatever changed in between is reported.
+    void setManifestFile(const QString &fileName);
+    QString manifestFile() const { return m_manifestFile; }
+
+public Q_SLOTS:
+    void rescan();
+    bool saveManifest();
+
 Q_SIGNALS:
     void fileChanged(const QString &id, const QString &path, const QString &fileName);
     void fileAdded(const QString &id, const QString &path, const QString &fileName);
     void fileRemoved(const QString &id, const QString &path, const QString &fileName);
+    void changeSetReady(const DQmlFileTracker::ChangeSet &changes);
+
+protected:
+    void timerEvent(QTimerEvent *e);
 
 private Q_SLOTS:
     void onDirChange(const QString &);
     void onFileChange(const QString &);
+    void onFilesChanged(const QString &dir, const QStringList &names);
 
 private:
-    Entry createEntry(const QFileInfo &info);
-    QString idFromPath(const QString &path) const;
+    Entry createEntry(const QString &id, const QFileInfo &info, const DQmlFileFilter &filter, WatchMode mode,
+                      const QHash<QString, FileState> *baseline = 0);
+    void compareWithManifest(const QString &id, QHash<QString, FileState> baseline);
+    void scheduleManifestSave();
+    QStringList idsFromPath(const QString &path) const;
+
+    void rescanEntry(const QString &id);
+    void poll();
+    bool pollEntry(const QString &id, int budget);
+    void updatePollTimer(bool active);
+    int addDirectory(const QString &id, Entry &entry, const QString &dir);
+    void scanDirectory(const QString &id, Entry &entry, const QString &dir, bool emitAdded,
+                       const QHash<QString, FileState> *baseline = 0);
+    void syncDirectory(const QString &id, Entry &entry, const QString &dir, bool recursive);
+    void removeDirectory(const QString &id, Entry &entry, const QString &dir);
+    void updateFile(const QString &id, Entry &entry, const QString &file);
+    void insertFile(const QString &id, Entry &entry, int dir, int index, const File &file, bool emitAdded);
+    void removeFile(const QString &id, Entry &entry, int dir, int index);
+    bool refreshFile(const QString &id, const Entry &entry, const QString &file, FileState *known, FileState current);
+    void notify(Change::Type type, const QString &id, const QString &path, const QString &file);
+    static bool isTrackedFile(const Entry &entry, const QString &dir, const QFileInfo &info);
+    static bool isTrackedDirectory(const Entry &entry, const QString &dir, const QFileInfo &info);
+    static FileState fileState(const QFileInfo &info);
+
+    void queueChange(Change::Type type, const QString &id, const QString &path, const QString &file);
+    void flushChanges();
+
+    void watchDirectory(const QString &id, const QString &path);
+    void unwatchDirectory(const QString &id, const QString &path);
+    void watchFile(const QString &path);
+    void unwatchFile(const QString &path);
 
     QHash<QString, Entry> m_set;
-    QSet<QString> m_suffixes;
+    // Absolute directory path to the ids of the roots it belongs to, more
+    // than one when roots overlap, like "." and "./qml". The directory is
+    // watched while any of them has it.
+    QMultiHash<QString, QString> m_dirIds;
+    // The directories the watcher accepted, which the metrics count
+    QSet<QString> m_watchedDirectories;
+    // How many roots want each file watched by m_watcher
+    QHash<QString, int> m_fileWatches;
+
+    int m_rescanInterval;
+    int m_rescanTimer;
+
+    int m_minPollInterval;
+    int m_maxPollInterval;
+    int m_pollInterval;
+    int m_pollTimer;
+    bool m_hashContent;
 
-    QFileSystemWatcher m_watcher;
+    QHash<QString, Change> m_pendingChanges;
+    QStringList m_pendingOrder;
+    QElapsedTimer m_coalesceAge;
+    int m_coalesceInterval;
+    int m_coalesceTimer;
+
+    QString m_manifestFile;
+    int m_manifestTimer;
+
+    QFileSystemWatcher *m_watcher;
+#ifdef Q_OS_LINUX
+    DQmlInotifyWatcher *m_inotify;
+#endif
 };
 
+Q_DECLARE_TYPEINFO(DQmlFileTracker::File, Q_MOVABLE_TYPE);
+Q_DECLARE_TYPEINFO(DQmlFileTracker::Directory, Q_MOVABLE_TYPE);
+
 QT_END_NAMESPACE
 
+Q_DECLARE_METATYPE(DQmlFileTracker::ChangeSet)
+
 #endif // DQMLFILETRACKER_H
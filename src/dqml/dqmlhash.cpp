@@ -0,0 +1,152 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlhash_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/qendian.h>
+
+#include <string.h>
+
+static const quint64 PRIME64_1 = Q_UINT64_C(11400714785074694791);
+static const quint64 PRIME64_2 = Q_UINT64_C(14029467366897019727);
+static const quint64 PRIME64_3 = Q_UINT64_C(1609587929392839161);
+static const quint64 PRIME64_4 = Q_UINT64_C(9650029242287828579);
+static const quint64 PRIME64_5 = Q_UINT64_C(2870177450012600261);
+
+static inline quint64 dqml_rotl64(quint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline quint64 dqml_read64(const uchar *p)
+{
+    quint64 v;
+    memcpy(&v, p, sizeof(v));
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    v = qbswap(v);
+#endif
+    return v;
+}
+
+static inline quint32 dqml_read32(const uchar *p)
+{
+    quint32 v;
+    memcpy(&v, p, sizeof(v));
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    v = qbswap(v);
+#endif
+    return v;
+}
+
+static inline quint64 dqml_round(quint64 acc, quint64 input)
+{
+    acc += input * PRIME64_2;
+    acc = dqml_rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline quint64 dqml_mergeRound(quint64 acc, quint64 val)
+{
+    acc ^= dqml_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+quint64 dqml_hash(const char *data, qint64 length, quint64 seed)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(data);
+    const uchar *end = p + length;
+    quint64 h;
+
+    if (length >= 32) {
+        const uchar *limit = end - 32;
+        quint64 v1 = seed + PRIME64_1 + PRIME64_2;
+        quint64 v2 = seed + PRIME64_2;
+        quint64 v3 = seed;
+        quint64 v4 = seed - PRIME64_1;
+        do {
+            v1 = dqml_round(v1, dqml_read64(p));
+            v2 = dqml_round(v2, dqml_read64(p + 8));
+            v3 = dqml_round(v3, dqml_read64(p + 16));
+            v4 = dqml_round(v4, dqml_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = dqml_rotl64(v1, 1) + dqml_rotl64(v2, 7) + dqml_rotl64(v3, 12) + dqml_rotl64(v4, 18);
+        h = dqml_mergeRound(h, v1);
+        h = dqml_mergeRound(h, v2);
+        h = dqml_mergeRound(h, v3);
+        h = dqml_mergeRound(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += quint64(length);
+
+    while (p + 8 <= end) {
+        h ^= dqml_round(0, dqml_read64(p));
+        h = dqml_rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= quint64(dqml_read32(p)) * PRIME64_1;
+        h = dqml_rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = dqml_rotl64(h, 11) * PRIME64_1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+quint64 dqml_hashFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return 0;
+    qint64 size = file.size();
+    if (size == 0)
+        return dqml_hash(0, 0);
+
+    // Mapping the file saves copying it through a buffer
+    uchar *mapped = file.map(0, size);
+    if (mapped) {
+        quint64 h = dqml_hash(reinterpret_cast<const char *>(mapped), size);
+        file.unmap(mapped);
+        return h;
+    }
+
+    QByteArray content = file.readAll();
+    return dqml_hash(content.constData(), content.size());
+}
@@ -0,0 +1,165 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlinotifywatcher_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QSet>
+#include <QtCore/QSocketNotifier>
+
+#include <sys/inotify.h>
+#include <errno.h>
+#include <unistd.h>
+
+static const uint DQML_INOTIFY_MASK = IN_CREATE
+                                    | IN_DELETE
+                                    | IN_MOVED_FROM
+                                    | IN_MOVED_TO
+                                    | IN_CLOSE_WRITE
+                                    | IN_ATTRIB
+                                    | IN_DELETE_SELF
+                                    | IN_MOVE_SELF
+                                    | IN_ONLYDIR
+                                    | IN_EXCL_UNLINK;
+
+DQmlInotifyWatcher::DQmlInotifyWatcher(QObject *parent)
+    : QObject(parent)
+    , m_fd(-1)
+    , m_notifier(0)
+{
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) {
+        qCWarning(DQML_LOG) << "inotify_init1 failed, errno:" << errno;
+        return;
+    }
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+}
+
+DQmlInotifyWatcher::~DQmlInotifyWatcher()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+bool DQmlInotifyWatcher::addPath(const QString &path)
+{
+    if (m_fd < 0 || m_descriptors.contains(path))
+        return false;
+    int wd = inotify_add_watch(m_fd, QFile::encodeName(path).constData(), DQML_INOTIFY_MASK);
+    if (wd < 0) {
+        qCWarning(DQML_LOG) << "failed to watch" << path << "errno:" << errno;
+        return false;
+    }
+    // The same directory reached through another path gives the same
+    // descriptor. It was either moved, between two watched parents say, and
+    // the new path may be added before the old one is removed, or it's
+    // reachable through both. Report it under the new path, and only drop
+    // the watch once neither path wants it.
+    m_paths.insert(wd, path);
+    m_descriptors.insert(path, wd);
+    return true;
+}
+
+bool DQmlInotifyWatcher::removePath(const QString &path)
+{
+    QHash<QString, int>::iterator it = m_descriptors.find(path);
+    if (it == m_descriptors.end())
+        return false;
+    int wd = it.value();
+    m_descriptors.erase(it);
+    QString other = m_descriptors.key(wd);
+    if (!other.isEmpty()) {
+        m_paths.insert(wd, other);
+        return true;
+    }
+    m_paths.remove(wd);
+    inotify_rm_watch(m_fd, wd);
+    return true;
+}
+
+void DQmlInotifyWatcher::readEvents()
+{
+    // Collect the events of one wakeup so that a file which gets many events
+    // in one go, like a 'git checkout', is only reported once.
+    QHash<QString, QSet<QString> > changed;
+    QSet<QString> dirty;
+    bool overflowed = false;
+
+    char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t size = ::read(m_fd, buffer, sizeof(buffer));
+        if (size <= 0)
+            break;
+        const char *ptr = buffer;
+        const char *end = buffer + size;
+        while (ptr < end) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+                continue;
+            }
+
+            QString path = m_paths.value(event->wd);
+            if (path.isEmpty())
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                // The watch is gone, either because the directory was removed
+                // or because we removed it ourselves.
+                m_paths.remove(event->wd);
+                QString alias = path;
+                do {
+                    m_descriptors.remove(alias);
+                    dirty << alias;
+                    alias = m_descriptors.key(event->wd);
+                } while (!alias.isEmpty());
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                dirty << path;
+            } else if (event->len > 0) {
+                changed[path] << QFile::decodeName(event->name);
+            }
+        }
+    }
+
+    if (overflowed) {
+        qCDebug(DQML_LOG) << "inotify queue overflow";
+        emit overflow();
+        return;
+    }
+
+    foreach (const QString &path, dirty) {
+        changed.remove(path);
+        emit directoryChanged(path);
+    }
+
+    for (QHash<QString, QSet<QString> >::const_iterator it = changed.constBegin();
+         it != changed.constEnd(); ++it) {
+        emit filesChanged(it.key(), it.value().toList());
+    }
+}
@@ -0,0 +1,78 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLINOTIFYWATCHER_P_H
+#define DQMLINOTIFYWATCHER_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QObject>
+#include <QtCore/QHash>
+
+QT_BEGIN_NAMESPACE
+
+class QSocketNotifier;
+
+// Watches directories through a single inotify descriptor. Only directories
+// are watched, files are reported through the events of their parent, which
+// means that editors saving through "write temp + rename" are seen as a
+// change in the directory rather than a lost watch on the old inode.
+class DQmlInotifyWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DQmlInotifyWatcher(QObject *parent = 0);
+    ~DQmlInotifyWatcher();
+
+    bool isValid() const { return m_fd >= 0; }
+
+    bool addPath(const QString &path);
+    bool removePath(const QString &path);
+
+Q_SIGNALS:
+    // Entries named 'names' inside 'path' were created, removed, renamed or written
+    void filesChanged(const QString &path, const QStringList &names);
+    // 'path' itself was removed or moved and needs to be looked at as a whole
+    void directoryChanged(const QString &path);
+    // Events were lost, everything needs to be looked at
+    void overflow();
+
+private Q_SLOTS:
+    void readEvents();
+
+private:
+    int m_fd;
+    QSocketNotifier *m_notifier;
+
+    // Events are reported under the path a descriptor was last added with,
+    // all paths which were added for it keep it
+    QHash<int, QString> m_paths;
+    QHash<QString, int> m_descriptors;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLINOTIFYWATCHER_P_H
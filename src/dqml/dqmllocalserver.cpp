@@ -29,7 +29,5 @@
 DQmlLocalServer::DQmlLocalServer(QQmlEngine *engine, QQuickView *view, const QString &file)
     : DQmlServer(engine, view, file)
 {
-    connect(&m_tracker, SIGNAL(fileAdded(QString,QString,QString)), this, SLOT(reloadQml()));
-    connect(&m_tracker, SIGNAL(fileRemoved(QString,QString,QString)), this, SLOT(reloadQml()));
-    connect(&m_tracker, SIGNAL(fileChanged(QString,QString,QString)), this, SLOT(reloadQml()));
+    connect(&m_tracker, SIGNAL(changeSetReady(DQmlFileTracker::ChangeSet)), this, SLOT(reloadQml()));
 }
@@ -0,0 +1,163 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlmanifest_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QSaveFile>
+#include <QtCore/qendian.h>
+
+#include <string.h>
+
+static const char dqml_manifestMagic[4] = { 'D', 'Q', 'M', 'M' };
+static const quint32 dqml_manifestVersion = 1;
+
+static inline void dqml_append32(QByteArray *data, quint32 value)
+{
+    value = qToLittleEndian(value);
+    data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static inline void dqml_append64(QByteArray *data, quint64 value)
+{
+    value = qToLittleEndian(value);
+    data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static inline void dqml_appendPadded(QByteArray *data, const QByteArray &bytes)
+{
+    data->append(bytes);
+    while (data->size() % 8)
+        data->append('\0');
+}
+
+static inline int dqml_padded(int size)
+{
+    return (size + 7) & ~7;
+}
+
+bool dqml_writeManifest(const QString &fileName, const QHash<QString, DQmlFileTracker::Entry> &set)
+{
+    QByteArray data;
+    data.append(dqml_manifestMagic, sizeof(dqml_manifestMagic));
+    dqml_append32(&data, dqml_manifestVersion);
+    dqml_append32(&data, set.size());
+    dqml_append32(&data, 0);
+
+    for (QHash<QString, DQmlFileTracker::Entry>::const_iterator it = set.constBegin();
+         it != set.constEnd(); ++it) {
+        const DQmlFileTracker::Entry &e = it.value();
+        QByteArray id = it.key().toUtf8();
+        QByteArray path = e.path.toUtf8();
+        dqml_append32(&data, id.size());
+        dqml_append32(&data, path.size());
+        dqml_append32(&data, e.fileCount);
+        dqml_append32(&data, 0);
+        dqml_appendPadded(&data, id + path);
+
+        foreach (const DQmlFileTracker::Directory &d, e.dirs) {
+            foreach (const DQmlFileTracker::File &f, d.files) {
+                QByteArray name = d.filePath(f.name).toUtf8();
+                dqml_append64(&data, f.state.modified);
+                dqml_append64(&data, f.state.size);
+                dqml_append64(&data, f.state.hash);
+                dqml_append32(&data, name.size());
+                dqml_append32(&data, 0);
+                dqml_appendPadded(&data, name);
+            }
+        }
+    }
+
+    QSaveFile file(fileName);
+    if (!file.open(QFile::WriteOnly)) {
+        qCWarning(DQML_LOG) << "failed to write manifest" << fileName << file.errorString();
+        return false;
+    }
+    file.write(data);
+    return file.commit();
+}
+
+bool dqml_readManifest(const QString &fileName, const QString &id, const QString &path,
+                       QHash<QString, DQmlFileTracker::FileState> *states)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    qint64 size = file.size();
+    if (size < 16)
+        return false;
+    const uchar *data = file.map(0, size);
+    QByteArray buffer;
+    if (!data) {
+        buffer = file.readAll();
+        data = reinterpret_cast<const uchar *>(buffer.constData());
+    }
+    const uchar *end = data + size;
+
+    bool found = false;
+    const uchar *p = data;
+    if (memcmp(p, dqml_manifestMagic, sizeof(dqml_manifestMagic)) != 0
+            || qFromLittleEndian<quint32>(p + 4) != dqml_manifestVersion) {
+        qCDebug(DQML_LOG) << "ignoring manifest of unknown format" << fileName;
+        return false;
+    }
+    quint32 rootCount = qFromLittleEndian<quint32>(p + 8);
+    p += 16;
+
+    for (quint32 r = 0; r < rootCount && !found; ++r) {
+        if (end - p < 16)
+            break;
+        quint32 idSize = qFromLittleEndian<quint32>(p);
+        quint32 pathSize = qFromLittleEndian<quint32>(p + 4);
+        quint32 fileCount = qFromLittleEndian<quint32>(p + 8);
+        p += 16;
+        if (quint64(end - p) < quint64(idSize) + pathSize)
+            break;
+        bool match = QString::fromUtf8(reinterpret_cast<const char *>(p), idSize) == id
+                && QString::fromUtf8(reinterpret_cast<const char *>(p + idSize), pathSize) == path;
+        p += dqml_padded(idSize + pathSize);
+
+        for (quint32 i = 0; i < fileCount; ++i) {
+            if (end - p < 32)
+                return found;
+            quint32 nameSize = qFromLittleEndian<quint32>(p + 24);
+            if (match) {
+                if (quint64(end - p - 32) < nameSize)
+                    return false;
+                DQmlFileTracker::FileState state;
+                state.modified = qFromLittleEndian<quint64>(p);
+                state.size = qFromLittleEndian<qint64>(p + 8);
+                state.hash = qFromLittleEndian<quint64>(p + 16);
+                states->insert(QString::fromUtf8(reinterpret_cast<const char *>(p + 32), nameSize), state);
+            }
+            p += 32 + dqml_padded(nameSize);
+        }
+        found = match;
+    }
+
+    return found;
+}
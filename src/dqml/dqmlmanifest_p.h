@@ -0,0 +1,55 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLMANIFEST_P_H
+#define DQMLMANIFEST_P_H
+
+#include <dqml/dqmlglobal.h>
+#include <dqml/dqmlfiletracker.h>
+
+QT_BEGIN_NAMESPACE
+
+// The manifest stores the state of every tracked file so that a restarted
+// tracker can tell what changed while it wasn't running. The format is laid
+// out to be read straight out of a memory mapping: a header followed by one
+// record per root and one per file, all little endian and 8-byte aligned.
+//
+//   header: "DQMM", quint32 version, quint32 root count, quint32 reserved
+//   root:   quint32 id size, quint32 path size, quint32 file count,
+//           quint32 reserved, UTF-8 id, UTF-8 path, padding
+//   file:   quint64 modified, qint64 size, quint64 hash, quint32 name size,
+//           quint32 reserved, UTF-8 name relative to the root, padding
+
+bool dqml_writeManifest(const QString &fileName, const QHash<QString, DQmlFileTracker::Entry> &set);
+
+// Reads the states of the files below 'path' stored under 'id'. Returns
+// false if the manifest can't be read or doesn't know 'id' at 'path'.
+bool dqml_readManifest(const QString &fileName, const QString &id, const QString &path,
+                       QHash<QString, DQmlFileTracker::FileState> *states);
+
+QT_END_NAMESPACE
+
+#endif // DQMLMANIFEST_P_H
@@ -0,0 +1,138 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlmetrics.h"
+
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+
+DQmlHistogram::DQmlHistogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{
+    for (int i = 0; i < BucketCount; ++i)
+        m_buckets[i].store(0);
+}
+
+void DQmlHistogram::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+    int bucket = 0;
+    while (bucket < BucketCount - 1 && (quint64(value) >> bucket) != 0)
+        ++bucket;
+    m_buckets[bucket].fetchAndAddRelaxed(1);
+    m_count.fetchAndAddRelaxed(1);
+    m_sum.fetchAndAddRelaxed(value);
+
+    qint64 max = m_max.load();
+    while (value > max && !m_max.testAndSetRelaxed(max, value, max)) { }
+}
+
+qint64 DQmlHistogram::percentile(double fraction) const
+{
+    qint64 count = m_count.load();
+    if (count == 0)
+        return 0;
+    qint64 wanted = qMax<qint64>(1, qint64(count * fraction + 0.5));
+    qint64 seen = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        seen += m_buckets[i].load();
+        if (seen >= wanted)
+            return qMin(qint64((Q_UINT64_C(1) << i) - 1), m_max.load());
+    }
+    return m_max.load();
+}
+
+DQmlMetrics *DQmlMetrics::instance()
+{
+    static DQmlMetrics metrics;
+    return &metrics;
+}
+
+DQmlMetrics::DQmlMetrics()
+{
+}
+
+DQmlMetrics::~DQmlMetrics()
+{
+    qDeleteAll(m_counters);
+    qDeleteAll(m_histograms);
+}
+
+DQmlCounter *DQmlMetrics::counter(const QString &name)
+{
+    QMutexLocker lock(&m_mutex);
+    DQmlCounter *&c = m_counters[name];
+    if (!c)
+        c = new DQmlCounter();
+    return c;
+}
+
+DQmlHistogram *DQmlMetrics::histogram(const QString &name)
+{
+    QMutexLocker lock(&m_mutex);
+    DQmlHistogram *&h = m_histograms[name];
+    if (!h)
+        h = new DQmlHistogram();
+    return h;
+}
+
+QByteArray DQmlMetrics::toJson() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    QJsonObject counters;
+    for (QHash<QString, DQmlCounter *>::const_iterator it = m_counters.constBegin();
+         it != m_counters.constEnd(); ++it) {
+        counters.insert(it.key(), double(it.value()->value()));
+    }
+
+    QJsonObject histograms;
+    for (QHash<QString, DQmlHistogram *>::const_iterator it = m_histograms.constBegin();
+         it != m_histograms.constEnd(); ++it) {
+        const DQmlHistogram *h = it.value();
+        QJsonObject o;
+        o.insert(QStringLiteral("count"), double(h->count()));
+        o.insert(QStringLiteral("sum"), double(h->sum()));
+        o.insert(QStringLiteral("mean"), h->count() ? double(h->sum()) / h->count() : 0.0);
+        o.insert(QStringLiteral("p50"), double(h->percentile(0.5)));
+        o.insert(QStringLiteral("p99"), double(h->percentile(0.99)));
+        o.insert(QStringLiteral("max"), double(h->max()));
+        histograms.insert(it.key(), o);
+    }
+
+    QJsonObject root;
+    root.insert(QStringLiteral("counters"), counters);
+    root.insert(QStringLiteral("histograms"), histograms);
+    return QJsonDocument(root).toJson();
+}
+
+void DQmlMetrics::dump()
+{
+    emit dumped(toJson());
+}
@@ -0,0 +1,123 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLMETRICS_H
+#define DQMLMETRICS_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+
+QT_BEGIN_NAMESPACE
+
+// A value which only goes through atomic adds, so it can be bumped from any
+// thread without taking a lock.
+class DQML_EXPORT DQmlCounter
+{
+public:
+    DQmlCounter() : m_value(0) { }
+
+    void add(qint64 delta = 1) { m_value.fetchAndAddRelaxed(delta); }
+    qint64 value() const { return m_value.load(); }
+
+private:
+    QAtomicInteger<qint64> m_value;
+};
+
+// Counts values into power of two buckets, bucket i holding the values
+// from 2^(i-1) up to 2^i. Percentiles are estimated from the buckets, which
+// is as precise as timings need to be.
+class DQML_EXPORT DQmlHistogram
+{
+public:
+    enum { BucketCount = 64 };
+
+    DQmlHistogram();
+
+    void record(qint64 value);
+
+    qint64 count() const { return m_count.load(); }
+    qint64 sum() const { return m_sum.load(); }
+    qint64 max() const { return m_max.load(); }
+    // Upper bound of the bucket holding the given fraction of all values
+    qint64 percentile(double fraction) const;
+
+private:
+    QAtomicInteger<qint64> m_buckets[BucketCount];
+    QAtomicInteger<qint64> m_count;
+    QAtomicInteger<qint64> m_sum;
+    QAtomicInteger<qint64> m_max;
+};
+
+// Records the time from construction to destruction, in microseconds
+class DQmlScopedTimer
+{
+public:
+    explicit DQmlScopedTimer(DQmlHistogram *histogram) : m_histogram(histogram) { m_timer.start(); }
+    ~DQmlScopedTimer() { m_histogram->record(m_timer.nsecsElapsed() / 1000); }
+
+private:
+    DQmlHistogram *m_histogram;
+    QElapsedTimer m_timer;
+};
+
+// The registry of all counters and histograms in the process. Looking a
+// metric up takes a lock, so hot paths do that once and keep the pointer,
+// which stays valid for the lifetime of the process. Updating it is
+// lock free.
+class DQML_EXPORT DQmlMetrics : public QObject
+{
+    Q_OBJECT
+public:
+    static DQmlMetrics *instance();
+
+    DQmlCounter *counter(const QString &name);
+    DQmlHistogram *histogram(const QString &name);
+
+    QByteArray toJson() const;
+
+public Q_SLOTS:
+    void dump();
+
+Q_SIGNALS:
+    void dumped(const QByteArray &json);
+
+private:
+    DQmlMetrics();
+    ~DQmlMetrics();
+
+    mutable QMutex m_mutex;
+    QHash<QString, DQmlCounter *> m_counters;
+    QHash<QString, DQmlHistogram *> m_histograms;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLMETRICS_H
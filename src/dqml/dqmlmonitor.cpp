@@ -26,155 +26,414 @@
 
 #include "dqmlmonitor.h"
 #include "dqmlfiletracker.h"
+#include "dqmlcodec.h"
+#include "dqmlmetrics.h"
+#include "dqmlmonitortarget_p.h"
+#include "dqmlprotocol_p.h"
+#include "dqmlreadjob_p.h"
 
-#include <QtCore/QTimerEvent>
-#include <QtCore/QDataStream>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
 
-#include <QtNetwork/QHostAddress>
-#include <QtNetwork/QTcpSocket>
+struct DQmlMonitorMetrics
+{
+    DQmlMonitorMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        filesSkippedBySync = m->counter(QStringLiteral("monitor.filesSkippedBySync"));
+        sharedReads = m->counter(QStringLiteral("monitor.sharedReads"));
+        readQueueDepth = m->histogram(QStringLiteral("monitor.readQueueDepth"));
+    }
+
+    DQmlCounter *filesSkippedBySync;
+    DQmlCounter *sharedReads;
+    DQmlHistogram *readQueueDepth;
+};
+
+// Smaller files are cheaper to send than to diff
+static const int DQML_DELTA_MIN_SIZE = 4096;
+
+// The most memory spent on keeping sent files around for deltas
+static const int DQML_SENT_CONTENT_COST = 32 * 1024 * 1024;
+
+Q_GLOBAL_STATIC(DQmlMonitorMetrics, dqml_metrics)
 
 DQmlMonitor::DQmlMonitor()
-    : m_socket(0)
-    , m_port(0)
-    , m_connected(false)
-    , m_connectTimer(0)
-    , m_syncAll(false)
+    : m_syncAll(false)
+    , m_compressionLevel(-1)
+    , m_compressionThreshold(512)
+    , m_sentContent(DQML_SENT_CONTENT_COST)
+    , m_nextSequence(0)
+    , m_nextToRelease(0)
+    , m_streamThreshold(1024 * 1024)
+    , m_sharedMemorySize(0)
 {
+    m_clock.start();
+
+    // Reading is mostly waiting on the disk, but hashing and compressing
+    // are not, so don't go beyond the cores we have
+    m_readPool = new QThreadPool(this);
+    m_readPool->setMaxThreadCount(qBound(1, QThread::idealThreadCount(), 4));
+
+    QList<QByteArray> codecs = DQmlCodec::codecNames();
+    if (!codecs.isEmpty())
+        m_preferredCodec = codecs.first();
+
     m_tracker = new DQmlFileTracker(this);
-    connect(m_tracker, SIGNAL(fileAdded(QString,QString,QString)), this, SLOT(fileWasAdded(QString,QString,QString)));
-    connect(m_tracker, SIGNAL(fileRemoved(QString,QString,QString)), this, SLOT(fileWasRemoved(QString,QString,QString)));
-    connect(m_tracker, SIGNAL(fileChanged(QString,QString,QString)), this, SLOT(fileWasChanged(QString,QString,QString)));
+    connect(m_tracker, SIGNAL(changeSetReady(DQmlFileTracker::ChangeSet)), this, SLOT(changeSetReceived(DQmlFileTracker::ChangeSet)));
 }
 
 DQmlMonitor::~DQmlMonitor()
 {
-    if (m_socket) {
-        m_socket->close();
-        delete m_socket;
-    }
+    qDeleteAll(m_targets);
+    m_readPool->waitForDone();
+    qDeleteAll(m_waitingReads);
+    qDeleteAll(m_reading);
+    qDeleteAll(m_readDone);
 }
 
 void DQmlMonitor::connectToServer(const QString &host, quint16 port)
 {
-    if (m_socket)
-        delete m_socket;
-
-    m_host = host;
-    m_port = port;
-
-    qCDebug(DQML_LOG) << "Connecting to: " << host << ":" << port;
-    m_socket = new QTcpSocket();
-
-    connect(m_socket, SIGNAL(connected()), this, SLOT(socketConnected()));
-    connect(m_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
-    connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+    addTarget(host, port, false);
+}
 
-    m_connected = false;
-    m_socket->connectToHost(QHostAddress(host), port, QTcpSocket::WriteOnly);
+void DQmlMonitor::connectToLocalServer(const QString &name)
+{
+    addTarget(name, 0, true);
 }
 
-QByteArray fileContent(const QString &path)
+void DQmlMonitor::addTarget(const QString &host, quint16 port, bool local)
 {
-    QFile file(path);
-    if (!file.open(QFile::ReadOnly)) {
-        qWarning() << "failed to read file" << path;
-        return QByteArray();
+    foreach (DQmlMonitorTarget *target, m_targets) {
+        if (target->host() == host && target->port() == port && target->isLocal() == local)
+            return;
     }
-    return file.readAll();
+    DQmlMonitorTarget *target = new DQmlMonitorTarget(this, host, port, local);
+    m_targets << target;
+    target->connectToServer();
 }
 
-void DQmlMonitor::writeEvent(EventType type, const QString &id, const QString &path, const QString &file)
+void DQmlMonitor::writeEvent(EventType type, const QString &id, const QString &path, const QString &file,
+                             DQmlMonitorTarget *target, quint64 unlessHash)
 {
     // If we're not supposed to be connected, don't try to write..
-    if (!m_socket)
+    if (m_targets.isEmpty())
         return;
 
-    if (m_connected) {
-        {
-            QDataStream stream(m_socket);
-            stream << type << id << file;
-            if (type != RemoveEvent) {
-                QByteArray content = fileContent(path + QStringLiteral("/") + file);
-                stream << content.size();
-                stream.writeRawData(content.constData(), content.size());
-            }
-        }
-        m_socket->flush();
+    // A server which isn't there doesn't need to know where changesets
+    // begin and end, its journal is replayed as one
+    bool marker = type == BeginEvent || type == CommitEvent;
 
-        qCDebug(DQML_LOG) << " -> event written to server";
+    // Rather than a frame which names another file
+    if (!marker && !dqml_fitsFrame(id, file)) {
+        qCWarning(DQML_LOG) << "name too long to send:" << id << file;
+        return;
+    }
 
+    // Until a server said hello and its journal is replayed, changes go in
+    // its journal so they're sent after the ones before them
+    if (target) {
+        if (!target->isReady()) {
+            if (!marker)
+                target->journalEvent(type, id, path, file);
+            return;
+        }
     } else {
-        qCDebug(DQML_LOG) << "monitored a change while disconnected, will be ignored..." << type << id << path << file;
+        bool anyReady = false;
+        foreach (DQmlMonitorTarget *t, m_targets) {
+            if (t->isReady()) {
+                anyReady = true;
+            } else if (!marker) {
+                qCDebug(DQML_LOG) << "monitored a change while disconnected, journaling it..." << type << id << path << file;
+                t->journalEvent(type, id, path, file);
+            }
+        }
+        if (!anyReady)
+            return;
     }
+
+    DQmlReadJob *job = new DQmlReadJob();
+    job->monitor = this;
+    job->sequence = m_nextSequence++;
+    job->type = type;
+    job->id = id;
+    job->path = path;
+    job->file = file;
+    job->target = target;
+    job->created = m_clock.nsecsElapsed() / 1000;
+    job->unlessHash = unlessHash;
+    m_waitingReads << job;
+    dispatchReads();
 }
 
-void DQmlMonitor::fileWasChanged(const QString &id, const QString &path, const QString &file)
+void DQmlMonitor::beginChangeSet(DQmlMonitorTarget *target)
 {
-    writeEvent(ChangeEvent, id, path, file);
+    writeEvent(BeginEvent, QString(), QString(), QString(), target);
 }
 
-void DQmlMonitor::fileWasAdded(const QString &id, const QString &path, const QString &file)
+void DQmlMonitor::commitChangeSet(DQmlMonitorTarget *target)
 {
-    writeEvent(AddEvent, id, path, file);
+    writeEvent(CommitEvent, QString(), QString(), QString(), target);
 }
 
-void DQmlMonitor::fileWasRemoved(const QString &id, const QString &path, const QString &file)
+// Hands waiting reads to the pool, keeping a bounded number in flight. A
+// file is only read once the previous read of it is done, so that the
+// delta is made against what the servers will have by then.
+void DQmlMonitor::dispatchReads()
 {
-    writeEvent(RemoveEvent, id, path, file);
+    int limit = 2 * m_readPool->maxThreadCount();
+    // Finished reads count too, they hold their message until it's sent
+    if (!m_waitingReads.isEmpty() && m_reading.size() + m_readDone.size() >= limit)
+        deferLaggards();
+
+    // Reads for all servers are encoded with the codec most of them use
+    // and only use what all of them can handle. Those which differ get the
+    // change from their journal when they've caught up.
+    QHash<QByteArray, int> codecVotes;
+    uint sharedCapabilities = DQmlDeltaCapability | DQmlStreamCapability;
+    foreach (DQmlMonitorTarget *t, m_targets) {
+        if (!t->isReady())
+            continue;
+        ++codecVotes[t->codec()];
+        sharedCapabilities &= t->capabilities();
+    }
+    QByteArray sharedCodec;
+    int votes = 0;
+    for (QHash<QByteArray, int>::const_iterator it = codecVotes.constBegin(); it != codecVotes.constEnd(); ++it) {
+        if (it.value() > votes) {
+            sharedCodec = it.key();
+            votes = it.value();
+        }
+    }
+
+    for (int i = 0; i < m_waitingReads.size() && m_reading.size() + m_readDone.size() < limit; ) {
+        DQmlReadJob *job = m_waitingReads.at(i);
+        QString key = job->id + QLatin1Char('/') + job->file;
+        bool marker = job->type == BeginEvent || job->type == CommitEvent;
+        if (!marker && m_busyFiles.contains(key)) {
+            ++i;
+            continue;
+        }
+        m_waitingReads.removeAt(i);
+        if (!marker)
+            m_busyFiles.insert(key);
+
+        QByteArray codec = job->target ? job->target->codec() : sharedCodec;
+        uint capabilities = job->target ? job->target->capabilities() : sharedCapabilities;
+
+        // What one server alone is sent doesn't match what the rest have,
+        // so it's always sent in full
+        if (!job->target && job->type == ChangeEvent && (capabilities & DQmlDeltaCapability)) {
+            const QByteArray *base = m_sentContent.object(key);
+            if (base)
+                job->base = *base;
+        }
+        job->codec = codec.isEmpty() ? 0 : DQmlCodec::codec(codec);
+        job->level = m_compressionLevel;
+        job->threshold = m_compressionThreshold;
+        if (capabilities & DQmlStreamCapability)
+            job->streamThreshold = m_streamThreshold;
+        m_reading.insert(job->sequence, job);
+        m_readPool->start(job);
+    }
+    dqml_metrics()->readQueueDepth->record(m_waitingReads.size() + m_reading.size());
 }
 
+// When the finished reads pile up because a server can't keep up with the
+// others, it's left to catch up from its journal so the rest can go on
+void DQmlMonitor::deferLaggards()
+{
+    if (m_targets.size() < 2)
+        return;
 
-void DQmlMonitor::socketConnected()
+    quint64 furthest = m_nextToRelease;
+    foreach (DQmlMonitorTarget *t, m_targets) {
+        if (t->isReady())
+            furthest = qMax(furthest, t->nextToSend());
+    }
+    foreach (DQmlMonitorTarget *t, m_targets) {
+        if (t->isReady() && t->isBlocked() && t->nextToSend() < furthest)
+            t->defer(furthest);
+    }
+    releaseSent();
+}
+
+void DQmlMonitor::readFinished(quint64 sequence)
 {
-    qCDebug(DQML_LOG) << "connected!";
-    m_connected = true;
-    if (m_connectTimer != 0) {
-        killTimer(m_connectTimer);
-        m_connectTimer = 0;
+    DQmlReadJob *job = m_reading.take(sequence);
+    Q_ASSERT(job);
+    m_readDone.insert(sequence, job);
+
+    QString key = job->id + QLatin1Char('/') + job->file;
+    m_busyFiles.remove(key);
+
+    if (job->skipped) {
+        // The server has this version, so deltas can be made against it
+        // from here on, as long as it's the only one
+        dqml_metrics()->filesSkippedBySync->add();
+        if (m_targets.size() == 1 && job->content.size() >= DQML_DELTA_MIN_SIZE)
+            m_sentContent.insert(key, new QByteArray(job->content), job->content.size());
+    } else if (!job->target && job->type != BeginEvent && job->type != CommitEvent) {
+        dqml_metrics()->sharedReads->add();
+        if (job->type == RemoveEvent || job->streamed || job->content.size() < DQML_DELTA_MIN_SIZE)
+            m_sentContent.remove(key);
+        else
+            m_sentContent.insert(key, new QByteArray(job->content), job->content.size());
     }
-    if (m_syncAll)
-        syncAllFiles();
+    // Only the message is sent, the content is in m_sentContent if needed
+    job->content.clear();
+
+    foreach (DQmlMonitorTarget *t, m_targets)
+        t->sendPending();
+    releaseSent();
+    dispatchReads();
 }
 
-void DQmlMonitor::syncAllFiles()
+// Lets go of the finished reads every connected server has gone past
+void DQmlMonitor::releaseSent()
 {
-    QHash<QString, DQmlFileTracker::Entry> all = m_tracker->trackingSet();
-    for (QHash<QString, DQmlFileTracker::Entry>::const_iterator it = all.constBegin();
-         it != m_tracker->trackingSet().constEnd(); ++it) {
-        const DQmlFileTracker::Entry &e = it.value();
-        foreach (const QString &file, e.content.keys())
-            fileWasAdded(it.key(), it.value().path, file);
+    quint64 upTo = m_nextSequence;
+    foreach (DQmlMonitorTarget *t, m_targets) {
+        if (t->isReady())
+            upTo = qMin(upTo, t->nextToSend());
+    }
+    while (m_nextToRelease < upTo) {
+        DQmlReadJob *job = m_readDone.take(m_nextToRelease);
+        if (!job)
+            break;
+        delete job;
+        ++m_nextToRelease;
     }
 }
 
-void DQmlMonitor::socketDisconnected()
+DQmlReadJob *DQmlMonitor::findJob(quint64 sequence) const
 {
-    qCDebug(DQML_LOG) << "disconnected...";
-    maybeNoSocketSoTryLater();
+    if (DQmlReadJob *job = m_readDone.value(sequence))
+        return job;
+    if (DQmlReadJob *job = m_reading.value(sequence))
+        return job;
+    foreach (DQmlReadJob *job, m_waitingReads) {
+        if (job->sequence == sequence)
+            return job;
+    }
+    return 0;
+}
+
+void DQmlMonitor::setCompression(const QByteArray &codec, int level)
+{
+    m_preferredCodec = codec;
+    m_compressionLevel = level;
+}
+
+// The tracker reports the files changed together, a save of several files
+// or a checkout, as one changeset, which the server applies in one go
+void DQmlMonitor::changeSetReceived(const DQmlFileTracker::ChangeSet &changes)
+{
+    if (changes.size() > 1)
+        beginChangeSet(0);
+    foreach (const DQmlFileTracker::Change &c, changes) {
+        switch (c.type) {
+        case DQmlFileTracker::Change::Added: writeEvent(AddEvent, c.id, c.path, c.fileName); break;
+        case DQmlFileTracker::Change::Changed: writeEvent(ChangeEvent, c.id, c.path, c.fileName); break;
+        case DQmlFileTracker::Change::Removed: writeEvent(RemoveEvent, c.id, c.path, c.fileName); break;
+        }
+    }
+    if (changes.size() > 1)
+        commitChangeSet(0);
 }
 
-void DQmlMonitor::socketError(QAbstractSocket::SocketError error)
+void DQmlMonitor::syncAllFiles()
 {
-    qCDebug(DQML_LOG) << "connection error, code:" << hex << error;
-    maybeNoSocketSoTryLater();
+    sendAllFiles(0);
 }
 
-void DQmlMonitor::maybeNoSocketSoTryLater()
+void DQmlMonitor::sendAllFiles(DQmlMonitorTarget *target)
 {
-    qCDebug(DQML_LOG) << " - socket is in state" << m_socket->state();
-    if (m_socket->state() == QAbstractSocket::UnconnectedState
-            || m_socket->state() == QAbstractSocket::ClosingState) {
-        m_connected = false;
-        if (m_connectTimer == 0) {
-            qCDebug(DQML_LOG) << " -> starting reconnect timer..";
-            m_connectTimer = startTimer(10000);
+    const QHash<QString, DQmlFileTracker::Entry> &all = m_tracker->trackingSet();
+    beginChangeSet(target);
+    for (QHash<QString, DQmlFileTracker::Entry>::const_iterator it = all.constBegin();
+         it != all.constEnd(); ++it) {
+        const DQmlFileTracker::Entry &e = it.value();
+        foreach (const DQmlFileTracker::Directory &d, e.dirs) {
+            foreach (const DQmlFileTracker::File &f, d.files)
+                writeEvent(AddEvent, it.key(), e.path, d.filePath(f.name), target);
         }
     }
+    commitChangeSet(target);
 }
 
-void DQmlMonitor::timerEvent(QTimerEvent *e)
+// Whether 'file' would be tracked in 'entry' if it existed on this side
+static bool dqml_isTrackable(const DQmlFileTracker::Entry &entry, const QString &file)
 {
-    if (e->timerId() == m_connectTimer)
-        connectToServer(m_host, m_port);
+    QStringList parts = file.split(QLatin1Char('/'));
+    QString dir;
+    for (int i = 0; i < parts.size() - 1; ++i) {
+        if (!entry.filter.acceptsDirectory(dir, parts.at(i)))
+            return false;
+        dir = dir.isEmpty() ? parts.at(i) : dir + QLatin1Char('/') + parts.at(i);
+    }
+    return entry.filter.acceptsFile(dir, parts.last());
 }
 
+// Brings the server's copy of 'id' in line with ours, given what it has.
+// Files it lacks or has a different version of are sent, files it has
+// which we would track but don't have are removed. Anything else is left
+// alone, it may well belong there.
+void DQmlMonitor::syncFiles(DQmlMonitorTarget *target, const QString &id,
+                            QHash<QString, DQmlFileTracker::FileState> remote)
+{
+    const QHash<QString, DQmlFileTracker::Entry> &all = m_tracker->trackingSet();
+    QHash<QString, DQmlFileTracker::Entry>::const_iterator it = all.constFind(id);
+    if (it == all.constEnd()) {
+        qCDebug(DQML_LOG) << "server has a mapping for" << id << "which we don't track";
+        return;
+    }
+
+    const DQmlFileTracker::Entry &e = it.value();
+    beginChangeSet(target);
+    int sent = 0;
+    int removed = 0;
+    int checked = 0;
+    foreach (const DQmlFileTracker::Directory &d, e.dirs) {
+        foreach (const DQmlFileTracker::File &f, d.files) {
+            QString file = d.filePath(f.name);
+            QHash<QString, DQmlFileTracker::FileState>::iterator r = remote.find(file);
+            if (r == remote.end()) {
+                writeEvent(AddEvent, id, e.path, file, target);
+                ++sent;
+                continue;
+            }
+            bool same = false;
+            if (r->size == f.state.size) {
+                if (f.state.hash != 0) {
+                    same = f.state.hash == r->hash;
+                } else {
+                    // Only the content can tell, leave that to the read
+                    // pool which skips the file if the hashes match
+                    writeEvent(ChangeEvent, id, e.path, file, target, r->hash);
+                    ++checked;
+                    remote.erase(r);
+                    continue;
+                }
+            }
+            if (!same) {
+                writeEvent(ChangeEvent, id, e.path, file, target);
+                ++sent;
+            }
+            remote.erase(r);
+        }
+    }
+
+    for (QHash<QString, DQmlFileTracker::FileState>::const_iterator r = remote.constBegin();
+         r != remote.constEnd(); ++r) {
+        if (dqml_isTrackable(e, r.key())) {
+            writeEvent(RemoveEvent, id, e.path, r.key(), target);
+            ++removed;
+        }
+    }
+    commitChangeSet(target);
+
+    qCDebug(DQML_LOG) << "synced" << id << "with" << target->host() << target->port() << "sent" << sent
+                      << "files, removed" << removed << "and is checking" << checked;
+    dqml_metrics()->filesSkippedBySync->add(e.fileCount - sent - checked);
+}
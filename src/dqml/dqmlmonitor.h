@@ -28,17 +28,25 @@
 #define DQMLMONITOR_H
 
 #include <dqml/dqmlglobal.h>
+#include <dqml/dqmlfiletracker.h>
 
+#include <QtCore/QCache>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QList>
 #include <QtCore/QObject>
-
-#include <QtNetwork/QAbstractSocket>
+#include <QtCore/QSet>
 
 QT_BEGIN_NAMESPACE
 
-class DQmlFileTracker;
-
-class QTcpSocket;
+class QThreadPool;
+class DQmlMonitorTarget;
+class DQmlReadJob;
 
+// Sends the changes to the tracked files to one or more servers. Each
+// change is read, hashed and compressed once and the result is written to
+// every server, each of which has its own connection, session and journal,
+// so a slow or absent server doesn't hold the others back for long.
 class DQML_EXPORT DQmlMonitor: public QObject
 {
     Q_OBJECT
@@ -49,36 +57,95 @@ public:
     DQmlFileTracker *fileTracker() { return m_tracker; }
     void setSyncAllFilesWhenConnected(bool sync) { m_syncAll = sync; }
 
+    // Messages are compressed with 'codec', or the best codec both sides
+    // have if the server lacks it, and 'level'. An empty codec turns
+    // compression off. Defaults to the most preferred DQmlCodec.
+    void setCompression(const QByteArray &codec, int level = -1);
+    QByteArray compressionCodec() const { return m_preferredCodec; }
+    int compressionLevel() const { return m_compressionLevel; }
+
+    // Messages smaller than 'bytes' are sent as they are. Defaults to 512.
+    void setCompressionThreshold(int bytes) { m_compressionThreshold = bytes; }
+    int compressionThreshold() const { return m_compressionThreshold; }
+
+    // Files of at least 'bytes' are streamed to the server in chunks rather
+    // than read and sent in one go. 0 turns streaming off. Defaults to 1 MB.
+    void setStreamThreshold(qint64 bytes) { m_streamThreshold = bytes; }
+    qint64 streamThreshold() const { return m_streamThreshold; }
+
+    // Large payloads to servers on this machine are handed over through a
+    // shared memory ring buffer of 'bytes' rather than the local socket.
+    // 0 turns it off, which is the default.
+    void setSharedMemorySize(int bytes) { m_sharedMemorySize = bytes; }
+    int sharedMemorySize() const { return m_sharedMemorySize; }
+
 public Q_SLOTS:
+    // Adds a server to send to, connecting to the same one twice does nothing
     void connectToServer(const QString &host, quint16 port);
+    // Adds a server on this machine listening on the QLocalServer 'name'
+    void connectToLocalServer(const QString &name);
     void syncAllFiles();
 
 private Q_SLOTS:
-    void socketConnected();
-    void socketDisconnected();
-    void socketError(QAbstractSocket::SocketError error);
-
-    void fileWasChanged(const QString &id, const QString &path, const QString &file);
-    void fileWasAdded(const QString &id, const QString &path, const QString &file);
-    void fileWasRemoved(const QString &id, const QString &path, const QString &file);
+    void readFinished(quint64 sequence);
 
-protected:
-    void timerEvent(QTimerEvent *e);
+    void changeSetReceived(const DQmlFileTracker::ChangeSet &changes);
 
 private:
-    enum EventType { ChangeEvent = 1, AddEvent = 2, RemoveEvent = 3 };
-    void writeEvent(EventType type, const QString &id, const QString &path, const QString &file);
-    void maybeNoSocketSoTryLater();
+    friend class DQmlMonitorTarget;
+
+    // The values are the DQmlMessageType they're sent as
+    enum EventType {
+        ChangeEvent = 1,
+        AddEvent = 2,
+        RemoveEvent = 3,
+        // Marks the events in between as one changeset
+        BeginEvent = 11,
+        CommitEvent = 12
+    };
+    // Sends a change to 'target', or to all servers when it's null
+    void writeEvent(EventType type, const QString &id, const QString &path, const QString &file,
+                    DQmlMonitorTarget *target = 0, quint64 unlessHash = 0);
+    void beginChangeSet(DQmlMonitorTarget *target);
+    void commitChangeSet(DQmlMonitorTarget *target);
+    void dispatchReads();
+    void deferLaggards();
+    void releaseSent();
+    DQmlReadJob *findJob(quint64 sequence) const;
+    void sendAllFiles(DQmlMonitorTarget *target);
+    void addTarget(const QString &host, quint16 port, bool local);
+    void syncFiles(DQmlMonitorTarget *target, const QString &id,
+                   QHash<QString, DQmlFileTracker::FileState> remote);
 
     DQmlFileTracker *m_tracker;
-
-    QTcpSocket *m_socket;
-    QString m_host;
-    quint16 m_port;
-    bool m_connected;
-    int m_connectTimer;
+    QList<DQmlMonitorTarget *> m_targets;
 
     bool m_syncAll;
+
+    QByteArray m_preferredCodec;
+    int m_compressionLevel;
+    int m_compressionThreshold;
+
+    // What the servers were last sent of each file, keyed on id and file
+    // name, to make deltas against
+    QCache<QString, QByteArray> m_sentContent;
+
+    // Files are read and encoded on the pool and sent in sequence order.
+    // Finished reads are kept until every server that is connected has
+    // gone past them.
+    QThreadPool *m_readPool;
+    QList<DQmlReadJob *> m_waitingReads;
+    QHash<quint64, DQmlReadJob *> m_reading;
+    QHash<quint64, DQmlReadJob *> m_readDone;
+    // Files with a read in flight, keyed like m_sentContent
+    QSet<QString> m_busyFiles;
+    quint64 m_nextSequence;
+    quint64 m_nextToRelease;
+
+    qint64 m_streamThreshold;
+    int m_sharedMemorySize;
+
+    QElapsedTimer m_clock;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,739 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlmonitortarget_p.h"
+#include "dqmlcodec.h"
+#include "dqmlmetrics.h"
+#include "dqmlprotocol_p.h"
+#include "dqmlreadjob_p.h"
+#include "dqmltransport_p.h"
+
+#include <QtCore/QTimerEvent>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMap>
+#include <QtCore/QUuid>
+
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QLocalSocket>
+#include <QtNetwork/QTcpSocket>
+
+// The totals over all servers, each target also counts its own share
+struct DQmlMonitorTargetMetrics
+{
+    DQmlMonitorTargetMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        filesSent = m->counter(QStringLiteral("monitor.filesSent"));
+        bytesSent = m->counter(QStringLiteral("monitor.bytesSent"));
+        removalsSent = m->counter(QStringLiteral("monitor.removalsSent"));
+        eventsDropped = m->counter(QStringLiteral("monitor.eventsDropped"));
+        resendsReceived = m->counter(QStringLiteral("monitor.resendsReceived"));
+        filesStreamed = m->counter(QStringLiteral("monitor.filesStreamed"));
+        chunksSent = m->counter(QStringLiteral("monitor.chunksSent"));
+        bytesViaSharedMemory = m->counter(QStringLiteral("monitor.bytesViaSharedMemory"));
+        journalCoalesced = m->counter(QStringLiteral("monitor.journalCoalesced"));
+        journalBytesSaved = m->counter(QStringLiteral("monitor.journalBytesSaved"));
+        journalReplayed = m->counter(QStringLiteral("monitor.journalReplayed"));
+        journalOverflows = m->counter(QStringLiteral("monitor.journalOverflows"));
+        journalDepth = m->histogram(QStringLiteral("monitor.journalDepth"));
+        eventsResent = m->counter(QStringLiteral("monitor.eventsResent"));
+        reconnectAttempts = m->counter(QStringLiteral("monitor.reconnectAttempts"));
+        deadConnections = m->counter(QStringLiteral("monitor.deadConnections"));
+        rttUsecs = m->histogram(QStringLiteral("monitor.rttUsecs"));
+        unackedEvents = m->histogram(QStringLiteral("monitor.unackedEvents"));
+    }
+
+    DQmlCounter *filesSent;
+    DQmlCounter *bytesSent;
+    DQmlCounter *removalsSent;
+    DQmlCounter *eventsDropped;
+    DQmlCounter *resendsReceived;
+    DQmlCounter *filesStreamed;
+    DQmlCounter *chunksSent;
+    DQmlCounter *bytesViaSharedMemory;
+    DQmlCounter *journalCoalesced;
+    DQmlCounter *journalBytesSaved;
+    DQmlCounter *journalReplayed;
+    DQmlCounter *journalOverflows;
+    DQmlHistogram *journalDepth;
+    DQmlCounter *eventsResent;
+    DQmlCounter *reconnectAttempts;
+    DQmlCounter *deadConnections;
+    DQmlHistogram *rttUsecs;
+    DQmlHistogram *unackedEvents;
+};
+
+// How much is left for the socket to write before we stop handing it more
+static const qint64 DQML_SEND_BUFFER_SIZE = 256 * 1024;
+
+static const int DQML_STREAM_CHUNK_SIZE = 64 * 1024;
+
+// Smaller payloads are cheaper to write to a local socket than to hand
+// over through shared memory
+static const int DQML_SHARED_MEMORY_MIN_SIZE = 16 * 1024;
+
+// Reconnects start out quick and back off to this
+static const int DQML_RECONNECT_MIN_DELAY = 100;
+static const int DQML_RECONNECT_MAX_DELAY = 10000;
+
+// The server answers heartbeats, if it's silent for longer than the
+// timeout the connection is considered dead
+static const int DQML_HEARTBEAT_INTERVAL = 2000;
+static const int DQML_HEARTBEAT_TIMEOUT = 3 * DQML_HEARTBEAT_INTERVAL;
+
+// The most files to remember changes of while disconnected, beyond that
+// it's cheaper to send everything
+static const int DQML_JOURNAL_SIZE = 10000;
+
+Q_GLOBAL_STATIC(DQmlMonitorTargetMetrics, dqml_metrics)
+
+DQmlMonitorTarget::DQmlMonitorTarget(DQmlMonitor *monitor, const QString &host, quint16 port, bool local)
+    : QObject(monitor)
+    , m_monitor(monitor)
+    , m_socket(0)
+    , m_host(host)
+    , m_port(port)
+    , m_local(local)
+    , m_connected(false)
+    , m_ready(false)
+    , m_connectTimer(0)
+    , m_heartbeatTimer(0)
+    , m_reconnectDelay(DQML_RECONNECT_MIN_DELAY)
+    , m_serverCapabilities(0)
+    , m_ring(0)
+    , m_ringReady(false)
+    , m_nextToSend(0)
+    , m_stream(0)
+    , m_streamType(DQmlMonitor::ChangeEvent)
+    , m_streamCreated(0)
+    , m_journalOrder(0)
+    , m_journalOverflowed(false)
+    , m_sentSequence(0)
+{
+    m_sessionId = QUuid::createUuid().toRfc4122();
+
+    DQmlMetrics *m = DQmlMetrics::instance();
+    QString prefix = local ? QStringLiteral("monitor.local:") + host + QLatin1Char('.')
+                           : QStringLiteral("monitor.") + host + QLatin1Char(':') + QString::number(port)
+                             + QLatin1Char('.');
+    m_bytesSent = m->counter(prefix + QStringLiteral("bytesSent"));
+    m_deferredEvents = m->counter(prefix + QStringLiteral("deferredEvents"));
+    m_reconnects = m->counter(prefix + QStringLiteral("reconnects"));
+    m_rttUsecs = m->histogram(prefix + QStringLiteral("rttUsecs"));
+    m_lagUsecs = m->histogram(prefix + QStringLiteral("lagUsecs"));
+    m_pendingEvents = m->histogram(prefix + QStringLiteral("pendingEvents"));
+    m_unackedEvents = m->histogram(prefix + QStringLiteral("unackedEvents"));
+}
+
+DQmlMonitorTarget::~DQmlMonitorTarget()
+{
+    delete m_stream;
+    delete m_ring;
+
+    if (m_socket) {
+        m_socket->close();
+        delete m_socket;
+    }
+}
+
+void DQmlMonitorTarget::connectToServer()
+{
+    abortStream();
+    if (m_socket)
+        delete m_socket;
+
+    delete m_ring;
+    m_ring = 0;
+    m_ringReady = false;
+
+    if (m_local) {
+        qCDebug(DQML_LOG) << "Connecting to local server: " << m_host;
+        m_socket = new QLocalSocket();
+        connect(m_socket, SIGNAL(error(QLocalSocket::LocalSocketError)), this, SLOT(localSocketError(QLocalSocket::LocalSocketError)));
+    } else {
+        qCDebug(DQML_LOG) << "Connecting to: " << m_host << ":" << m_port;
+        m_socket = new QTcpSocket();
+        connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+    }
+
+    connect(m_socket, SIGNAL(connected()), this, SLOT(socketConnected()));
+    connect(m_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+    connect(m_socket, SIGNAL(readyRead()), this, SLOT(readReplies()));
+    connect(m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten()));
+
+    m_connected = false;
+    m_ready = false;
+    m_codec.clear();
+    m_serverCapabilities = 0;
+    m_replyReader.clear();
+    if (m_local)
+        static_cast<QLocalSocket *>(m_socket)->connectToServer(m_host);
+    else
+        static_cast<QTcpSocket *>(m_socket)->connectToHost(QHostAddress(m_host), m_port);
+}
+
+bool DQmlMonitorTarget::isBlocked() const
+{
+    return !m_ready || m_stream || m_socket->bytesToWrite() >= DQML_SEND_BUFFER_SIZE;
+}
+
+// Whether the message a job made can go to this server as it is. It was
+// encoded for the servers which were connected at the time, this one may
+// not have the same codec or capabilities.
+bool DQmlMonitorTarget::canTake(const DQmlReadJob *job) const
+{
+    if (job->streamed)
+        return m_serverCapabilities & DQmlStreamCapability;
+    if (job->message.size() < 16)
+        return false;
+    if (uchar(job->message.at(3)) == DQmlDeltaMessage
+            && !(m_serverCapabilities & DQmlDeltaCapability))
+        return false;
+    if (dqml_readInt<quint16>(job->message.constData() + 4) & DQmlCompressedFrame)
+        return job->codec && job->codec->name() == m_codec;
+    return true;
+}
+
+// Writes the monitor's finished reads to the socket in the order the
+// changes came in, regardless of the order the reads finished in. Once the
+// socket has enough to write, the rest waits for bytesWritten().
+void DQmlMonitorTarget::sendPending()
+{
+    if (!m_ready)
+        return;
+
+    bool sent = false;
+    while (m_socket->bytesToWrite() < DQML_SEND_BUFFER_SIZE) {
+        if (m_stream) {
+            sendChunk();
+            sent = true;
+            continue;
+        }
+
+        DQmlReadJob *job = m_monitor->m_readDone.value(m_nextToSend);
+        if (!job)
+            break;
+        ++m_nextToSend;
+        if (job->skipped || (job->target && job->target != this))
+            continue;
+
+        // Changeset markers are not numbered, there's nothing to resend
+        if (job->type == DQmlMonitor::BeginEvent || job->type == DQmlMonitor::CommitEvent) {
+            if (m_serverCapabilities & DQmlChangeSetCapability) {
+                m_socket->write(job->message);
+                dqml_metrics()->bytesSent->add(job->message.size());
+                m_bytesSent->add(job->message.size());
+                sent = true;
+            }
+            continue;
+        }
+
+        // A file with a change waiting in the journal has to wait with the
+        // rest, the server may not have what a delta is made against
+        QString key = job->id + QLatin1Char('/') + job->file;
+        if (m_journal.contains(key) || !canTake(job)) {
+            journalEvent(EventType(job->type), job->id, job->path, job->file);
+        } else if (job->streamed) {
+            beginStream(EventType(job->type), job->id, job->path, job->file);
+            m_streamCreated = job->created;
+            sent = true;
+        } else {
+            writeMessage(job->message);
+            m_unacked << UnackedEvent(m_sentSequence, job->created, EventType(job->type),
+                                      job->id, job->path, job->file);
+            if (job->type == DQmlMonitor::RemoveEvent)
+                dqml_metrics()->removalsSent->add();
+            else
+                dqml_metrics()->filesSent->add();
+            qCDebug(DQML_LOG) << " -> event written to" << m_host << job->id << job->file;
+            sent = true;
+        }
+    }
+    m_pendingEvents->record(m_monitor->m_nextSequence - m_nextToSend);
+
+    // Once caught up, what had to be put aside is read again for this
+    // server alone
+    if (!m_stream && m_nextToSend == m_monitor->m_nextSequence
+            && m_socket->bytesToWrite() < DQML_SEND_BUFFER_SIZE
+            && (!m_journal.isEmpty() || m_journalOverflowed)) {
+        replayJournal();
+    }
+
+    if (sent)
+        flush();
+}
+
+// Gives up on sending what's before 'sequence' in the order it came in and
+// journals it instead, so that the monitor can let go of it
+void DQmlMonitorTarget::defer(quint64 sequence)
+{
+    int deferred = 0;
+    for (; m_nextToSend < sequence; ++m_nextToSend) {
+        DQmlReadJob *job = m_monitor->findJob(m_nextToSend);
+        if (!job || (job->target && job->target != this)
+                || job->type == DQmlMonitor::BeginEvent || job->type == DQmlMonitor::CommitEvent)
+            continue;
+        // A read which is done and skipped has nothing to send
+        if (job->skipped && m_monitor->m_readDone.contains(m_nextToSend))
+            continue;
+        journalEvent(EventType(job->type), job->id, job->path, job->file);
+        ++deferred;
+    }
+    if (deferred > 0) {
+        qCDebug(DQML_LOG) << m_host << m_port << "fell behind, journaled" << deferred << "changes";
+        m_deferredEvents->add(deferred);
+    }
+}
+
+void DQmlMonitorTarget::beginStream(EventType type, const QString &id, const QString &path, const QString &file)
+{
+    QFile *f = new QFile(path + QLatin1Char('/') + file);
+    if (!f->open(QFile::ReadOnly)) {
+        qCDebug(DQML_LOG) << "failed to open" << f->fileName() << "for streaming" << f->errorString();
+        delete f;
+        return;
+    }
+
+    qCDebug(DQML_LOG) << " -> streaming" << f->size() << "bytes of" << id << file << "to" << m_host;
+    m_stream = f;
+    m_streamType = type;
+    m_streamId = id;
+    m_streamPath = path;
+    m_streamName = file;
+
+    writeMessage(dqml_makeFrame(DQmlStreamBeginMessage, id, file));
+}
+
+// Sends the next chunk of the file being streamed, or ends the stream when
+// it's all sent
+void DQmlMonitorTarget::sendChunk()
+{
+    Q_ASSERT(m_stream);
+    QByteArray chunk(DQML_STREAM_CHUNK_SIZE, Qt::Uninitialized);
+    qint64 size = m_stream->read(chunk.data(), chunk.size());
+
+    QByteArray message;
+    if (size > 0) {
+        chunk.resize(size);
+        DQmlCodec *codec = m_codec.isEmpty() ? 0 : DQmlCodec::codec(m_codec);
+        message = dqml_encodeFrame(DQmlStreamChunkMessage, m_streamId, m_streamName, chunk,
+                                   codec, m_monitor->m_compressionLevel, m_monitor->m_compressionThreshold);
+        dqml_metrics()->chunksSent->add();
+    } else {
+        if (size < 0)
+            qCDebug(DQML_LOG) << "failed to read" << m_stream->fileName() << m_stream->errorString();
+        message = dqml_makeFrame(DQmlStreamEndMessage, m_streamId, m_streamName);
+        qCDebug(DQML_LOG) << " -> stream written to" << m_host << m_streamId << m_streamName;
+        delete m_stream;
+        m_stream = 0;
+        dqml_metrics()->filesSent->add();
+        dqml_metrics()->filesStreamed->add();
+    }
+    writeMessage(message);
+    if (!m_stream) {
+        m_unacked << UnackedEvent(m_sentSequence, m_streamCreated, m_streamType,
+                                  m_streamId, m_streamPath, m_streamName);
+    }
+}
+
+void DQmlMonitorTarget::abortStream()
+{
+    if (!m_stream)
+        return;
+    qCDebug(DQML_LOG) << "disconnected while streaming" << m_streamName << ", journaling it...";
+    delete m_stream;
+    m_stream = 0;
+    journalEvent(m_streamType, m_streamId, m_streamPath, m_streamName);
+}
+
+// Writes a message which is part of the session, numbering it
+void DQmlMonitorTarget::writeMessage(const QByteArray &message)
+{
+    QByteArray frame;
+    if (m_ringReady && message.size() >= DQML_SHARED_MEMORY_MIN_SIZE)
+        frame = dqml_moveToRing(message, m_ring);
+    if (!frame.isNull()) {
+        m_socket->write(frame);
+        dqml_metrics()->bytesViaSharedMemory->add(message.size() - frame.size());
+    } else {
+        m_socket->write(message);
+    }
+    ++m_sentSequence;
+    dqml_metrics()->bytesSent->add(message.size());
+    m_bytesSent->add(message.size());
+}
+
+// The server handled everything up to and including 'sequence'
+void DQmlMonitorTarget::acknowledge(quint64 sequence)
+{
+    qint64 now = m_monitor->m_clock.nsecsElapsed() / 1000;
+    while (!m_unacked.isEmpty() && m_unacked.first().sequence <= sequence)
+        m_lagUsecs->record(now - m_unacked.takeFirst().created);
+    dqml_metrics()->unackedEvents->record(m_unacked.size());
+    m_unackedEvents->record(m_unacked.size());
+}
+
+// Picks up after a reconnect. What the server got before the connection
+// went is done with, the rest is sent again unless the journal has a later
+// change of the same file.
+void DQmlMonitorTarget::resumeSession(quint64 sequence)
+{
+    qCDebug(DQML_LOG) << m_host << m_port << "handled" << sequence << "of" << m_sentSequence << "messages";
+    m_reconnectDelay = DQML_RECONNECT_MIN_DELAY;
+    acknowledge(sequence);
+    QList<UnackedEvent> lost = m_unacked;
+    m_unacked.clear();
+    m_ready = true;
+    // Whatever the monitor has in flight was journaled while we were away
+    m_nextToSend = m_monitor->m_nextSequence;
+
+    if (m_monitor->m_syncAll) {
+        // The manifests which follow bring the server up to date
+        if (!m_journal.isEmpty() || !lost.isEmpty())
+            qCDebug(DQML_LOG) << "dropping" << m_journal.size() + lost.size() << "unsent changes in favor of sync";
+        m_journal.clear();
+        m_journalOverflowed = false;
+        return;
+    }
+
+    // What was lost and what changed in the meantime go as one changeset
+    m_monitor->beginChangeSet(this);
+    foreach (const UnackedEvent &e, lost) {
+        if (m_journal.contains(e.id + QLatin1Char('/') + e.file))
+            continue;
+        dqml_metrics()->eventsResent->add();
+        m_monitor->writeEvent(e.type, e.id, e.path, e.file, this);
+    }
+    replayJournal();
+    m_monitor->commitChangeSet(this);
+}
+
+// Remembers a change which couldn't be sent. Only the latest state of a
+// file is kept, its content is read when the journal is replayed.
+void DQmlMonitorTarget::journalEvent(EventType type, const QString &id, const QString &path, const QString &file)
+{
+    if (m_journalOverflowed)
+        return;
+
+    QString key = id + QLatin1Char('/') + file;
+    QHash<QString, JournalEntry>::iterator it = m_journal.find(key);
+    if (it != m_journal.end()) {
+        dqml_metrics()->journalCoalesced->add();
+        if (it->type != DQmlMonitor::RemoveEvent)
+            dqml_metrics()->journalBytesSaved->add(QFileInfo(path + QLatin1Char('/') + file).size());
+        // An added file which then changed is still new to the server
+        if (it->type != DQmlMonitor::AddEvent || type != DQmlMonitor::ChangeEvent)
+            it->type = type;
+        it->order = m_journalOrder++;
+        return;
+    }
+
+    if (m_journal.size() >= DQML_JOURNAL_SIZE) {
+        qCDebug(DQML_LOG) << "journal is full, all files will be sent on reconnect";
+        dqml_metrics()->journalOverflows->add();
+        dqml_metrics()->eventsDropped->add(m_journal.size() + 1);
+        m_journal.clear();
+        m_journalOverflowed = true;
+        return;
+    }
+
+    JournalEntry e;
+    e.order = m_journalOrder++;
+    e.type = type;
+    e.id = id;
+    e.path = path;
+    e.file = file;
+    m_journal.insert(key, e);
+    dqml_metrics()->journalDepth->record(m_journal.size());
+}
+
+// Sends what changed while we were disconnected or fell behind, in the
+// order it last changed in
+void DQmlMonitorTarget::replayJournal()
+{
+    if (m_journalOverflowed) {
+        m_journalOverflowed = false;
+        m_journal.clear();
+        m_monitor->sendAllFiles(this);
+        return;
+    }
+
+    if (m_journal.isEmpty())
+        return;
+
+    QMap<quint64, JournalEntry> ordered;
+    foreach (const JournalEntry &e, m_journal)
+        ordered.insert(e.order, e);
+    m_journal.clear();
+
+    qCDebug(DQML_LOG) << "replaying journal of" << ordered.size() << "changes to" << m_host << m_port;
+    dqml_metrics()->journalReplayed->add(ordered.size());
+    m_monitor->beginChangeSet(this);
+    foreach (const JournalEntry &e, ordered)
+        m_monitor->writeEvent(e.type, e.id, e.path, e.file, this);
+    m_monitor->commitChangeSet(this);
+}
+
+void DQmlMonitorTarget::socketBytesWritten()
+{
+    sendPending();
+    m_monitor->releaseSent();
+    m_monitor->dispatchReads();
+}
+
+void DQmlMonitorTarget::readReplies()
+{
+    m_lastReceived.start();
+    m_replyReader.readFrom(m_socket);
+
+    DQmlFrame frame;
+    while (m_connected) {
+        DQmlFrameReader::Result result = m_replyReader.next(&frame);
+        if (result == DQmlFrameReader::NeedMore)
+            break;
+        if (result == DQmlFrameReader::Garbled) {
+            qCDebug(DQML_LOG) << "garbled reply from server, reconnecting...";
+            m_replyReader.clear();
+            dqml_abortSocket(m_socket);
+            maybeNoSocketSoTryLater();
+            return;
+        }
+        handleReply(frame);
+    }
+    flush();
+}
+
+void DQmlMonitorTarget::handleReply(const DQmlFrame &frame)
+{
+    if (frame.type == DQmlHelloReply) {
+        if (frame.version != DQML_PROTOCOL_VERSION || frame.payloadLength < 4) {
+            qCWarning(DQML_LOG) << "server speaks protocol version" << frame.version
+                                << "but we speak" << DQML_PROTOCOL_VERSION;
+            dqml_abortSocket(m_socket);
+            maybeNoSocketSoTryLater();
+            return;
+        }
+        m_serverCapabilities = dqml_readInt<quint32>(frame.payload);
+        QList<QByteArray> codecs = QByteArray(frame.payload + 4, frame.payloadLength - 4).split(',');
+
+        // Use our preferred codec if the server has it, otherwise the
+        // server's preferred one if we have that
+        const QByteArray &preferred = m_monitor->m_preferredCodec;
+        m_codec.clear();
+        if (!preferred.isEmpty()) {
+            if (codecs.contains(preferred)) {
+                m_codec = preferred;
+            } else {
+                foreach (const QByteArray &name, codecs) {
+                    if (DQmlCodec::codec(name)) {
+                        m_codec = name;
+                        break;
+                    }
+                }
+            }
+        }
+        qCDebug(DQML_LOG) << "server supports" << codecs << "compressing with" << m_codec
+                          << "capabilities" << m_serverCapabilities;
+
+        QByteArray hello;
+        uint capabilities = DQmlDeltaCapability | DQmlStreamCapability | DQmlChangeSetCapability;
+        if (m_local && m_monitor->m_sharedMemorySize > 0)
+            capabilities |= DQmlSharedMemoryCapability;
+        m_serverCapabilities &= capabilities;
+        dqml_appendInt<quint32>(&hello, m_serverCapabilities);
+        hello += m_codec;
+        m_socket->write(dqml_makeFrame(DQmlHelloMessage, QString(), QString(), hello));
+
+        QByteArray session;
+        dqml_appendInt<quint64>(&session, m_sentSequence);
+        session += m_sessionId;
+        m_socket->write(dqml_makeFrame(DQmlSessionMessage, QString(), QString(), session));
+
+        // A ring per connection, so nothing is left in it from the last one
+        if (m_serverCapabilities & DQmlSharedMemoryCapability) {
+            m_ring = new DQmlSharedRing();
+            QString key = QStringLiteral("dqml-") + QString::fromLatin1(QUuid::createUuid().toRfc4122().toHex());
+            if (m_ring->create(key, m_monitor->m_sharedMemorySize)) {
+                m_socket->write(dqml_makeFrame(DQmlSharedMemoryMessage, QString(), QString(), key.toUtf8()));
+            } else {
+                delete m_ring;
+                m_ring = 0;
+            }
+        }
+
+    } else if (frame.type == DQmlSharedMemoryReply) {
+        qCDebug(DQML_LOG) << m_host << "attached to shared memory" << (m_ring ? m_ring->key() : QString());
+        m_ringReady = m_ring != 0;
+
+    } else if ((frame.type == DQmlSessionReply || frame.type == DQmlAckReply
+                || frame.type == DQmlHeartbeatReply) && frame.payloadLength >= 8) {
+        quint64 value = dqml_readInt<quint64>(frame.payload);
+        if (frame.type == DQmlSessionReply) {
+            resumeSession(value);
+        } else if (frame.type == DQmlAckReply) {
+            acknowledge(value);
+        } else {
+            qint64 rtt = m_monitor->m_clock.nsecsElapsed() / 1000 - qint64(value);
+            dqml_metrics()->rttUsecs->record(rtt);
+            m_rttUsecs->record(rtt);
+        }
+
+    } else if (frame.type == DQmlManifestReply) {
+        if (!m_monitor->m_syncAll)
+            return;
+        QHash<QString, DQmlFileTracker::FileState> remote;
+        const char *p = frame.payload;
+        const char *end = p + frame.payloadLength;
+        quint32 count = end - p >= 4 ? dqml_readInt<quint32>(p) : 0;
+        p += 4;
+        for (quint32 i = 0; i < count && end - p >= 2; ++i) {
+            int length = dqml_readInt<quint16>(p);
+            p += 2;
+            if (end - p < length + 16)
+                break;
+            DQmlFileTracker::FileState state;
+            QString file = QString::fromUtf8(p, length);
+            state.size = dqml_readInt<qint64>(p + length);
+            state.hash = dqml_readInt<quint64>(p + length + 8);
+            remote.insert(file, state);
+            p += length + 16;
+        }
+        m_monitor->syncFiles(this, frame.idString(), remote);
+
+    } else if (frame.type == DQmlResendReply) {
+        // The server doesn't have what we made the delta against
+        QString id = frame.idString();
+        QString file = frame.fileString();
+        qCDebug(DQML_LOG) << m_host << m_port << "asked for all of" << id << file;
+        dqml_metrics()->resendsReceived->add();
+        m_monitor->m_sentContent.remove(id + QLatin1Char('/') + file);
+        const QHash<QString, DQmlFileTracker::Entry> &all = m_monitor->m_tracker->trackingSet();
+        QHash<QString, DQmlFileTracker::Entry>::const_iterator it = all.constFind(id);
+        if (it != all.constEnd() && it->file(file))
+            m_monitor->writeEvent(DQmlMonitor::ChangeEvent, id, it->path, file, this);
+
+    } else {
+        qCDebug(DQML_LOG) << "unknown reply from server" << frame.type;
+    }
+}
+
+void DQmlMonitorTarget::flush()
+{
+    if (m_socket && m_connected)
+        dqml_flushSocket(m_socket);
+}
+
+void DQmlMonitorTarget::socketConnected()
+{
+    qCDebug(DQML_LOG) << "connected to" << m_host << m_port;
+    m_connected = true;
+    if (m_connectTimer != 0) {
+        killTimer(m_connectTimer);
+        m_connectTimer = 0;
+    }
+    m_lastReceived.start();
+    m_heartbeatTimer = startTimer(DQML_HEARTBEAT_INTERVAL);
+    // With sync, the server's manifests will tell us what to send
+}
+
+void DQmlMonitorTarget::socketDisconnected()
+{
+    qCDebug(DQML_LOG) << "disconnected from" << m_host << m_port;
+    maybeNoSocketSoTryLater();
+}
+
+void DQmlMonitorTarget::socketError(QAbstractSocket::SocketError error)
+{
+    qCDebug(DQML_LOG) << "connection error, code:" << hex << error;
+    maybeNoSocketSoTryLater();
+}
+
+void DQmlMonitorTarget::localSocketError(QLocalSocket::LocalSocketError error)
+{
+    qCDebug(DQML_LOG) << "local connection error, code:" << hex << error;
+    maybeNoSocketSoTryLater();
+}
+
+void DQmlMonitorTarget::maybeNoSocketSoTryLater()
+{
+    QAbstractSocket::SocketState state = dqml_socketState(m_socket);
+    qCDebug(DQML_LOG) << " - socket is in state" << state;
+    if (state == QAbstractSocket::UnconnectedState || state == QAbstractSocket::ClosingState) {
+        bool wasReady = m_ready;
+        m_connected = false;
+        m_ready = false;
+        m_ringReady = false;
+        abortStream();
+        // What the monitor still has for us goes in the journal, so the
+        // other servers aren't held back
+        if (wasReady) {
+            defer(m_monitor->m_nextSequence);
+            m_monitor->releaseSent();
+        }
+        if (m_heartbeatTimer != 0) {
+            killTimer(m_heartbeatTimer);
+            m_heartbeatTimer = 0;
+        }
+        if (m_connectTimer == 0) {
+            qCDebug(DQML_LOG) << " -> reconnecting in" << m_reconnectDelay << "ms..";
+            m_connectTimer = startTimer(m_reconnectDelay);
+            m_reconnectDelay = qMin(m_reconnectDelay * 2, DQML_RECONNECT_MAX_DELAY);
+        }
+    }
+}
+
+void DQmlMonitorTarget::timerEvent(QTimerEvent *e)
+{
+    if (e->timerId() == m_connectTimer) {
+        killTimer(m_connectTimer);
+        m_connectTimer = 0;
+        dqml_metrics()->reconnectAttempts->add();
+        m_reconnects->add();
+        connectToServer();
+    } else if (e->timerId() == m_heartbeatTimer) {
+        sendHeartbeat();
+    }
+}
+
+// Checks that the server is still there, TCP alone can take many minutes
+// to notice that it's not
+void DQmlMonitorTarget::sendHeartbeat()
+{
+    if (m_lastReceived.elapsed() > DQML_HEARTBEAT_TIMEOUT) {
+        qCDebug(DQML_LOG) << "no word from" << m_host << m_port << "in" << m_lastReceived.elapsed()
+                          << "ms, reconnecting...";
+        dqml_metrics()->deadConnections->add();
+        dqml_abortSocket(m_socket);
+        maybeNoSocketSoTryLater();
+        return;
+    }
+
+    QByteArray timestamp;
+    dqml_appendInt<qint64>(&timestamp, m_monitor->m_clock.nsecsElapsed() / 1000);
+    m_socket->write(dqml_makeFrame(DQmlHeartbeatMessage, QString(), QString(), timestamp));
+    flush();
+}
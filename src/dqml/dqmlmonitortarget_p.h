@@ -0,0 +1,186 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLMONITORTARGET_P_H
+#define DQMLMONITORTARGET_P_H
+
+#include <dqml/dqmlglobal.h>
+#include <dqml/dqmlmonitor.h>
+
+#include "dqmlprotocol_p.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+
+#include <QtNetwork/QAbstractSocket>
+#include <QtNetwork/QLocalSocket>
+
+QT_BEGIN_NAMESPACE
+
+class QFile;
+class QIODevice;
+class DQmlCounter;
+class DQmlHistogram;
+class DQmlReadJob;
+class DQmlSharedRing;
+
+// One of the servers a DQmlMonitor sends to, with its own connection,
+// session and journal. The monitor reads and encodes each change once into
+// its queue of finished reads, which every target works through at the
+// pace of its own socket.
+class DQmlMonitorTarget : public QObject
+{
+    Q_OBJECT
+public:
+    typedef DQmlMonitor::EventType EventType;
+
+    // A 'local' target connects to the QLocalServer named 'host'
+    DQmlMonitorTarget(DQmlMonitor *monitor, const QString &host, quint16 port, bool local);
+    ~DQmlMonitorTarget();
+
+    QString host() const { return m_host; }
+    quint16 port() const { return m_port; }
+    bool isLocal() const { return m_local; }
+
+    // Connected and done with the handshake
+    bool isReady() const { return m_ready; }
+    // What the server handles, DQmlCapability, and the codec agreed on
+    uint capabilities() const { return m_serverCapabilities; }
+    QByteArray codec() const { return m_codec; }
+
+    // The sequence number of the next of the monitor's reads to send
+    quint64 nextToSend() const { return m_nextToSend; }
+    // Whether the socket has all it should be given for now
+    bool isBlocked() const;
+
+    void connectToServer();
+    void sendPending();
+    void defer(quint64 sequence);
+    void journalEvent(EventType type, const QString &id, const QString &path, const QString &file);
+
+private Q_SLOTS:
+    void socketConnected();
+    void socketDisconnected();
+    void socketError(QAbstractSocket::SocketError error);
+    void localSocketError(QLocalSocket::LocalSocketError error);
+    void socketBytesWritten();
+    void readReplies();
+
+protected:
+    void timerEvent(QTimerEvent *e);
+
+private:
+    bool canTake(const DQmlReadJob *job) const;
+    void beginStream(EventType type, const QString &id, const QString &path, const QString &file);
+    void sendChunk();
+    void abortStream();
+    void replayJournal();
+    void writeMessage(const QByteArray &message);
+    void acknowledge(quint64 sequence);
+    void resumeSession(quint64 sequence);
+    void sendHeartbeat();
+    void handleReply(const DQmlFrame &frame);
+    void flush();
+    void maybeNoSocketSoTryLater();
+
+    DQmlMonitor *m_monitor;
+
+    // A QTcpSocket or a QLocalSocket
+    QIODevice *m_socket;
+    QString m_host;
+    quint16 m_port;
+    bool m_local;
+    bool m_connected;
+    bool m_ready;
+    int m_connectTimer;
+    int m_heartbeatTimer;
+    int m_reconnectDelay;
+    QElapsedTimer m_lastReceived;
+
+    // What the server said it handles in its hello, DQmlCapability
+    uint m_serverCapabilities;
+    // The codec agreed on with the server, empty until it said hello
+    QByteArray m_codec;
+    // Replies which have only partly arrived
+    DQmlFrameReader m_replyReader;
+
+    // Large payloads go through here on local connections, once the
+    // server attached to it
+    DQmlSharedRing *m_ring;
+    bool m_ringReady;
+
+    quint64 m_nextToSend;
+
+    // The file being streamed, nothing else is sent until it's done
+    QFile *m_stream;
+    EventType m_streamType;
+    QString m_streamId;
+    QString m_streamPath;
+    QString m_streamName;
+    qint64 m_streamCreated;
+
+    // Changes which couldn't be sent, keyed on id and file name
+    struct JournalEntry {
+        quint64 order;
+        EventType type;
+        QString id;
+        QString path;
+        QString file;
+    };
+    QHash<QString, JournalEntry> m_journal;
+    quint64 m_journalOrder;
+    bool m_journalOverflowed;
+
+    // Messages are numbered in the session, events the server hasn't
+    // acknowledged yet are sent again after a reconnect
+    struct UnackedEvent {
+        UnackedEvent(quint64 s, qint64 c, EventType t, const QString &i, const QString &p, const QString &f)
+            : sequence(s), created(c), type(t), id(i), path(p), file(f) { }
+        quint64 sequence;
+        qint64 created;
+        EventType type;
+        QString id;
+        QString path;
+        QString file;
+    };
+    QByteArray m_sessionId;
+    quint64 m_sentSequence;
+    QList<UnackedEvent> m_unacked;
+
+    // Metrics of this target alone, named after it
+    DQmlCounter *m_bytesSent;
+    DQmlCounter *m_deferredEvents;
+    DQmlCounter *m_reconnects;
+    DQmlHistogram *m_rttUsecs;
+    DQmlHistogram *m_lagUsecs;
+    DQmlHistogram *m_pendingEvents;
+    DQmlHistogram *m_unackedEvents;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLMONITORTARGET_P_H
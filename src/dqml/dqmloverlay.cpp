@@ -0,0 +1,231 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmloverlay_p.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+
+#include <QtNetwork/QNetworkRequest>
+
+static const QString DQML_OVERLAY_SCHEME = QStringLiteral("dqml");
+static const QString DQML_QMLDIR = QStringLiteral("qmldir");
+
+void DQmlOverlay::addRoot(const QString &path)
+{
+    QWriteLocker locker(&m_lock);
+    if (!m_roots.contains(path))
+        m_roots << path;
+}
+
+bool DQmlOverlay::isMapped(const QString &path) const
+{
+    QReadLocker locker(&m_lock);
+    foreach (const QString &root, m_roots) {
+        if (path.startsWith(root) && (path.size() == root.size() || path.at(root.size()) == QLatin1Char('/')))
+            return true;
+    }
+    return false;
+}
+
+void DQmlOverlay::insert(const QString &path, const QByteArray &content)
+{
+    QWriteLocker locker(&m_lock);
+    Entry &e = m_entries[path];
+    e.content = content;
+    e.removed = false;
+}
+
+// Hides the file on disk or in the resources too
+void DQmlOverlay::remove(const QString &path)
+{
+    QWriteLocker locker(&m_lock);
+    Entry &e = m_entries[path];
+    e.content.clear();
+    e.removed = true;
+}
+
+bool DQmlOverlay::lookup(const QString &path, QByteArray *content, bool *removed) const
+{
+    QReadLocker locker(&m_lock);
+    QHash<QString, Entry>::const_iterator it = m_entries.constFind(path);
+    if (it == m_entries.constEnd())
+        return false;
+    *content = it->content;
+    *removed = it->removed;
+    return true;
+}
+
+bool DQmlOverlay::content(const QString &path, QByteArray *content) const
+{
+    bool removed = false;
+    if (lookup(path, content, &removed))
+        return !removed;
+
+    QFile f(path);
+    if (f.open(QFile::ReadOnly)) {
+        *content = f.readAll();
+        return true;
+    }
+
+    // The engine only finds the components of a remote directory through
+    // its qmldir, make one up for directories which don't have it
+    QFileInfo info(path);
+    if (info.fileName() == DQML_QMLDIR) {
+        *content = makeQmldir(info.path());
+        return true;
+    }
+    return false;
+}
+
+QByteArray DQmlOverlay::makeQmldir(const QString &directory) const
+{
+    QSet<QString> files = QDir(directory).entryList(QStringList() << QStringLiteral("*.qml"), QDir::Files).toSet();
+    {
+        QReadLocker locker(&m_lock);
+        QString prefix = directory + QLatin1Char('/');
+        for (QHash<QString, Entry>::const_iterator it = m_entries.constBegin(); it != m_entries.constEnd(); ++it) {
+            if (!it.key().startsWith(prefix) || !it.key().endsWith(QStringLiteral(".qml")))
+                continue;
+            QString name = it.key().mid(prefix.size());
+            if (name.contains(QLatin1Char('/')))
+                continue;
+            if (it->removed)
+                files.remove(name);
+            else
+                files.insert(name);
+        }
+    }
+
+    QByteArray qmldir;
+    foreach (const QString &file, files) {
+        if (!file.at(0).isUpper())
+            continue;
+        QByteArray name = file.toUtf8();
+        qmldir += name.left(name.size() - 4) + " 1.0 " + name + '\n';
+    }
+    return qmldir;
+}
+
+QUrl dqml_overlayUrl(const QString &path)
+{
+    QUrl url;
+    url.setScheme(DQML_OVERLAY_SCHEME);
+    if (dqml_isResourcePath(path)) {
+        url.setHost(QStringLiteral("qrc"));
+        url.setPath(path.mid(1));
+    } else {
+        url.setHost(QStringLiteral("file"));
+        // Windows paths start with the drive
+        url.setPath(path.startsWith(QLatin1Char('/')) ? path : QLatin1Char('/') + path);
+    }
+    return url;
+}
+
+QString dqml_overlayPath(const QUrl &url)
+{
+    QString path = url.path();
+    if (url.host() == QStringLiteral("qrc"))
+        return QLatin1Char(':') + path;
+    if (path.size() > 2 && path.at(2) == QLatin1Char(':'))
+        return path.mid(1);
+    return path;
+}
+
+QUrl DQmlOverlayInterceptor::intercept(const QUrl &url, DataType type)
+{
+    Q_UNUSED(type);
+    QString path;
+    if (url.isLocalFile())
+        path = QFileInfo(url.toLocalFile()).absoluteFilePath();
+    else if (url.scheme() == QStringLiteral("qrc"))
+        path = QLatin1Char(':') + url.path();
+    if (path.isEmpty() || !m_overlay->isMapped(path))
+        return url;
+    QUrl overlayUrl = dqml_overlayUrl(path);
+    overlayUrl.setQuery(url.query());
+    overlayUrl.setFragment(url.fragment());
+    return overlayUrl;
+}
+
+DQmlOverlayNetworkAccessManager::DQmlOverlayNetworkAccessManager(const DQmlOverlayPointer &overlay, QObject *parent)
+    : QNetworkAccessManager(parent)
+    , m_overlay(overlay)
+{
+}
+
+QNetworkReply *DQmlOverlayNetworkAccessManager::createRequest(Operation op, const QNetworkRequest &request,
+                                                              QIODevice *outgoingData)
+{
+    if (op != GetOperation || request.url().scheme() != DQML_OVERLAY_SCHEME)
+        return QNetworkAccessManager::createRequest(op, request, outgoingData);
+    QByteArray content;
+    bool found = m_overlay->content(dqml_overlayPath(request.url()), &content);
+    return new DQmlOverlayReply(request, content, found, this);
+}
+
+QNetworkAccessManager *DQmlOverlayNetworkAccessManagerFactory::create(QObject *parent)
+{
+    return new DQmlOverlayNetworkAccessManager(m_overlay, parent);
+}
+
+DQmlOverlayReply::DQmlOverlayReply(const QNetworkRequest &request, const QByteArray &content, bool found, QObject *parent)
+    : QNetworkReply(parent)
+    , m_content(content)
+    , m_offset(0)
+{
+    setRequest(request);
+    setUrl(request.url());
+    setOperation(QNetworkAccessManager::GetOperation);
+    setHeader(QNetworkRequest::ContentLengthHeader, m_content.size());
+    if (!found)
+        setError(ContentNotFoundError, QStringLiteral("Not found: ") + request.url().toString());
+    open(ReadOnly | Unbuffered);
+    setFinished(true);
+
+    // Whoever made the request connects to it first
+    if (found)
+        QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
+    QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+}
+
+qint64 DQmlOverlayReply::bytesAvailable() const
+{
+    return m_content.size() - m_offset + QNetworkReply::bytesAvailable();
+}
+
+qint64 DQmlOverlayReply::readData(char *data, qint64 maxSize)
+{
+    qint64 size = qMin(maxSize, m_content.size() - m_offset);
+    if (size <= 0)
+        return m_offset < m_content.size() ? 0 : -1;
+    memcpy(data, m_content.constData() + m_offset, size);
+    m_offset += size;
+    return size;
+}
@@ -0,0 +1,146 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLOVERLAY_P_H
+#define DQMLOVERLAY_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QStringList>
+#include <QtCore/QUrl>
+
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+
+#include <QtQml/QQmlAbstractUrlInterceptor>
+#include <QtQml/QQmlNetworkAccessManagerFactory>
+
+QT_BEGIN_NAMESPACE
+
+// Paths in compiled in resources, which can't be written to
+inline bool dqml_isResourcePath(const QString &path)
+{
+    return path.startsWith(QLatin1Char(':'));
+}
+
+// What a server received, kept in memory and served to the engine in
+// place of what's on disk or in the resources below the mapped
+// directories. Used from the engine's loader thread as well.
+class DQmlOverlay
+{
+public:
+    void addRoot(const QString &path);
+    bool isMapped(const QString &path) const;
+
+    void insert(const QString &path, const QByteArray &content);
+    void remove(const QString &path);
+
+    // The content of 'path', from the overlay or else from the file
+    // itself, false if neither has it
+    bool content(const QString &path, QByteArray *content) const;
+    // Whether the overlay knows 'path', and its content if it's not removed
+    bool lookup(const QString &path, QByteArray *content, bool *removed) const;
+
+private:
+    QByteArray makeQmldir(const QString &directory) const;
+
+    struct Entry {
+        QByteArray content;
+        bool removed;
+    };
+
+    mutable QReadWriteLock m_lock;
+    QStringList m_roots;
+    QHash<QString, Entry> m_entries;
+};
+
+typedef QSharedPointer<DQmlOverlay> DQmlOverlayPointer;
+
+// Files below the mapped directories are served as dqml://file/<path> or
+// dqml://qrc/<path>, so that everything they refer to goes through the
+// overlay too
+QUrl dqml_overlayUrl(const QString &path);
+QString dqml_overlayPath(const QUrl &url);
+
+class DQmlOverlayInterceptor : public QQmlAbstractUrlInterceptor
+{
+public:
+    DQmlOverlayInterceptor(const DQmlOverlayPointer &overlay) : m_overlay(overlay) { }
+
+    QUrl intercept(const QUrl &url, DataType type);
+
+private:
+    DQmlOverlayPointer m_overlay;
+};
+
+class DQmlOverlayNetworkAccessManager : public QNetworkAccessManager
+{
+public:
+    DQmlOverlayNetworkAccessManager(const DQmlOverlayPointer &overlay, QObject *parent);
+
+protected:
+    QNetworkReply *createRequest(Operation op, const QNetworkRequest &request, QIODevice *outgoingData);
+
+private:
+    DQmlOverlayPointer m_overlay;
+};
+
+class DQmlOverlayNetworkAccessManagerFactory : public QQmlNetworkAccessManagerFactory
+{
+public:
+    DQmlOverlayNetworkAccessManagerFactory(const DQmlOverlayPointer &overlay) : m_overlay(overlay) { }
+
+    QNetworkAccessManager *create(QObject *parent);
+
+private:
+    DQmlOverlayPointer m_overlay;
+};
+
+// Hands out content which is all there from the start
+class DQmlOverlayReply : public QNetworkReply
+{
+public:
+    DQmlOverlayReply(const QNetworkRequest &request, const QByteArray &content, bool found, QObject *parent);
+
+    qint64 bytesAvailable() const;
+    bool isSequential() const { return true; }
+    void abort() { }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+
+private:
+    QByteArray m_content;
+    qint64 m_offset;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLOVERLAY_P_H
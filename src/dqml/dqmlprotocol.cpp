@@ -0,0 +1,201 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlprotocol_p.h"
+
+#include <QtCore/QIODevice>
+
+#include <string.h>
+
+// What the frame reader starts out with and shrinks back to when it's empty
+static const int DQML_READER_BUFFER_SIZE = 64 * 1024;
+
+int dqml_parseFrame(const char *data, int size, DQmlFrame *frame)
+{
+    if (size < DQML_FRAME_HEADER_SIZE)
+        return 0;
+    if (dqml_readInt<quint16>(data) != DQML_FRAME_MAGIC)
+        return -1;
+
+    quint32 payloadLength = dqml_readInt<quint32>(data + 12);
+    if (payloadLength > DQML_MAX_PAYLOAD_SIZE)
+        return -1;
+
+    frame->version = quint8(data[2]);
+    frame->type = quint8(data[3]);
+    frame->flags = dqml_readInt<quint16>(data + 4);
+    frame->idLength = dqml_readInt<quint16>(data + 6);
+    frame->fileLength = dqml_readInt<quint16>(data + 8);
+    frame->payloadLength = payloadLength;
+    frame->payloadOffset = 0;
+    frame->payloadTotal = payloadLength;
+
+    qint64 frameSize = qint64(DQML_FRAME_HEADER_SIZE) + frame->idLength + frame->fileLength + payloadLength;
+    if (frameSize > size)
+        return 0;
+
+    frame->id = data + DQML_FRAME_HEADER_SIZE;
+    frame->file = frame->id + frame->idLength;
+    frame->payload = frame->file + frame->fileLength;
+    return int(frameSize);
+}
+
+DQmlFrameReader::DQmlFrameReader()
+    : m_begin(0)
+    , m_end(0)
+    , m_pieceSize(0)
+    , m_payloadLeft(0)
+{
+}
+
+void DQmlFrameReader::reserve(int size)
+{
+    if (m_begin == m_end) {
+        m_begin = m_end = 0;
+        // Don't hold on to what one large frame needed
+        if (m_buffer.size() > DQML_READER_BUFFER_SIZE && size <= DQML_READER_BUFFER_SIZE) {
+            m_buffer.resize(DQML_READER_BUFFER_SIZE);
+            m_buffer.squeeze();
+        }
+    }
+    if (m_buffer.size() - m_end >= size)
+        return;
+    if (m_begin > 0) {
+        ::memmove(m_buffer.data(), m_buffer.constData() + m_begin, m_end - m_begin);
+        m_end -= m_begin;
+        m_begin = 0;
+    }
+    if (m_buffer.size() - m_end < size)
+        m_buffer.resize(qMax(m_end + size, qMax(2 * m_buffer.size(), DQML_READER_BUFFER_SIZE)));
+}
+
+qint64 DQmlFrameReader::readFrom(QIODevice *device)
+{
+    qint64 available = device->bytesAvailable();
+    if (available <= 0)
+        return 0;
+    // Whatever doesn't fit now is left in the device for the next round
+    int size = int(qMin<qint64>(available, DQML_MAX_PAYLOAD_SIZE));
+    reserve(size);
+    qint64 read = device->read(m_buffer.data() + m_end, size);
+    if (read > 0)
+        m_end += int(read);
+    return read;
+}
+
+void DQmlFrameReader::append(const char *data, int size)
+{
+    reserve(size);
+    ::memcpy(m_buffer.data() + m_end, data, size);
+    m_end += size;
+}
+
+DQmlFrameReader::Result DQmlFrameReader::next(DQmlFrame *frame)
+{
+    if (m_payloadLeft > 0) {
+        int size = qMin(m_end - m_begin, m_payloadLeft);
+        if (size == 0)
+            return NeedMore;
+        *frame = m_pieceFrame;
+        frame->id = m_pieceHeader.constData() + DQML_FRAME_HEADER_SIZE;
+        frame->file = frame->id + frame->idLength;
+        frame->payload = m_buffer.constData() + m_begin;
+        frame->payloadLength = size;
+        frame->payloadOffset = m_pieceFrame.payloadTotal - m_payloadLeft;
+        m_begin += size;
+        m_payloadLeft -= size;
+        return PieceReady;
+    }
+
+    const char *data = m_buffer.constData() + m_begin;
+    int available = m_end - m_begin;
+    int size = dqml_parseFrame(data, available, frame);
+    if (size < 0)
+        return Garbled;
+    if (size > 0) {
+        m_begin += size;
+        return FrameReady;
+    }
+
+    // Only what's written straight into a file can be taken in pieces
+    if (m_pieceSize <= 0 || available < DQML_FRAME_HEADER_SIZE
+        || frame->payloadLength <= m_pieceSize
+        || (frame->type != DQmlChangeMessage && frame->type != DQmlAddMessage)
+        || (frame->flags & (DQmlCompressedFrame | DQmlSharedMemoryFrame))) {
+        return NeedMore;
+    }
+    int headerSize = DQML_FRAME_HEADER_SIZE + frame->idLength + frame->fileLength;
+    if (available < headerSize)
+        return NeedMore;
+
+    m_pieceHeader = QByteArray(data, headerSize);
+    m_pieceFrame = *frame;
+    m_payloadLeft = frame->payloadLength;
+    m_begin += headerSize;
+    return next(frame);
+}
+
+void DQmlFrameReader::clear()
+{
+    m_begin = m_end = 0;
+    m_payloadLeft = 0;
+    m_pieceHeader.clear();
+}
+
+bool dqml_fitsFrame(const QString &id, const QString &file)
+{
+    // UTF-8 takes at most 3 bytes per UTF-16 code unit
+    if (id.size() * 3 <= DQML_MAX_NAME_SIZE && file.size() * 3 <= DQML_MAX_NAME_SIZE)
+        return true;
+    return id.toUtf8().size() <= DQML_MAX_NAME_SIZE && file.toUtf8().size() <= DQML_MAX_NAME_SIZE;
+}
+
+QByteArray dqml_makeFrame(int type, const QString &id, const QString &file,
+                          const QByteArray &payload, int flags)
+{
+    QByteArray idUtf8 = id.toUtf8();
+    QByteArray fileUtf8 = file.toUtf8();
+    // Cut short, the lengths would point at another file
+    if (idUtf8.size() > DQML_MAX_NAME_SIZE || fileUtf8.size() > DQML_MAX_NAME_SIZE) {
+        qCWarning(DQML_LOG) << "name too long for a frame:" << id << file;
+        return QByteArray();
+    }
+
+    QByteArray frame;
+    frame.reserve(DQML_FRAME_HEADER_SIZE + idUtf8.size() + fileUtf8.size() + payload.size());
+    dqml_appendInt<quint16>(&frame, DQML_FRAME_MAGIC);
+    frame.append(char(DQML_PROTOCOL_VERSION));
+    frame.append(char(type));
+    dqml_appendInt<quint16>(&frame, flags);
+    dqml_appendInt<quint16>(&frame, idUtf8.size());
+    dqml_appendInt<quint16>(&frame, fileUtf8.size());
+    dqml_appendInt<quint16>(&frame, 0);
+    dqml_appendInt<quint32>(&frame, payload.size());
+    frame += idUtf8;
+    frame += fileUtf8;
+    frame += payload;
+    return frame;
+}
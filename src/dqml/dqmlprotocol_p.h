@@ -0,0 +1,239 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLPROTOCOL_P_H
+#define DQMLPROTOCOL_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/qendian.h>
+
+QT_BEGIN_NAMESPACE
+
+class QIODevice;
+
+// Everything between monitor and server is sent in frames:
+//
+//   quint16 magic, "DQ"
+//   quint8  protocol version
+//   quint8  type, a DQmlMessageType or a DQmlReplyType
+//   quint16 flags, DQmlFrameFlag
+//   quint16 id length
+//   quint16 file length
+//   quint16 reserved, 0
+//   quint32 payload length
+//   the tracker id, UTF-8
+//   the file name relative to the tracked directory, UTF-8
+//   the payload
+//
+// Integers are big endian. As the header has a fixed size, a frame can be
+// waited for or skipped without understanding it, and it is used right
+// where it lies in the receive buffer.
+static const quint16 DQML_FRAME_MAGIC = 0x4451;
+static const int DQML_PROTOCOL_VERSION = 1;
+static const int DQML_FRAME_HEADER_SIZE = 16;
+
+// Beyond this, we've lost track of where the frames are
+static const quint32 DQML_MAX_PAYLOAD_SIZE = 1024 * 1024 * 1024;
+
+// The id and file name lengths are quint16s
+static const int DQML_MAX_NAME_SIZE = 0xffff;
+
+enum DQmlFrameFlag {
+    // The payload is the quint32 uncompressed size followed by the payload
+    // compressed with the codec from the monitor's hello
+    DQmlCompressedFrame = 0x1,
+    // The payload is the quint64 position and quint32 size of the actual
+    // payload in the monitor's shared memory ring, the other flags apply
+    // to what's there
+    DQmlSharedMemoryFrame = 0x2
+};
+
+// What the server's hello says it handles, and the monitor's hello says
+// it will send
+enum DQmlCapability {
+    DQmlDeltaCapability = 0x1,
+    DQmlStreamCapability = 0x2,
+    DQmlChangeSetCapability = 0x4,
+    // Only offered on local connections
+    DQmlSharedMemoryCapability = 0x8
+};
+
+// Frames from the monitor to the server, and their payloads.
+enum DQmlMessageType {
+    DQmlChangeMessage = 1,      // content
+    DQmlAddMessage = 2,         // content
+    DQmlRemoveMessage = 3,      // nothing
+    DQmlDeltaMessage = 4,       // quint64 base hash, quint64 result hash, delta
+    // Large files are sent as a begin, any number of chunks and an end, so
+    // that neither side has to hold all of it. Nothing else is sent until
+    // the end and the server writes the chunks to the file as they come.
+    DQmlStreamBeginMessage = 5, // nothing
+    DQmlStreamChunkMessage = 6, // content
+    DQmlStreamEndMessage = 7,   // nothing
+
+    // The ones below have no id and file. The ones above are numbered from
+    // 1 at the start of the monitor's session, which the server
+    // acknowledges.
+
+    // Answers the server's hello. quint32 capabilities, followed by the
+    // name of the codec compressed frames use, if any.
+    DQmlHelloMessage = 8,
+    // Sent after the hello. quint64 sequence number of the last message
+    // sent, followed by the session id.
+    DQmlSessionMessage = 9,
+    // Sent every few seconds. qint64 timestamp, to be sent back.
+    DQmlHeartbeatMessage = 10,
+    // The messages between a begin and a commit are one changeset. The
+    // server holds on to them and applies them together on the commit,
+    // followed by a single reload. Changesets may nest, only the outermost
+    // commit applies. Nothing.
+    DQmlChangeSetBeginMessage = 11,
+    DQmlChangeSetCommitMessage = 12,
+    // Offers a DQmlSharedRing for large payloads, sent after the session.
+    // The key of the shared memory segment, UTF-8.
+    DQmlSharedMemoryMessage = 13
+};
+
+inline bool dqml_isNumberedMessage(int type) { return type < DQmlHelloMessage; }
+
+// Frames from the server back to the monitor, and their payloads.
+enum DQmlReplyType {
+    // The delta to the file in id and file did not apply to the server's
+    // copy, send the whole file. Nothing.
+    DQmlResendReply = 1,
+    // Sent on connect. quint32 capabilities, followed by the codecs the
+    // server can decompress, comma separated in order of preference.
+    DQmlHelloReply = 2,
+    // Sent for each tracker mapping, in id, after the session reply.
+    // quint32 count and for each file: quint16 name length, the name
+    // relative to the mapped directory in UTF-8, qint64 size and quint64
+    // dqml_hash() of the content.
+    DQmlManifestReply = 3,
+    // quint64 sequence number of the last message handled.
+    DQmlAckReply = 4,
+    // qint64 timestamp of the heartbeat.
+    DQmlHeartbeatReply = 5,
+    // quint64 sequence number of the last message handled in this session
+    // before the monitor reconnected, 0 for a new session.
+    DQmlSessionReply = 6,
+    // The server attached to the monitor's shared memory ring, frames may
+    // use it from here on. Nothing.
+    DQmlSharedMemoryReply = 7
+};
+
+// A frame as it lies in a buffer
+struct DQmlFrame
+{
+    int version;
+    int type;
+    int flags;
+    const char *id;
+    int idLength;
+    const char *file;
+    int fileLength;
+    const char *payload;
+    int payloadLength;
+    // A frame handed out in pieces by DQmlFrameReader has part of the
+    // payload, starting at 'payloadOffset' of the 'payloadTotal' bytes
+    int payloadOffset;
+    int payloadTotal;
+
+    bool isLastPiece() const { return payloadOffset + payloadLength == payloadTotal; }
+    QString idString() const { return QString::fromUtf8(id, idLength); }
+    QString fileString() const { return QString::fromUtf8(file, fileLength); }
+};
+
+// Looks for a frame at the start of 'data'. Returns its size, 0 if the
+// 'size' bytes don't hold all of it yet or -1 if 'data' isn't a frame.
+int dqml_parseFrame(const char *data, int size, DQmlFrame *frame);
+
+// Collects the frames coming in on a connection in a buffer which is
+// reused for as long as it lasts. Frames are handed out where they lie and
+// stay valid until the next readFrom(), the buffer is only compacted when
+// more data wouldn't fit behind what's in it. A change or addition larger
+// than the piece size is handed out in pieces as they arrive, so that a
+// large file is never held in memory whole.
+class DQmlFrameReader
+{
+public:
+    enum Result {
+        NeedMore,
+        FrameReady,
+        PieceReady,
+        Garbled
+    };
+
+    DQmlFrameReader();
+
+    // 0, the default, hands out every frame whole
+    void setPieceSize(int bytes) { m_pieceSize = bytes; }
+
+    // Appends what 'device' has to read without waiting for more
+    qint64 readFrom(QIODevice *device);
+    void append(const char *data, int size);
+    Result next(DQmlFrame *frame);
+    void clear();
+
+    int buffered() const { return m_end - m_begin; }
+
+private:
+    void reserve(int size);
+
+    QByteArray m_buffer;
+    int m_begin;
+    int m_end;
+    int m_pieceSize;
+
+    // The frame being handed out in pieces, with its id and file
+    DQmlFrame m_pieceFrame;
+    QByteArray m_pieceHeader;
+    int m_payloadLeft;
+};
+
+// Returns a null QByteArray if 'id' or 'file' is too long for a frame
+QByteArray dqml_makeFrame(int type, const QString &id, const QString &file,
+                          const QByteArray &payload = QByteArray(), int flags = 0);
+// Whether 'id' and 'file' can be sent in a frame
+bool dqml_fitsFrame(const QString &id, const QString &file);
+
+template <typename T> inline void dqml_appendInt(QByteArray *out, T value)
+{
+    uchar buffer[sizeof(T)];
+    qToBigEndian<T>(value, buffer);
+    out->append(reinterpret_cast<const char *>(buffer), sizeof(T));
+}
+
+template <typename T> inline T dqml_readInt(const char *data)
+{
+    return qFromBigEndian<T>(reinterpret_cast<const uchar *>(data));
+}
+
+QT_END_NAMESPACE
+
+#endif // DQMLPROTOCOL_P_H
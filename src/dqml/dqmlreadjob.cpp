@@ -0,0 +1,153 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlreadjob_p.h"
+#include "dqmlcodec.h"
+#include "dqmldelta_p.h"
+#include "dqmlhash_p.h"
+#include "dqmlmetrics.h"
+#include "dqmlprotocol_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+struct DQmlReadMetrics
+{
+    DQmlReadMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        messagesCompressed = m->counter(QStringLiteral("monitor.messagesCompressed"));
+        deltasSent = m->counter(QStringLiteral("monitor.deltasSent"));
+        deltaBytesSaved = m->counter(QStringLiteral("monitor.deltaBytesSaved"));
+        readUsecs = m->histogram(QStringLiteral("monitor.readUsecs"));
+    }
+
+    DQmlCounter *messagesCompressed;
+    DQmlCounter *deltasSent;
+    DQmlCounter *deltaBytesSaved;
+    DQmlHistogram *readUsecs;
+};
+
+Q_GLOBAL_STATIC(DQmlReadMetrics, dqml_metrics)
+
+QByteArray dqml_fileContent(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        qWarning() << "failed to read file" << path;
+        return QByteArray();
+    }
+    return file.readAll();
+}
+
+// Images and the like are compressed already, another round only costs time
+static bool dqml_isCompressedFormat(const QString &file)
+{
+    static const char *suffixes[] = { ".png", ".jpg", ".jpeg", ".gif", ".webp", ".ktx",
+                                      ".mp3", ".ogg", ".mp4", ".gz", ".zip", 0 };
+    for (const char **s = suffixes; *s; ++s) {
+        if (file.endsWith(QLatin1String(*s), Qt::CaseInsensitive))
+            return true;
+    }
+    return false;
+}
+
+QByteArray dqml_encodeFrame(int type, const QString &id, const QString &file, const QByteArray &payload,
+                            DQmlCodec *codec, int level, int threshold)
+{
+    if (codec && payload.size() >= threshold && !dqml_isCompressedFormat(file)) {
+        QByteArray compressed = codec->compress(payload, level);
+        // Don't make the server decompress for a few percent
+        if (!compressed.isEmpty() && compressed.size() < payload.size() - payload.size() / 8) {
+            QByteArray wrapped;
+            wrapped.reserve(sizeof(quint32) + compressed.size());
+            dqml_appendInt<quint32>(&wrapped, payload.size());
+            wrapped += compressed;
+            dqml_metrics()->messagesCompressed->add();
+            return dqml_makeFrame(type, id, file, wrapped, DQmlCompressedFrame);
+        }
+    }
+    return dqml_makeFrame(type, id, file, payload);
+}
+
+DQmlReadJob::DQmlReadJob()
+    : monitor(0)
+    , sequence(0)
+    , type(0)
+    , target(0)
+    , created(0)
+    , unlessHash(0)
+    , codec(0)
+    , level(-1)
+    , threshold(0)
+    , streamThreshold(0)
+    , skipped(false)
+    , streamed(false)
+{
+    setAutoDelete(false);
+}
+
+void DQmlReadJob::run()
+{
+    {
+        DQmlScopedTimer timer(dqml_metrics()->readUsecs);
+        QString fileName = path + QStringLiteral("/") + file;
+        if (type == DQmlRemoveMessage || !dqml_isNumberedMessage(type)) {
+            // Nothing to read for a removal or a changeset marker
+            message = dqml_makeFrame(type, id, file);
+        } else if (streamThreshold > 0 && QFileInfo(fileName).size() >= streamThreshold) {
+            // Don't pull it all into memory, hashing maps the file
+            skipped = unlessHash != 0 && dqml_hashFile(fileName) == unlessHash;
+            streamed = !skipped;
+        } else {
+            content = dqml_fileContent(fileName);
+            skipped = unlessHash != 0 && dqml_hash(content.constData(), content.size()) == unlessHash;
+
+            // When the server should have an earlier version, only send
+            // what differs from it
+            QByteArray delta;
+            if (!skipped && !base.isNull())
+                delta = dqml_makeDelta(base, content);
+
+            if (skipped) {
+                // Nothing to send
+            } else if (!delta.isEmpty()) {
+                QByteArray payload;
+                payload.reserve(2 * sizeof(quint64) + delta.size());
+                dqml_appendInt<quint64>(&payload, dqml_hash(base.constData(), base.size()));
+                dqml_appendInt<quint64>(&payload, dqml_hash(content.constData(), content.size()));
+                payload += delta;
+                message = dqml_encodeFrame(DQmlDeltaMessage, id, file, payload, codec, level, threshold);
+                dqml_metrics()->deltasSent->add();
+                dqml_metrics()->deltaBytesSaved->add(content.size() - delta.size());
+            } else {
+                message = dqml_encodeFrame(type, id, file, content, codec, level, threshold);
+            }
+        }
+    }
+
+    QMetaObject::invokeMethod(monitor, "readFinished", Qt::QueuedConnection, Q_ARG(quint64, sequence));
+}
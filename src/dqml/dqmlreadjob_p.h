@@ -0,0 +1,89 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLREADJOB_P_H
+#define DQMLREADJOB_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QRunnable>
+#include <QtCore/QString>
+
+QT_BEGIN_NAMESPACE
+
+class DQmlCodec;
+class DQmlMonitorTarget;
+
+// Reads a file and turns it into the message the server is sent for it,
+// delta encoded and compressed as asked, on one of the monitor's read
+// threads. When done, the monitor's readFinished() is invoked with the
+// sequence number. The monitor owns the job.
+class DQmlReadJob : public QRunnable
+{
+public:
+    DQmlReadJob();
+
+    void run();
+
+    QObject *monitor;
+    quint64 sequence;
+    int type;
+    QString id;
+    QString path;
+    QString file;
+    // The one server this is for, null when it's for all of them
+    DQmlMonitorTarget *target;
+    // When the change was seen, in microseconds on the monitor's clock
+    qint64 created;
+    // What the server should have of the file, to make a delta against,
+    // null when it doesn't take deltas
+    QByteArray base;
+    // If the content hashes to this, the server has it already
+    quint64 unlessHash;
+    DQmlCodec *codec;
+    int level;
+    int threshold;
+    // Files this large are left to the monitor to stream
+    qint64 streamThreshold;
+
+    // Results
+    QByteArray message;
+    QByteArray content;
+    bool skipped;
+    bool streamed;
+};
+
+QByteArray dqml_fileContent(const QString &path);
+
+// Makes a frame of 'payload', compressed with 'codec' unless that doesn't
+// pay off or 'file' is compressed already
+QByteArray dqml_encodeFrame(int type, const QString &id, const QString &file, const QByteArray &payload,
+                            DQmlCodec *codec, int level, int threshold);
+
+QT_END_NAMESPACE
+
+#endif // DQMLREADJOB_P_H
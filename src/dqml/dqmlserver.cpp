@@ -25,11 +25,17 @@
 */
 
 #include "dqmlserver.h"
+#include "dqmlmetrics.h"
+#include "dqmloverlay_p.h"
+#include "dqmlserverconnection_p.h"
+#include "dqmlwritejob_p.h"
 
-#include <QFile>
-#include <QFileInfo>
+#include <QDir>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QThreadPool>
 
 #include <QQmlEngine>
 #include <QQmlComponent>
@@ -37,6 +43,25 @@
 #include <QQuickView>
 #include <QQuickItem>
 
+struct DQmlServerMetrics
+{
+    DQmlServerMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        reloads = m->counter(QStringLiteral("server.reloads"));
+        connectionsAccepted = m->counter(QStringLiteral("server.connectionsAccepted"));
+        connections = m->histogram(QStringLiteral("server.connections"));
+        reloadUsecs = m->histogram(QStringLiteral("server.reloadUsecs"));
+    }
+
+    DQmlCounter *reloads;
+    DQmlCounter *connectionsAccepted;
+    DQmlHistogram *connections;
+    DQmlHistogram *reloadUsecs;
+};
+
+Q_GLOBAL_STATIC(DQmlServerMetrics, dqml_metrics)
+
 DQmlServer::DQmlServer(QQmlEngine *engine, QQuickView *view, const QString &file)
     : m_file(file)
     , m_engine(engine)
@@ -45,15 +70,77 @@ DQmlServer::DQmlServer(QQmlEngine *engine, QQuickView *view, const QString &file
     , m_createViewIfNeeded(false)
     , m_ownsView(false)
     , m_pendingReload(false)
+    , m_loadingComponent(0)
     , m_tcpServer(0)
-    , m_clientSocket(0)
+    , m_localServer(0)
+    , m_writePool(0)
+    , m_partFiles(0)
+    , m_overlayInterceptor(0)
+    , m_overlayFactory(0)
+{
+    // One thread keeps the batches in order
+    m_writePool = new QThreadPool(this);
+    m_writePool->setMaxThreadCount(1);
+}
+
+DQmlServer::~DQmlServer()
+{
+    m_writePool->waitForDone();
+    qDeleteAll(m_writing);
+    qDeleteAll(m_connections);
+    setOverlayEnabled(false);
+}
+
+void DQmlServer::addTrackerMapping(const QString &id, const QString &path)
 {
+    QString dir = path;
+    if (dir.startsWith(QStringLiteral("qrc:")))
+        dir = dir.mid(3);
+    if (!dqml_isResourcePath(dir))
+        dir = QDir(dir).absolutePath();
+    while (dir.size() > 2 && dir.endsWith(QLatin1Char('/')))
+        dir.chop(1);
+    m_trackerMapping.insert(id, dir);
+    if (m_overlay)
+        m_overlay->addRoot(dir);
+}
+
+void DQmlServer::setOverlayEnabled(bool enabled)
+{
+    if (enabled == isOverlayEnabled())
+        return;
+
+    if (!enabled) {
+        if (m_engine && m_engine->urlInterceptor() == m_overlayInterceptor)
+            m_engine->setUrlInterceptor(0);
+        if (m_engine && m_engine->networkAccessManagerFactory() == m_overlayFactory)
+            m_engine->setNetworkAccessManagerFactory(0);
+        delete m_overlayInterceptor;
+        delete m_overlayFactory;
+        m_overlayInterceptor = 0;
+        m_overlayFactory = 0;
+        m_overlay.clear();
+        return;
+    }
+
+    if (m_engine->networkAccessManagerFactory()) {
+        qCWarning(DQML_LOG) << "the engine has a network access manager factory, can't serve from an overlay";
+        return;
+    }
+
+    m_overlay = DQmlOverlayPointer(new DQmlOverlay());
+    foreach (const QString &dir, m_trackerMapping)
+        m_overlay->addRoot(dir);
+    m_overlayInterceptor = new DQmlOverlayInterceptor(m_overlay);
+    m_overlayFactory = new DQmlOverlayNetworkAccessManagerFactory(m_overlay);
+    m_engine->setUrlInterceptor(m_overlayInterceptor);
+    m_engine->setNetworkAccessManagerFactory(m_overlayFactory);
 }
 
 void DQmlServer::listen(quint16 port)
 {
-    if (m_tcpServer || m_clientSocket) {
-        qCDebug(DQML_LOG) << "asked to listen on port" << port << "when already connected...";
+    if (m_tcpServer) {
+        qCDebug(DQML_LOG) << "asked to listen on port" << port << "when already listening...";
         return;
     }
     m_tcpServer = new QTcpServer();
@@ -67,95 +154,151 @@ void DQmlServer::listen(quint16 port)
     connect(m_tcpServer, SIGNAL(acceptError(QAbstractSocket::SocketError)), this, SLOT(acceptError(QAbstractSocket::SocketError)));
 }
 
-void DQmlServer::newConnection()
+void DQmlServer::listenLocal(const QString &name)
 {
-    if (m_clientSocket) {
-        qCDebug(DQML_LOG) << " -> already got a connection, ignoring...";
+    if (m_localServer) {
+        qCDebug(DQML_LOG) << "asked to listen on" << name << "when already listening locally...";
         return;
     }
-    m_clientSocket = m_tcpServer->nextPendingConnection();
-    qCDebug(DQML_LOG) << "connecting to client" << m_clientSocket->peerAddress();
-    connect(m_clientSocket, SIGNAL(readyRead()), this, SLOT(read()));
+    // A server which crashed leaves its socket file behind
+    QLocalServer::removeServer(name);
+    m_localServer = new QLocalServer();
+    if (m_localServer->listen(name)) {
+        qCDebug(DQML_LOG) << "server listening on" << m_localServer->fullServerName();
+    } else {
+        qCDebug(DQML_LOG) << "Server failed to listen.." << m_localServer->errorString();
+    }
+
+    connect(m_localServer, SIGNAL(newConnection()), this, SLOT(newLocalConnection()));
 }
 
-void DQmlServer::acceptError(QAbstractSocket::SocketError error)
+
+void DQmlServer::newConnection()
 {
-    qDebug() << "Network error:" << error;
+    while (QTcpSocket *socket = m_tcpServer->nextPendingConnection()) {
+        qCDebug(DQML_LOG) << "connecting to client" << socket->peerAddress();
+        acceptConnection(socket, false);
+    }
 }
 
-void DQmlServer::read()
+void DQmlServer::newLocalConnection()
 {
-    QDataStream stream(m_clientSocket);
-    QString id, file, content;
-    int type;
-
-    char *data = 0;
-    int dataLength = 0;
+    while (QLocalSocket *socket = m_localServer->nextPendingConnection()) {
+        qCDebug(DQML_LOG) << "connecting to local client";
+        acceptConnection(socket, true);
+    }
+}
 
-    stream >> type >> id >> file;
+void DQmlServer::acceptConnection(QIODevice *socket, bool local)
+{
+    m_connections << new DQmlServerConnection(this, socket, local);
+    dqml_metrics()->connectionsAccepted->add();
+    dqml_metrics()->connections->record(m_connections.size());
+}
 
-    if (type == 1 || type == 2) {
-        stream >> dataLength;
-        data = (char *) malloc(dataLength);
+// What the connection queued is still written, only nobody is told
+void DQmlServer::removeConnection(DQmlServerConnection *connection)
+{
+    if (!m_connections.removeOne(connection))
+        return;
+    foreach (DQmlWriteJob *job, m_writing) {
+        if (job->connection == connection)
+            job->connection = 0;
+    }
+    qCDebug(DQML_LOG) << connection << "closed," << m_connections.size() << "connections left";
+}
 
-        char *d = data;
+void DQmlServer::queueWrites(DQmlWriteJob *job)
+{
+    job->server = this;
+    m_writing << job;
+    m_writePool->start(job);
+}
 
-        int bytesLeft = dataLength;
-        while (bytesLeft > 0) {
-            char chunk[1024];
-            int actual = stream.readRawData(chunk, qMin<int>(bytesLeft, sizeof(chunk)));
-            memcpy(d, chunk, actual);
-            bytesLeft -= actual;
-            d += actual;
+void DQmlServer::writeFinished()
+{
+    DQmlWriteJob *job = m_writing.takeFirst();
+    if (job->failed) {
+        // Nothing of the session from here on is durable. Dropping the
+        // connection makes the monitor resend it from what is.
+        foreach (DQmlWriteJob *later, m_writing) {
+            if (later->session == job->session)
+                later->session.clear();
+        }
+        if (job->connection) {
+            qCWarning(DQML_LOG) << "failed to write what" << job->connection << "sent, disconnecting it";
+            job->connection->close();
+            job->connection = 0;
         }
+    } else if (!job->session.isEmpty()) {
+        quint64 &durable = m_sessions[job->session];
+        durable = qMax(durable, job->sequence);
     }
+    if (job->connection)
+        job->connection->writeFinished(job);
+    // A half written file or changeset is not worth reloading for, its
+    // connection asks again once it's complete
+    if (job->reload && !(job->connection && job->connection->isBusy()))
+        scheduleReload();
+    delete job;
+}
 
-    if (!m_trackerMapping.contains(id)) {
-        qCDebug(DQML_LOG) << " -> got data for unknown id, aborting" << id;
-        qCDebug(DQML_LOG) << " --->" << m_trackerMapping.keys();
+// Changes from all connections which come in until the reload happens
+// share it
+void DQmlServer::scheduleReload()
+{
+    if (m_pendingReload)
         return;
-    }
-    QString fileName = m_trackerMapping.value(id) + QStringLiteral("/") + file;
-
-    if (type == 1 || type == 2) {
-        QFile f(fileName);
-        if (!f.open(QFile::WriteOnly)) {
-            qCDebug(DQML_LOG) << " -> failed to write" << QFileInfo(f).absoluteFilePath() << f.errorString();
-            return;
-        }
-        f.write(data, dataLength);
-        qCDebug(DQML_LOG) << " -> updated" << id << ":" << file;
-    } else if (type == 3) {
-        QFile f(fileName);
-        bool removed = f.remove();
-        if (removed)
-            qCDebug(DQML_LOG) << " -> removed" << id << ":" << file;
-        else
-            qCDebug(DQML_LOG) << " -> failed to remove" << id << ":" << file;
-    }
+    QMetaObject::invokeMethod(this, "reloadQml", Qt::QueuedConnection);
+    m_pendingReload = true;
+}
 
-    // More commands in the queue, invoke ourselves again..
-    if (!m_clientSocket->atEnd())
-        QMetaObject::invokeMethod(this, "read", Qt::QueuedConnection);
-    else if (!m_pendingReload) {
-        QMetaObject::invokeMethod(this, "reloadQml", Qt::QueuedConnection);
-        m_pendingReload = true;
-    }
+void DQmlServer::acceptError(QAbstractSocket::SocketError error)
+{
+    qDebug() << "Network error:" << error;
 }
 
 void DQmlServer::reloadQml()
 {
     m_pendingReload = false;
     qCDebug(DQML_LOG) << "reloading...";
+    dqml_metrics()->reloads->add();
+    m_reloadTimer.start();
     delete m_contentItem;
     m_contentItem = 0;
+    // A reload which comes in while the previous one is still loading
+    // replaces it
+    if (m_loadingComponent) {
+        disconnect(m_loadingComponent, 0, this, 0);
+        m_loadingComponent->deleteLater();
+        m_loadingComponent = 0;
+    }
     m_engine->clearComponentCache();
 
     QQmlComponent *component = new QQmlComponent(m_engine);
-    QUrl fileUrl = QUrl::fromLocalFile(m_file);
-    component->loadUrl(fileUrl);
+    component->loadUrl(QUrl::fromLocalFile(m_file));
     qCDebug(DQML_LOG) << "loaded url..";
 
+    if (component->isLoading()) {
+        m_loadingComponent = component;
+        connect(component, SIGNAL(statusChanged(QQmlComponent::Status)), this, SLOT(componentStatusChanged()));
+        return;
+    }
+    showComponent(component);
+}
+
+void DQmlServer::componentStatusChanged()
+{
+    QQmlComponent *component = m_loadingComponent;
+    if (!component || component->isLoading())
+        return;
+    disconnect(component, 0, this, 0);
+    m_loadingComponent = 0;
+    showComponent(component);
+}
+
+void DQmlServer::showComponent(QQmlComponent *component)
+{
     if (!component->isReady()) {
         qWarning() << component->errorString();
         return;
@@ -189,7 +332,7 @@ void DQmlServer::reloadQml()
             qCDebug(DQML_LOG) << "created a view to hold the QML";
         }
         if (m_view) {
-            m_view->setContent(fileUrl, component, m_contentItem);
+            m_view->setContent(component->url(), component, m_contentItem);
             if (winPos.x() >= 0 && winPos.y() >= 0)
                 m_view->setPosition(winPos);
             if (winSize.width() > 0 && winSize.height() > 0)
@@ -199,7 +342,5 @@ void DQmlServer::reloadQml()
         else
             qCDebug(DQML_LOG) << "no view to show qml, set 'setCreatesViewIfNeeded(true)' or supply one.";
     }
+    dqml_metrics()->reloadUsecs->record(m_reloadTimer.nsecsElapsed() / 1000);
 }
-
-
-
@@ -28,54 +28,119 @@
 #define DQMLSERVER_H
 
 #include <dqml/dqmlglobal.h>
+#include <dqml/dqmlfiletracker.h>
 
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QSharedPointer>
 
 #include <QtNetwork/QAbstractSocket>
 
 QT_BEGIN_NAMESPACE
 
-class QTcpSocket;
+class DQmlOverlay;
+class DQmlOverlayInterceptor;
+class DQmlOverlayNetworkAccessManagerFactory;
+class DQmlServerConnection;
+class DQmlWriteJob;
+class QIODevice;
+class QLocalServer;
 class QTcpServer;
+class QThreadPool;
+class QQmlComponent;
 class QQmlEngine;
 class QQuickView;
 
+// Takes the changes from any number of monitors, say one per developer or
+// per tracked repository, each on a connection of its own. Their changes
+// are written by one writer thread in the order they arrive and reloaded
+// for together.
 class DQML_EXPORT DQmlServer : public QObject
 {
     Q_OBJECT
 public:
     DQmlServer(QQmlEngine *engine, QQuickView *view, const QString &file);
+    ~DQmlServer();
 
     void setCreateViewIfNeeded(bool createView) { m_createViewIfNeeded = createView; }
     bool createsViewIfNeeded() const { return m_createViewIfNeeded; }
 
-    void addTrackerMapping(const QString &id, const QString &path) { m_trackerMapping.insert(id, path); }
+    // 'path' is a directory, or a resource directory like ":/qml" or
+    // "qrc:/qml" which can only be changed with the overlay on
+    void addTrackerMapping(const QString &id, const QString &path);
+
+    // Serves what was received from memory, in place of what's on disk or
+    // in the resources of the mapped directories, so that a reload doesn't
+    // wait for the disk. The files are still written in the background.
+    // Installs a URL interceptor and network access manager factory on the
+    // engine, so it must be turned on before the first reload.
+    void setOverlayEnabled(bool enabled);
+    bool isOverlayEnabled() const { return !m_overlay.isNull(); }
+
+    int connectionCount() const { return m_connections.size(); }
 
 public Q_SLOTS:
     void listen(quint16 port);
+    // Listens for monitors on this machine on the QLocalServer 'name'
+    void listenLocal(const QString &name);
     void reloadQml();
 
 private Q_SLOTS:
     void newConnection();
+    void newLocalConnection();
     void acceptError(QAbstractSocket::SocketError error);
-
-    void read();
+    void writeFinished();
+    void componentStatusChanged();
 
 private:
+    friend class DQmlServerConnection;
+
+    void acceptConnection(QIODevice *socket, bool local);
+    void removeConnection(DQmlServerConnection *connection);
+    void queueWrites(DQmlWriteJob *job);
+    void scheduleReload();
+    void showComponent(QQmlComponent *component);
+
     QString m_file;
 
-    QQmlEngine *m_engine;
+    // Applications may destroy the engine before the server
+    QPointer<QQmlEngine> m_engine;
     QQuickView *m_view;
     QObject *m_contentItem;
 
     bool m_createViewIfNeeded;
     bool m_ownsView;
     bool m_pendingReload;
+    // Components served from the overlay load asynchronously
+    QQmlComponent *m_loadingComponent;
+    QElapsedTimer m_reloadTimer;
 
     QTcpServer *m_tcpServer;
-    QTcpSocket *m_clientSocket;
+    QLocalServer *m_localServer;
+    QList<DQmlServerConnection *> m_connections;
 
     QHash<QString, QString> m_trackerMapping;
+
+    // Hashes of the files in the mapped directories, so that they are only
+    // rehashed on connect if they changed
+    QHash<QString, DQmlFileTracker::FileState> m_fileStates;
+
+    // How far each monitor's session got onto disk, for when it reconnects
+    QHash<QByteArray, quint64> m_sessions;
+
+    // Received files are put in place by a single writer thread, one batch
+    // per read of a connection, in order
+    QThreadPool *m_writePool;
+    QList<DQmlWriteJob *> m_writing;
+    // Numbers part files, a pending batch may still be moving a previous
+    // one of the same file into place
+    int m_partFiles;
+
+    QSharedPointer<DQmlOverlay> m_overlay;
+    DQmlOverlayInterceptor *m_overlayInterceptor;
+    DQmlOverlayNetworkAccessManagerFactory *m_overlayFactory;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,758 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlserverconnection_p.h"
+#include "dqmlcodec.h"
+#include "dqmldelta_p.h"
+#include "dqmlhash_p.h"
+#include "dqmlmetrics.h"
+#include "dqmloverlay_p.h"
+#include "dqmltransport_p.h"
+#include "dqmlwritejob_p.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QDateTime>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QTimerEvent>
+
+#include <QtNetwork/QAbstractSocket>
+
+struct DQmlServerConnectionMetrics
+{
+    DQmlServerConnectionMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        filesReceived = m->counter(QStringLiteral("server.filesReceived"));
+        bytesReceived = m->counter(QStringLiteral("server.bytesReceived"));
+        bytesDecompressed = m->counter(QStringLiteral("server.bytesDecompressed"));
+        filesRemoved = m->counter(QStringLiteral("server.filesRemoved"));
+        deltasApplied = m->counter(QStringLiteral("server.deltasApplied"));
+        resendsRequested = m->counter(QStringLiteral("server.resendsRequested"));
+        acksSent = m->counter(QStringLiteral("server.acksSent"));
+        changeSetsApplied = m->counter(QStringLiteral("server.changeSetsApplied"));
+        changeSetSize = m->histogram(QStringLiteral("server.changeSetSize"));
+        filesInPieces = m->counter(QStringLiteral("server.filesInPieces"));
+        staleConnections = m->counter(QStringLiteral("server.staleConnections"));
+        parseUsecs = m->histogram(QStringLiteral("server.parseUsecs"));
+        writeUsecs = m->histogram(QStringLiteral("server.writeUsecs"));
+        manifestUsecs = m->histogram(QStringLiteral("server.manifestUsecs"));
+    }
+
+    DQmlCounter *filesReceived;
+    DQmlCounter *bytesReceived;
+    DQmlCounter *bytesDecompressed;
+    DQmlCounter *filesRemoved;
+    DQmlCounter *deltasApplied;
+    DQmlCounter *resendsRequested;
+    DQmlCounter *acksSent;
+    DQmlCounter *changeSetsApplied;
+    DQmlHistogram *changeSetSize;
+    DQmlCounter *filesInPieces;
+    DQmlCounter *staleConnections;
+    DQmlHistogram *parseUsecs;
+    DQmlHistogram *writeUsecs;
+    DQmlHistogram *manifestUsecs;
+};
+
+Q_GLOBAL_STATIC(DQmlServerConnectionMetrics, dqml_metrics)
+
+// Monitors send a heartbeat every 2 seconds, a connection which is silent
+// for much longer than that is gone
+static const int DQML_STALE_CHECK_INTERVAL = 5000;
+static const int DQML_STALE_TIMEOUT = 15000;
+
+// Streamed files are written under this suffix and renamed into place once
+// complete, so that a reload never sees half of one
+static const QString DQML_PART_SUFFIX = QStringLiteral(".dqmlpart");
+
+// Changesets hold on to smaller files in memory until they're committed,
+// and larger ones are written to a part file as they arrive
+static const int DQML_STAGED_CONTENT_SIZE = 256 * 1024;
+
+// Rebuilds the new content of a file from 'base' and 'delta'. Fails if
+// 'base' isn't the one the delta was made against.
+static bool dqml_patch(const QByteArray &base, quint64 baseHash, quint64 resultHash,
+                       const QByteArray &delta, QByteArray *result)
+{
+    return dqml_hash(base.constData(), base.size()) == baseHash
+            && dqml_applyDelta(base, delta, result)
+            && dqml_hash(result->constData(), result->size()) == resultHash;
+}
+
+DQmlServerConnection::DQmlServerConnection(DQmlServer *server, QIODevice *socket, bool local)
+    : QObject(server)
+    , m_server(server)
+    , m_socket(socket)
+    , m_closed(false)
+    , m_staleTimer(0)
+    , m_codec(0)
+    , m_pieceFile(0)
+    , m_ring(0)
+    , m_streamFile(0)
+    , m_lastSequence(0)
+    , m_queuedSequence(0)
+    , m_durableSequence(0)
+    , m_ackedSequence(0)
+    , m_writeBatch(0)
+    , m_changeSetDepth(0)
+    , m_changeSetStart(0)
+{
+    m_socket->setParent(this);
+    m_reader.setPieceSize(DQML_STAGED_CONTENT_SIZE);
+    connect(m_socket, SIGNAL(readyRead()), this, SLOT(read()));
+    connect(m_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+    m_lastReceived.start();
+    m_staleTimer = startTimer(DQML_STALE_CHECK_INTERVAL);
+
+    // Tell the monitor what we handle and how it may compress what it
+    // sends us. Shared memory only works on the same machine.
+    uint capabilities = DQmlDeltaCapability | DQmlStreamCapability | DQmlChangeSetCapability;
+    if (local)
+        capabilities |= DQmlSharedMemoryCapability;
+    QByteArray hello;
+    dqml_appendInt<quint32>(&hello, capabilities);
+    QList<QByteArray> codecs = DQmlCodec::codecNames();
+    for (int i = 0; i < codecs.size(); ++i) {
+        if (i > 0)
+            hello += ',';
+        hello += codecs.at(i);
+    }
+    m_socket->write(dqml_makeFrame(DQmlHelloReply, QString(), QString(), hello));
+    dqml_flushSocket(m_socket);
+}
+
+DQmlServerConnection::~DQmlServerConnection()
+{
+    abortChangeSet();
+    discardPieces();
+    if (m_streamFile) {
+        m_streamFile->remove();
+        delete m_streamFile;
+    }
+    delete m_writeBatch;
+    delete m_ring;
+}
+
+// Drops the connection and everything it had only partly received. What
+// it handed to the writer is still written.
+void DQmlServerConnection::close()
+{
+    if (m_closed)
+        return;
+    m_closed = true;
+    disconnect(m_socket, 0, this, 0);
+    dqml_abortSocket(m_socket);
+    m_server->removeConnection(this);
+    deleteLater();
+}
+
+void DQmlServerConnection::socketDisconnected()
+{
+    qCDebug(DQML_LOG) << "monitor disconnected";
+    close();
+}
+
+void DQmlServerConnection::timerEvent(QTimerEvent *e)
+{
+    if (e->timerId() != m_staleTimer)
+        return;
+    if (m_lastReceived.elapsed() > DQML_STALE_TIMEOUT) {
+        qCDebug(DQML_LOG) << "no word from monitor in" << m_lastReceived.elapsed() << "ms, closing connection";
+        dqml_metrics()->staleConnections->add();
+        close();
+    }
+}
+
+// The monitor numbers what it sends from the start of its session. Tell it
+// how far we got, so that it resends whatever was lost with the last
+// connection, and continue counting from where it is.
+void DQmlServerConnection::resumeSession(const QByteArray &session, quint64 sent)
+{
+    // A connection the monitor had before this one is dead, even if we
+    // haven't noticed yet. What it queued still counts once it's written.
+    foreach (DQmlServerConnection *connection, m_server->m_connections) {
+        if (connection != this && connection->m_sessionId == session) {
+            qCDebug(DQML_LOG) << "monitor reconnected, closing its stale connection";
+            dqml_metrics()->staleConnections->add();
+            connection->close();
+        }
+    }
+
+    // The monitor resends whatever didn't make it onto disk
+    m_sessionId = session;
+    quint64 durable = m_server->m_sessions.value(session, 0);
+    if (!m_server->m_sessions.contains(session))
+        qCDebug(DQML_LOG) << "new session" << session.toHex();
+    else
+        qCDebug(DQML_LOG) << "resuming session at" << durable << "of" << sent;
+
+    QByteArray reply;
+    dqml_appendInt<quint64>(&reply, durable);
+    m_socket->write(dqml_makeFrame(DQmlSessionReply, QString(), QString(), reply));
+    m_lastSequence = sent;
+    m_queuedSequence = sent;
+    m_durableSequence = sent;
+    m_ackedSequence = sent;
+
+    // Tell it what we have, so that a sync only sends what we lack
+    for (QHash<QString, QString>::const_iterator it = m_server->m_trackerMapping.constBegin();
+         it != m_server->m_trackerMapping.constEnd(); ++it) {
+        sendManifest(it.key(), it.value());
+    }
+    dqml_flushSocket(m_socket);
+}
+
+// Only what's on disk is acknowledged, the monitor resends the rest if
+// the connection goes before then
+void DQmlServerConnection::sendAck()
+{
+    if (m_durableSequence == m_ackedSequence
+            || dqml_socketState(m_socket) != QAbstractSocket::ConnectedState) {
+        return;
+    }
+    QByteArray ack;
+    dqml_appendInt<quint64>(&ack, m_durableSequence);
+    m_socket->write(dqml_makeFrame(DQmlAckReply, QString(), QString(), ack));
+    dqml_flushSocket(m_socket);
+    m_ackedSequence = m_durableSequence;
+    dqml_metrics()->acksSent->add();
+}
+
+// What's been handled of an open changeset only counts once it's committed
+quint64 DQmlServerConnection::handledSequence() const
+{
+    return m_changeSetDepth > 0 ? m_changeSetStart : m_lastSequence;
+}
+
+// Hands the changes of this read to the writer, to be acknowledged and
+// reloaded for once they're on disk
+void DQmlServerConnection::queueWrites(bool reload)
+{
+    quint64 handled = handledSequence();
+    if (!m_writeBatch && !reload && handled == m_queuedSequence)
+        return;
+    DQmlWriteJob *job = m_writeBatch ? m_writeBatch : new DQmlWriteJob();
+    m_writeBatch = 0;
+    job->connection = m_closed ? 0 : this;
+    job->session = m_sessionId;
+    job->sequence = handled;
+    job->reload = reload;
+    m_queuedSequence = handled;
+    // The engine reads from the overlay, which has the changes already
+    if (reload && m_server->m_overlay && !isBusy()) {
+        m_server->scheduleReload();
+        job->reload = false;
+    }
+    m_server->queueWrites(job);
+}
+
+void DQmlServerConnection::writeFinished(DQmlWriteJob *job)
+{
+    m_durableSequence = job->sequence;
+    sendAck();
+}
+
+// Part files get a name of their own, a batch still in flight may be about
+// to move the last one of the same file into place. Resources can't be
+// written to, theirs go to the temp directory.
+QString DQmlServerConnection::partFileName(const QString &fileName)
+{
+    if (dqml_isResourcePath(fileName)) {
+        return QDir::temp().filePath(QStringLiteral("dqml.%1.%2").arg(QCoreApplication::applicationPid())
+                                     .arg(++m_server->m_partFiles) + DQML_PART_SUFFIX);
+    }
+    return fileName + QLatin1Char('.') + QString::number(++m_server->m_partFiles) + DQML_PART_SUFFIX;
+}
+
+void DQmlServerConnection::beginChangeSet()
+{
+    if (m_changeSetDepth++ == 0)
+        m_changeSetStart = m_lastSequence;
+}
+
+// Applies the changeset once the outermost one is committed, returns
+// whether anything changed
+bool DQmlServerConnection::commitChangeSet()
+{
+    if (m_changeSetDepth == 0) {
+        qCDebug(DQML_LOG) << " -> got a commit without a changeset";
+        return false;
+    }
+    if (--m_changeSetDepth > 0)
+        return false;
+
+    QList<StagedChange> staged = m_staged;
+    m_staged.clear();
+    qCDebug(DQML_LOG) << " -> applying changeset of" << staged.size() << "changes";
+    foreach (const StagedChange &c, staged)
+        applyChange(c.fileName, c.content, c.partFile, c.remove);
+    dqml_metrics()->changeSetsApplied->add();
+    dqml_metrics()->changeSetSize->record(staged.size());
+    return !staged.isEmpty();
+}
+
+void DQmlServerConnection::abortChangeSet()
+{
+    if (m_changeSetDepth == 0)
+        return;
+    qCDebug(DQML_LOG) << " -> dropping unfinished changeset of" << m_staged.size() << "changes";
+    foreach (const StagedChange &c, m_staged) {
+        if (!c.partFile.isEmpty())
+            QFile::remove(c.partFile);
+    }
+    m_staged.clear();
+    m_changeSetDepth = 0;
+    m_lastSequence = m_changeSetStart;
+}
+
+// Queues writing, renaming into place or removing a file for the writer,
+// or stages that until the commit while a changeset is open
+void DQmlServerConnection::applyChange(const QString &fileName, const QByteArray &content, const QString &partFile, bool remove)
+{
+    if (m_changeSetDepth > 0) {
+        // Only the last change of a file in the changeset matters
+        for (int i = m_staged.size() - 1; i >= 0; --i) {
+            const StagedChange &c = m_staged.at(i);
+            if (c.fileName != fileName)
+                continue;
+            if (!c.partFile.isEmpty() && c.partFile != partFile)
+                QFile::remove(c.partFile);
+            m_staged.removeAt(i);
+        }
+
+        StagedChange c;
+        c.fileName = fileName;
+        c.partFile = partFile;
+        c.remove = remove;
+        if (!remove && partFile.isEmpty() && content.size() > DQML_STAGED_CONTENT_SIZE) {
+            // Large files wait on disk, like streamed ones
+            c.partFile = partFileName(fileName);
+            QDir().mkpath(QFileInfo(fileName).absolutePath());
+            QFile f(c.partFile);
+            if (!f.open(QFile::WriteOnly) || f.write(content) != content.size()) {
+                qCDebug(DQML_LOG) << " -> failed to write" << c.partFile << f.errorString();
+                return;
+            }
+        } else {
+            // The content may point into the receive buffer
+            c.content = QByteArray(content.constData(), content.size());
+        }
+        m_staged << c;
+        return;
+    }
+
+    if (DQmlOverlay *overlay = m_server->m_overlay.data()) {
+        if (remove) {
+            overlay->remove(fileName);
+        } else if (partFile.isEmpty()) {
+            overlay->insert(fileName, QByteArray(content.constData(), content.size()));
+        } else {
+            QFile f(partFile);
+            if (f.open(QFile::ReadOnly))
+                overlay->insert(fileName, f.readAll());
+            else
+                qCDebug(DQML_LOG) << " -> failed to read" << partFile << f.errorString();
+        }
+    }
+
+    if (!m_writeBatch)
+        m_writeBatch = new DQmlWriteJob();
+    // The content may point into the receive buffer
+    m_writeBatch->add(fileName, QByteArray(content.constData(), content.size()), partFile, remove);
+}
+
+// What 'fileName' holds once the changes staged and queued for the writer
+// so far are applied, false if it won't exist
+bool DQmlServerConnection::currentContent(const QString &fileName, QByteArray *content) const
+{
+    QString source;
+    for (int i = m_staged.size() - 1; i >= 0; --i) {
+        const StagedChange &c = m_staged.at(i);
+        if (c.fileName != fileName)
+            continue;
+        if (c.remove)
+            return false;
+        if (c.partFile.isEmpty()) {
+            *content = c.content;
+            return true;
+        }
+        source = c.partFile;
+        break;
+    }
+
+    // Has everything that was applied, whether or not it's on disk yet
+    bool removed = false;
+    if (source.isEmpty() && m_server->m_overlay && m_server->m_overlay->lookup(fileName, content, &removed))
+        return !removed;
+
+    QList<DQmlWriteJob *> batches = m_server->m_writing;
+    if (m_writeBatch)
+        batches << m_writeBatch;
+    for (int i = batches.size() - 1; i >= 0 && source.isEmpty(); --i) {
+        const DQmlWriteJob::Change *c = batches.at(i)->find(fileName);
+        if (!c)
+            continue;
+        if (c->remove)
+            return false;
+        if (c->partFile.isEmpty()) {
+            *content = c->content;
+            return true;
+        }
+        // Unless the writer moved it into place already
+        if (QFile::exists(c->partFile))
+            source = c->partFile;
+        break;
+    }
+
+    QFile f(source.isEmpty() ? fileName : source);
+    if (!f.open(QFile::ReadOnly))
+        return false;
+    *content = f.readAll();
+    return true;
+}
+
+// Handles all complete frames in the receive buffer where they lie, what
+// is left of a frame waits for more data. Large changes are written out as
+// they arrive and count once their last piece is in.
+void DQmlServerConnection::read()
+{
+    m_lastReceived.start();
+    m_reader.readFrom(m_socket);
+
+    bool handledFiles = false;
+    DQmlFrame frame;
+    // A frame may have us close the connection
+    while (!m_closed) {
+        DQmlFrameReader::Result result = m_reader.next(&frame);
+        if (result == DQmlFrameReader::NeedMore)
+            break;
+        if (result == DQmlFrameReader::Garbled) {
+            qCDebug(DQML_LOG) << " -> garbled data from monitor, disconnecting";
+            rejectMonitor(handledFiles);
+            return;
+        }
+        if (result == DQmlFrameReader::PieceReady) {
+            handlePiece(frame);
+            if (!frame.isLastPiece())
+                continue;
+        } else if (frame.type == DQmlChangeSetBeginMessage) {
+            beginChangeSet();
+        } else if (frame.type == DQmlChangeSetCommitMessage) {
+            if (commitChangeSet())
+                handledFiles = true;
+        } else if (!handleFrame(frame)) {
+            rejectMonitor(handledFiles);
+            return;
+        }
+        if (dqml_isNumberedMessage(frame.type)) {
+            ++m_lastSequence;
+            handledFiles = true;
+        }
+    }
+
+    queueWrites(handledFiles);
+}
+
+// Drops what's left to read and closes the connection, so that nothing
+// more from the monitor is handled. What was handled before is still
+// written.
+void DQmlServerConnection::rejectMonitor(bool reload)
+{
+    m_reader.clear();
+    discardPieces();
+    queueWrites(reload);
+    close();
+}
+
+// Returns false if the monitor is to be disconnected, nothing after the
+// frame is handled then
+
+bool DQmlServerConnection::handleFrame(const DQmlFrame &frame)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    if (frame.type == DQmlHelloMessage) {
+        if (frame.version != DQML_PROTOCOL_VERSION || frame.payloadLength < 4) {
+            qCWarning(DQML_LOG) << "monitor speaks protocol version" << frame.version
+                                << "but we speak" << DQML_PROTOCOL_VERSION;
+            return false;
+        }
+        QByteArray codec(frame.payload + 4, frame.payloadLength - 4);
+        m_codec = codec.isEmpty() ? 0 : DQmlCodec::codec(codec);
+        qCDebug(DQML_LOG) << "monitor uses capabilities" << dqml_readInt<quint32>(frame.payload)
+                          << "and codec" << codec;
+        return true;
+    }
+
+    if (frame.type == DQmlSessionMessage) {
+        if (frame.payloadLength >= 8)
+            resumeSession(QByteArray(frame.payload + 8, frame.payloadLength - 8), dqml_readInt<quint64>(frame.payload));
+        return true;
+    }
+
+    if (frame.type == DQmlSharedMemoryMessage) {
+        delete m_ring;
+        m_ring = new DQmlSharedRing();
+        if (m_ring->attach(QString::fromUtf8(frame.payload, frame.payloadLength))) {
+            m_socket->write(dqml_makeFrame(DQmlSharedMemoryReply, QString(), QString()));
+            dqml_flushSocket(m_socket);
+        } else {
+            delete m_ring;
+            m_ring = 0;
+        }
+        return true;
+    }
+
+    if (frame.type == DQmlHeartbeatMessage) {
+        sendAck();
+        m_socket->write(dqml_makeFrame(DQmlHeartbeatReply, QString(), QString(),
+                                       QByteArray(frame.payload, frame.payloadLength)));
+        dqml_flushSocket(m_socket);
+        return true;
+    }
+
+    QByteArray payload = QByteArray::fromRawData(frame.payload, frame.payloadLength);
+    if (frame.flags & DQmlSharedMemoryFrame) {
+        if (!m_ring || frame.payloadLength < 12
+                || !m_ring->read(dqml_readInt<quint64>(frame.payload), dqml_readInt<quint32>(frame.payload + 8), &payload)) {
+            // The ring is out of step, a new connection gets a new one and
+            // the monitor resends what wasn't acknowledged
+            qCDebug(DQML_LOG) << " -> got a frame in shared memory we can't read, disconnecting";
+            return false;
+        }
+    }
+    if (frame.flags & DQmlCompressedFrame) {
+        if (!m_codec || payload.size() < 4) {
+            // Counting it as handled would acknowledge a change we dropped
+            qCDebug(DQML_LOG) << " -> got a compressed frame without a codec, disconnecting";
+            return false;
+        }
+        int size = dqml_readInt<quint32>(payload.constData());
+        payload = m_codec->decompress(QByteArray::fromRawData(payload.constData() + 4, payload.size() - 4), size);
+        if (payload.isNull()) {
+            qCDebug(DQML_LOG) << " -> failed to decompress frame with" << m_codec->name() << ", disconnecting";
+            return false;
+        }
+        dqml_metrics()->bytesDecompressed->add(payload.size());
+    }
+
+    // Chunks are the bulk of a large file, match them against the stream
+    // without making strings of them
+    if (frame.type == DQmlStreamChunkMessage || frame.type == DQmlStreamEndMessage) {
+        if (!m_streamFile || QByteArray::fromRawData(frame.id, frame.idLength) != m_streamId
+                || QByteArray::fromRawData(frame.file, frame.fileLength) != m_streamName) {
+            qCDebug(DQML_LOG) << " -> got part of a stream which wasn't begun" << frame.idString() << ":" << frame.fileString();
+            return true;
+        }
+        dqml_metrics()->parseUsecs->record(timer.nsecsElapsed() / 1000);
+        if (frame.type == DQmlStreamChunkMessage) {
+            DQmlScopedTimer writeTimer(dqml_metrics()->writeUsecs);
+            if (m_streamFile->isOpen())
+                m_streamFile->write(payload);
+            dqml_metrics()->bytesReceived->add(payload.size());
+        } else {
+            if (m_streamFile->isOpen()) {
+                m_streamFile->close();
+                applyChange(m_streamTarget, QByteArray(), m_streamFile->fileName(), false);
+                dqml_metrics()->filesReceived->add();
+                qCDebug(DQML_LOG) << " -> updated" << m_streamId << ":" << m_streamName << "from stream";
+            }
+            delete m_streamFile;
+            m_streamFile = 0;
+        }
+        return true;
+    }
+
+    QString id = frame.idString();
+    QString file = frame.fileString();
+    int type = frame.type;
+    dqml_metrics()->parseUsecs->record(timer.nsecsElapsed() / 1000);
+
+    QString fileName = mappedFileName(frame);
+    if (fileName.isEmpty())
+        return true;
+
+    QByteArray base;
+    QByteArray patched;
+    if (type == DQmlDeltaMessage) {
+        if (payload.size() >= 16 && currentContent(fileName, &base)
+                && dqml_patch(base, dqml_readInt<quint64>(payload.constData()),
+                              dqml_readInt<quint64>(payload.constData() + 8),
+                              QByteArray::fromRawData(payload.constData() + 16, payload.size() - 16), &patched)) {
+            dqml_metrics()->deltasApplied->add();
+        } else {
+            qCDebug(DQML_LOG) << " -> delta does not apply to our copy, asking for all of" << id << ":" << file;
+            requestResend(id, file);
+            type = 0;
+        }
+    }
+
+    if (type == DQmlChangeMessage || type == DQmlAddMessage || type == DQmlDeltaMessage) {
+        applyChange(fileName, type == DQmlDeltaMessage ? patched : payload, QString(), false);
+        dqml_metrics()->filesReceived->add();
+        dqml_metrics()->bytesReceived->add(payload.size());
+        qCDebug(DQML_LOG) << " -> updated" << id << ":" << file;
+    } else if (type == DQmlStreamBeginMessage) {
+        if (m_streamFile) {
+            qCDebug(DQML_LOG) << " -> stream of" << m_streamId << ":" << m_streamName << "never ended";
+            m_streamFile->remove();
+            delete m_streamFile;
+        }
+        QDir().mkpath(QFileInfo(fileName).absolutePath());
+        m_streamFile = new QFile(partFileName(fileName), this);
+        m_streamTarget = fileName;
+        m_streamId = QByteArray(frame.id, frame.idLength);
+        m_streamName = QByteArray(frame.file, frame.fileLength);
+        if (!m_streamFile->open(QFile::WriteOnly))
+            qCDebug(DQML_LOG) << " -> failed to write" << QFileInfo(fileName).absoluteFilePath() << m_streamFile->errorString();
+    } else if (type == DQmlRemoveMessage) {
+        applyChange(fileName, QByteArray(), QString(), true);
+        dqml_metrics()->filesRemoved->add();
+        qCDebug(DQML_LOG) << " -> removed" << id << ":" << file;
+    } else if (type != 0) {
+        qCDebug(DQML_LOG) << " -> skipping frame of unknown type" << type;
+    }
+    return true;
+}
+
+// Writes a large change to its part file piece by piece and applies it
+// like a streamed file once it's all there
+void DQmlServerConnection::handlePiece(const DQmlFrame &frame)
+{
+    if (frame.payloadOffset == 0) {
+        discardPieces();
+        QString fileName = mappedFileName(frame);
+        if (!fileName.isEmpty()) {
+            QDir().mkpath(QFileInfo(fileName).absolutePath());
+            m_pieceFile = new QFile(partFileName(fileName), this);
+            m_pieceTarget = fileName;
+            if (!m_pieceFile->open(QFile::WriteOnly)) {
+                qCDebug(DQML_LOG) << " -> failed to write" << QFileInfo(fileName).absoluteFilePath() << m_pieceFile->errorString();
+                delete m_pieceFile;
+                m_pieceFile = 0;
+            }
+        }
+    }
+    if (!m_pieceFile)
+        return;
+
+    {
+        DQmlScopedTimer writeTimer(dqml_metrics()->writeUsecs);
+        m_pieceFile->write(frame.payload, frame.payloadLength);
+    }
+    dqml_metrics()->bytesReceived->add(frame.payloadLength);
+
+    if (frame.isLastPiece()) {
+        m_pieceFile->close();
+        applyChange(m_pieceTarget, QByteArray(), m_pieceFile->fileName(), false);
+        dqml_metrics()->filesReceived->add();
+        dqml_metrics()->filesInPieces->add();
+        qCDebug(DQML_LOG) << " -> updated" << frame.idString() << ":" << frame.fileString() << "in pieces";
+        delete m_pieceFile;
+        m_pieceFile = 0;
+    }
+}
+
+// Drops a change which stopped arriving half way
+void DQmlServerConnection::discardPieces()
+{
+    if (!m_pieceFile)
+        return;
+    m_pieceFile->remove();
+    delete m_pieceFile;
+    m_pieceFile = 0;
+}
+
+// Where a frame's file goes, or nothing if it's not one of ours
+QString DQmlServerConnection::mappedFileName(const DQmlFrame &frame) const
+{
+    QString id = frame.idString();
+    QString file = frame.fileString();
+    if (!m_server->m_trackerMapping.contains(id)) {
+        qCDebug(DQML_LOG) << " -> got data for unknown id, aborting" << id;
+        qCDebug(DQML_LOG) << " --->" << m_server->m_trackerMapping.keys();
+        return QString();
+    }
+    if (QDir::isAbsolutePath(file) || file.split(QLatin1Char('/')).contains(QStringLiteral(".."))) {
+        qCDebug(DQML_LOG) << " -> file outside of tracked directory, aborting" << id << file;
+        return QString();
+    }
+    QString root = m_server->m_trackerMapping.value(id);
+    if (dqml_isResourcePath(root) && !m_server->m_overlay) {
+        qCDebug(DQML_LOG) << " -> resources can only be changed with the overlay on, aborting" << id << file;
+        return QString();
+    }
+    return root + QStringLiteral("/") + file;
+}
+
+void DQmlServerConnection::requestResend(const QString &id, const QString &file)
+{
+    dqml_metrics()->resendsRequested->add();
+    m_socket->write(dqml_makeFrame(DQmlResendReply, id, file));
+    dqml_flushSocket(m_socket);
+}
+
+void DQmlServerConnection::sendManifest(const QString &id, const QString &path)
+{
+    DQmlScopedTimer timer(dqml_metrics()->manifestUsecs);
+    QByteArray files;
+    quint32 count = 0;
+    QString root = QDir(path).absolutePath();
+    QDirIterator iterator(root, QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+    while (iterator.hasNext()) {
+        QString absPath = iterator.next();
+        // The monitor would remove them under the writer's feet
+        if (dqml_isPartialFile(absPath))
+            continue;
+        QFileInfo info = iterator.fileInfo();
+        DQmlFileTracker::FileState state;
+        state.modified = info.lastModified().toMSecsSinceEpoch();
+        state.size = info.size();
+
+        DQmlFileTracker::FileState &known = m_server->m_fileStates[absPath];
+        if (known.hash == 0 || known.modified != state.modified || known.size != state.size) {
+            state.hash = dqml_hashFile(absPath);
+            known = state;
+        }
+        QByteArray name = absPath.mid(root.size() + 1).toUtf8();
+        dqml_appendInt<quint16>(&files, name.size());
+        files += name;
+        dqml_appendInt<qint64>(&files, known.size);
+        dqml_appendInt<quint64>(&files, known.hash);
+        ++count;
+    }
+
+    qCDebug(DQML_LOG) << "sending manifest of" << count << "files for" << id;
+    QByteArray payload;
+    payload.reserve(sizeof(quint32) + files.size());
+    dqml_appendInt<quint32>(&payload, count);
+    payload += files;
+    m_socket->write(dqml_makeFrame(DQmlManifestReply, id, QString(), payload));
+}
@@ -0,0 +1,143 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLSERVERCONNECTION_P_H
+#define DQMLSERVERCONNECTION_P_H
+
+#include <dqml/dqmlglobal.h>
+#include <dqml/dqmlserver.h>
+
+#include "dqmlprotocol_p.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+
+QT_BEGIN_NAMESPACE
+
+class DQmlCodec;
+class DQmlSharedRing;
+class DQmlWriteJob;
+class QFile;
+class QIODevice;
+
+// One of the monitors connected to a DQmlServer, with its own parser,
+// session and changeset. What it receives goes through the server's writer
+// and into its reload schedule, which all connections share.
+class DQmlServerConnection : public QObject
+{
+    Q_OBJECT
+public:
+    // Takes over 'socket', a QTcpSocket or a QLocalSocket
+    DQmlServerConnection(DQmlServer *server, QIODevice *socket, bool local);
+    ~DQmlServerConnection();
+
+    QByteArray sessionId() const { return m_sessionId; }
+    // In the middle of a file or changeset, which isn't worth reloading for
+    bool isBusy() const { return m_streamFile || m_pieceFile || m_changeSetDepth > 0; }
+
+    void writeFinished(DQmlWriteJob *job);
+    void close();
+
+private Q_SLOTS:
+    void read();
+    void socketDisconnected();
+
+protected:
+    void timerEvent(QTimerEvent *e);
+
+private:
+    bool handleFrame(const DQmlFrame &frame);
+    void rejectMonitor(bool reload);
+    void handlePiece(const DQmlFrame &frame);
+    void discardPieces();
+    QString mappedFileName(const DQmlFrame &frame) const;
+    QString partFileName(const QString &fileName);
+    void requestResend(const QString &id, const QString &file);
+    void sendManifest(const QString &id, const QString &path);
+    void resumeSession(const QByteArray &session, quint64 sent);
+    void sendAck();
+    void queueWrites(bool reload);
+    quint64 handledSequence() const;
+    void beginChangeSet();
+    bool commitChangeSet();
+    void abortChangeSet();
+    void applyChange(const QString &fileName, const QByteArray &content, const QString &partFile, bool remove);
+    bool currentContent(const QString &fileName, QByteArray *content) const;
+
+    DQmlServer *m_server;
+    QIODevice *m_socket;
+    bool m_closed;
+    int m_staleTimer;
+    QElapsedTimer m_lastReceived;
+
+    // The codec from the monitor's hello
+    DQmlCodec *m_codec;
+    // Frames which have only partly arrived
+    DQmlFrameReader m_reader;
+    // Where the change arriving in pieces is written to, if any
+    QFile *m_pieceFile;
+    QString m_pieceTarget;
+    // The local monitor's ring large payloads come through, if any
+    DQmlSharedRing *m_ring;
+
+    // The file being streamed to, written chunk by chunk, and its id and
+    // name in UTF-8
+    QFile *m_streamFile;
+    QString m_streamTarget;
+    QByteArray m_streamId;
+    QByteArray m_streamName;
+
+    // The monitor's session and the sequence number of the last message
+    // from it we handled, handed to the writer, got on disk and
+    // acknowledged
+    QByteArray m_sessionId;
+    quint64 m_lastSequence;
+    quint64 m_queuedSequence;
+    quint64 m_durableSequence;
+    quint64 m_ackedSequence;
+
+    // What this read changed, handed to the server's writer at the end
+    DQmlWriteJob *m_writeBatch;
+
+    // The changeset being received, applied in order on the commit. Only
+    // what was committed is acknowledged, so the monitor resends the rest
+    // if the connection goes before then.
+    struct StagedChange {
+        QString fileName;
+        QByteArray content;
+        // A streamed file, still under its temporary name
+        QString partFile;
+        bool remove;
+    };
+    QList<StagedChange> m_staged;
+    int m_changeSetDepth;
+    quint64 m_changeSetStart;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLSERVERCONNECTION_P_H
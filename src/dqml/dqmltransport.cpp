@@ -0,0 +1,187 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmltransport_p.h"
+#include "dqmlprotocol_p.h"
+
+#include <QtCore/QIODevice>
+
+#include <QtNetwork/QLocalSocket>
+#include <QtNetwork/QTcpSocket>
+
+#include <string.h>
+
+// Room for how far the server has read, padded to keep the data aligned
+static const int DQML_RING_HEADER_SIZE = 64;
+
+void dqml_flushSocket(QIODevice *socket)
+{
+    if (QAbstractSocket *tcp = qobject_cast<QAbstractSocket *>(socket))
+        tcp->flush();
+    else if (QLocalSocket *local = qobject_cast<QLocalSocket *>(socket))
+        local->flush();
+}
+
+void dqml_abortSocket(QIODevice *socket)
+{
+    if (QAbstractSocket *tcp = qobject_cast<QAbstractSocket *>(socket))
+        tcp->abort();
+    else if (QLocalSocket *local = qobject_cast<QLocalSocket *>(socket))
+        local->abort();
+}
+
+void dqml_disconnectSocket(QIODevice *socket)
+{
+    if (QAbstractSocket *tcp = qobject_cast<QAbstractSocket *>(socket))
+        tcp->disconnectFromHost();
+    else if (QLocalSocket *local = qobject_cast<QLocalSocket *>(socket))
+        local->disconnectFromServer();
+}
+
+QAbstractSocket::SocketState dqml_socketState(QIODevice *socket)
+{
+    if (QAbstractSocket *tcp = qobject_cast<QAbstractSocket *>(socket))
+        return tcp->state();
+    if (QLocalSocket *local = qobject_cast<QLocalSocket *>(socket))
+        return QAbstractSocket::SocketState(local->state());
+    return QAbstractSocket::UnconnectedState;
+}
+
+DQmlSharedRing::DQmlSharedRing()
+    : m_size(0)
+    , m_written(0)
+    , m_read(0)
+{
+}
+
+DQmlSharedRing::~DQmlSharedRing()
+{
+    if (m_memory.isAttached())
+        m_memory.detach();
+}
+
+bool DQmlSharedRing::create(const QString &key, int size)
+{
+    m_memory.setKey(key);
+    if (!m_memory.create(DQML_RING_HEADER_SIZE + size)) {
+        qCDebug(DQML_LOG) << "failed to create shared memory" << key << m_memory.errorString();
+        return false;
+    }
+    m_size = size;
+    m_written = 0;
+    m_memory.lock();
+    *consumed() = 0;
+    m_memory.unlock();
+    return true;
+}
+
+bool DQmlSharedRing::attach(const QString &key)
+{
+    m_memory.setKey(key);
+    if (!m_memory.attach()) {
+        qCDebug(DQML_LOG) << "failed to attach to shared memory" << key << m_memory.errorString();
+        return false;
+    }
+    m_size = m_memory.size() - DQML_RING_HEADER_SIZE;
+    m_memory.lock();
+    m_read = *consumed();
+    m_memory.unlock();
+    return m_size > 0;
+}
+
+quint64 *DQmlSharedRing::consumed() const
+{
+    return static_cast<quint64 *>(const_cast<void *>(m_memory.constData()));
+}
+
+char *DQmlSharedRing::buffer() const
+{
+    return static_cast<char *>(const_cast<void *>(m_memory.constData())) + DQML_RING_HEADER_SIZE;
+}
+
+qint64 DQmlSharedRing::write(const char *data, int size)
+{
+    m_memory.lock();
+    quint64 free = m_size - (m_written - *consumed());
+    m_memory.unlock();
+    if (quint64(size) > free)
+        return -1;
+
+    // The server doesn't look at this room until the frame pointing at it
+    // arrives, so it's written without holding the lock
+    int offset = m_written % m_size;
+    int first = qMin(size, m_size - offset);
+    memcpy(buffer() + offset, data, first);
+    memcpy(buffer(), data + first, size - first);
+
+    qint64 position = m_written;
+    m_written += size;
+    return position;
+}
+
+bool DQmlSharedRing::read(quint64 position, int size, QByteArray *data)
+{
+    if (size < 0 || size > m_size)
+        return false;
+    // A stale or reordered frame would read what another one wrote
+    if (position != m_read) {
+        qCDebug(DQML_LOG) << "shared memory frame at" << position << "but expected" << m_read;
+        return false;
+    }
+
+    data->resize(size);
+    int offset = position % m_size;
+    int first = qMin(size, m_size - offset);
+    memcpy(data->data(), buffer() + offset, first);
+    memcpy(data->data() + first, buffer(), size - first);
+
+    m_read = position + size;
+    m_memory.lock();
+    *consumed() = m_read;
+    m_memory.unlock();
+    return true;
+}
+
+QByteArray dqml_moveToRing(const QByteArray &frame, DQmlSharedRing *ring)
+{
+    const char *header = frame.constData();
+    int offset = DQML_FRAME_HEADER_SIZE + dqml_readInt<quint16>(header + 6) + dqml_readInt<quint16>(header + 8);
+    int size = frame.size() - offset;
+    qint64 position = ring->write(header + offset, size);
+    if (position < 0)
+        return QByteArray();
+
+    QByteArray result;
+    result.reserve(offset + 12);
+    result.append(header, 4);
+    dqml_appendInt<quint16>(&result, dqml_readInt<quint16>(header + 4) | DQmlSharedMemoryFrame);
+    result.append(header + 6, 6);
+    dqml_appendInt<quint32>(&result, 12);
+    result.append(header + DQML_FRAME_HEADER_SIZE, offset - DQML_FRAME_HEADER_SIZE);
+    dqml_appendInt<quint64>(&result, position);
+    dqml_appendInt<quint32>(&result, size);
+    return result;
+}
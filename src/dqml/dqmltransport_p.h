@@ -0,0 +1,95 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLTRANSPORT_P_H
+#define DQMLTRANSPORT_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QSharedMemory>
+
+#include <QtNetwork/QAbstractSocket>
+
+QT_BEGIN_NAMESPACE
+
+class QIODevice;
+
+// Monitor and server talk over a QTcpSocket or, on the same machine, a
+// QLocalSocket. These cover what QIODevice doesn't have in common.
+void dqml_flushSocket(QIODevice *socket);
+void dqml_abortSocket(QIODevice *socket);
+void dqml_disconnectSocket(QIODevice *socket);
+// QLocalSocket's states have the same values as QAbstractSocket's
+QAbstractSocket::SocketState dqml_socketState(QIODevice *socket);
+
+// A ring buffer in shared memory which a local monitor moves large
+// payloads through, so that they're copied once rather than pushed through
+// the socket. The monitor creates it and writes, the server attaches and
+// reads, strictly in the order the frames pointing into it arrive. The
+// only shared state is how far the server has read, which frees the room
+// for the monitor to write to again.
+//
+// Whichever side detaches last removes the segment, so a monitor which
+// crashes leaves it to the server to clean up once the connection is gone.
+// On Unix, a segment is only left behind when the monitor dies before the
+// server attached, or both sides die, and has to be removed with ipcrm.
+class DQmlSharedRing
+{
+public:
+    DQmlSharedRing();
+    ~DQmlSharedRing();
+
+    bool create(const QString &key, int size);
+    bool attach(const QString &key);
+    QString key() const { return m_memory.key(); }
+    int size() const { return m_size; }
+
+    // Copies 'data' in, returns its position or -1 when there isn't room
+    qint64 write(const char *data, int size);
+    // Copies out what was written at 'position' and frees its room. Fails
+    // unless 'position' is where the last read ended, reads come in the
+    // order they were written.
+    bool read(quint64 position, int size, QByteArray *data);
+
+private:
+    quint64 *consumed() const;
+    char *buffer() const;
+
+    QSharedMemory m_memory;
+    int m_size;
+    quint64 m_written;
+    // Where the server's next read starts
+    quint64 m_read;
+};
+
+// Turns a frame into one which points at its payload in 'ring'. Returns a
+// null array when the ring is full, the frame is then sent as it is.
+QByteArray dqml_moveToRing(const QByteArray &frame, DQmlSharedRing *ring);
+
+QT_END_NAMESPACE
+
+#endif // DQMLTRANSPORT_P_H
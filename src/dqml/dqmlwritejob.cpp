@@ -0,0 +1,221 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "dqmlwritejob_p.h"
+#include "dqmlmetrics.h"
+#include "dqmloverlay_p.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSet>
+#include <QtCore/QVector>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+struct DQmlWriteMetrics
+{
+    DQmlWriteMetrics()
+    {
+        DQmlMetrics *m = DQmlMetrics::instance();
+        writeBatches = m->counter(QStringLiteral("server.writeBatches"));
+        writeBatchSize = m->histogram(QStringLiteral("server.writeBatchSize"));
+        writeBatchUsecs = m->histogram(QStringLiteral("server.writeBatchUsecs"));
+        syncUsecs = m->histogram(QStringLiteral("server.syncUsecs"));
+    }
+
+    DQmlCounter *writeBatches;
+    DQmlHistogram *writeBatchSize;
+    DQmlHistogram *writeBatchUsecs;
+    DQmlHistogram *syncUsecs;
+};
+
+Q_GLOBAL_STATIC(DQmlWriteMetrics, dqml_metrics)
+
+// New content is written under this suffix next to the file it replaces
+static const QString DQML_WRITE_SUFFIX = QStringLiteral(".dqmlnew");
+
+static void dqml_syncFile(const QString &fileName, bool directory)
+{
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+#ifdef Q_OS_LINUX
+    // The content and size of a file is all a reader needs
+    if (directory)
+        ::fsync(fd);
+    else
+        ::fdatasync(fd);
+#else
+    Q_UNUSED(directory);
+    ::fsync(fd);
+#endif
+    ::close(fd);
+#else
+    Q_UNUSED(fileName);
+    Q_UNUSED(directory);
+#endif
+}
+
+// Replaces 'to' in one step where the platform allows it
+static bool dqml_replaceFile(const QString &from, const QString &to)
+{
+#ifdef Q_OS_UNIX
+    return ::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#else
+    QFile::remove(to);
+    return QFile::rename(from, to);
+#endif
+}
+
+DQmlWriteJob::DQmlWriteJob()
+    : server(0)
+    , connection(0)
+    , sequence(0)
+    , reload(false)
+    , failed(false)
+{
+    setAutoDelete(false);
+}
+
+void DQmlWriteJob::add(const QString &fileName, const QByteArray &content, const QString &partFile, bool remove)
+{
+    // Only the last change of a file in the batch matters, and two of them
+    // can't share the temporary name
+    for (int i = changes.size() - 1; i >= 0; --i) {
+        Change &c = changes[i];
+        if (c.fileName != fileName)
+            continue;
+        if (!c.partFile.isEmpty() && c.partFile != partFile) {
+            c.fileName = c.partFile;
+            c.partFile.clear();
+            c.remove = true;
+        } else {
+            changes.removeAt(i);
+        }
+    }
+
+    Change c;
+    c.fileName = fileName;
+    c.content = content;
+    c.partFile = partFile;
+    c.remove = remove;
+    changes << c;
+}
+
+const DQmlWriteJob::Change *DQmlWriteJob::find(const QString &fileName) const
+{
+    for (int i = changes.size() - 1; i >= 0; --i) {
+        if (changes.at(i).fileName == fileName)
+            return &changes.at(i);
+    }
+    return 0;
+}
+
+void DQmlWriteJob::run()
+{
+    {
+        DQmlScopedTimer timer(dqml_metrics()->writeBatchUsecs);
+        QElapsedTimer syncTimer;
+        qint64 syncNsecs = 0;
+
+        // Everything goes to disk under a temporary name first. The changes
+        // are left as they are, the server may be looking at them.
+        QVector<QString> sources(changes.size());
+        for (int i = 0; i < changes.size(); ++i) {
+            const Change &c = changes.at(i);
+            // Resources only change in the server's overlay
+            if (dqml_isResourcePath(c.fileName)) {
+                if (!c.partFile.isEmpty())
+                    QFile::remove(c.partFile);
+                continue;
+            }
+            if (c.remove)
+                continue;
+            if (!c.partFile.isEmpty()) {
+                sources[i] = c.partFile;
+                continue;
+            }
+            // Tracking is recursive, so the file may live in a directory
+            // which does not exist on this side yet.
+            QDir().mkpath(QFileInfo(c.fileName).absolutePath());
+            QFile f(c.fileName + DQML_WRITE_SUFFIX);
+            if (!f.open(QFile::WriteOnly) || f.write(c.content) != c.content.size()) {
+                qCDebug(DQML_LOG) << " -> failed to write" << QFileInfo(c.fileName).absoluteFilePath() << f.errorString();
+                f.remove();
+                failed = true;
+                continue;
+            }
+            sources[i] = f.fileName();
+        }
+
+        syncTimer.start();
+        foreach (const QString &source, sources) {
+            if (!source.isEmpty())
+                dqml_syncFile(source, false);
+        }
+        syncNsecs += syncTimer.nsecsElapsed();
+
+        // Then it all shows up, in order
+        QSet<QString> directories;
+        for (int i = 0; i < changes.size(); ++i) {
+            const Change &c = changes.at(i);
+            if (dqml_isResourcePath(c.fileName)) {
+                continue;
+            } else if (c.remove) {
+                // Already gone is as good as removed
+                if (!QFile::remove(c.fileName) && QFile::exists(c.fileName)) {
+                    qCDebug(DQML_LOG) << " -> failed to remove" << c.fileName;
+                    failed = true;
+                }
+            } else if (sources.at(i).isEmpty()) {
+                continue;
+            } else if (!dqml_replaceFile(sources.at(i), c.fileName)) {
+                qCDebug(DQML_LOG) << " -> failed to move" << sources.at(i) << "into place";
+                failed = true;
+                continue;
+            }
+            directories << QFileInfo(c.fileName).absolutePath();
+        }
+
+        syncTimer.start();
+        foreach (const QString &directory, directories)
+            dqml_syncFile(directory, true);
+        syncNsecs += syncTimer.nsecsElapsed();
+
+        dqml_metrics()->syncUsecs->record(syncNsecs / 1000);
+        dqml_metrics()->writeBatches->add();
+        dqml_metrics()->writeBatchSize->record(changes.size());
+    }
+
+    QMetaObject::invokeMethod(server, "writeFinished", Qt::QueuedConnection);
+}
@@ -0,0 +1,88 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DQMLWRITEJOB_P_H
+#define DQMLWRITEJOB_P_H
+
+#include <dqml/dqmlglobal.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QRunnable>
+#include <QtCore/QString>
+
+QT_BEGIN_NAMESPACE
+
+class DQmlServerConnection;
+
+// Whether 'fileName' is one the server is still writing: a ".dqmlnew" file
+// of the writer or a ".dqmlpart" file of a file arriving in parts
+inline bool dqml_isPartialFile(const QString &fileName)
+{
+    return fileName.endsWith(QLatin1String(".dqmlnew")) || fileName.endsWith(QLatin1String(".dqmlpart"));
+}
+
+// Puts one batch of received files in place on the server's writer
+// thread. New content is written under a temporary name next to the file,
+// everything is synced to disk in one go and then renamed into place in
+// order, so a reload never sees half a file and the batch is durable when
+// the server's writeFinished() is invoked. The server owns the job.
+class DQmlWriteJob : public QRunnable
+{
+public:
+    struct Change {
+        QString fileName;
+        QByteArray content;
+        // Already written under this name, only to be moved into place
+        QString partFile;
+        bool remove;
+    };
+
+    DQmlWriteJob();
+
+    void add(const QString &fileName, const QByteArray &content, const QString &partFile, bool remove);
+    // The last change to 'fileName' in the batch, if any
+    const Change *find(const QString &fileName) const;
+    bool isEmpty() const { return changes.isEmpty(); }
+
+    void run();
+
+    QObject *server;
+    // Where the batch came from, null once that connection is gone
+    DQmlServerConnection *connection;
+    QList<Change> changes;
+    // How far the monitor's session is handled with this batch, which the
+    // connection acknowledges once it's written
+    QByteArray session;
+    quint64 sequence;
+    bool reload;
+    // Something couldn't be written, the batch isn't durable
+    bool failed;
+};
+
+QT_END_NAMESPACE
+
+#endif // DQMLWRITEJOB_P_H
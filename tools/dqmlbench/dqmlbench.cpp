@@ -0,0 +1,838 @@
+/*
+    Copyright (c) 2014, Gunnar Sletta
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <QGuiApplication>
+
+#include <QQmlEngine>
+
+#include <QQuickItem>
+#include <QQuickView>
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QTemporaryDir>
+#include <QTimer>
+#include <QtEndian>
+
+#include <QTcpSocket>
+
+#include <dqml/dqmlserver.h>
+#include <dqml/dqmllocalserver.h>
+#include <dqml/dqmlmonitor.h>
+#include <dqml/dqmlfiletracker.h>
+#include <dqml/dqmlmetrics.h>
+#include <dqml/dqmlcodec.h>
+
+#include "dqmlhash_p.h"
+
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// Measures the time from writing a file on the monitor's side to the
+// first frame which shows it on the server's side, all in one process
+// rendering offscreen. The fragment scenario instead feeds a server frames
+// cut into random pieces and checks that what it wrote is what was sent.
+
+struct Options
+{
+    Options()
+        : scenario(QStringLiteral("local"))
+        , files(100)
+        , dirs(10)
+        , depth(1)
+        , size(1024)
+        , edits(100)
+        , warmup(5)
+        , interval(100)
+        , timeout(5000)
+        , port(7357)
+        , coalesce(-1)
+        , fragment(1500)
+        , seed(1)
+        , stats(false)
+    {
+    }
+
+    QString scenario;
+    int files;
+    int dirs;
+    int depth;
+    int size;
+    int edits;
+    int warmup;
+    int interval;
+    int timeout;
+    int port;
+    int coalesce;
+    int fragment;
+    int seed;
+    bool stats;
+};
+
+static void printHelp()
+{
+    printf("Usage: \n"
+           " > dqmlbench [--scenario name] [--files n] [--dirs n] [--depth n] [--size bytes]\n"
+           "             [--edits n] [--warmup n] [--interval ms] [--timeout ms] [--port port]\n"
+           "             [--coalesce ms] [--fragment bytes] [--seed n] [--stats]\n"
+           "\n"
+           "Generates a tree of QML files, edits them one at a time and reports how long\n"
+           "it takes from writing a file until a frame showing the change is rendered.\n"
+           "Runs on the offscreen platform with the software renderer unless told\n"
+           "otherwise through QT_QPA_PLATFORM and QT_QUICK_BACKEND.\n"
+           "\n"
+           "Scenarios:\n"
+           "    local       DQmlLocalServer tracking the tree, like 'dqml --local'\n"
+           "    tcp         A DQmlMonitor sending to a DQmlServer over loopback TCP\n"
+           "    sync        Like tcp, with the server starting out empty and --sync\n"
+           "                bringing it up to date, which is timed too\n"
+           "    local-socket\n"
+           "                Like tcp, over a local socket\n"
+           "    fragment    Sends --edits changes of up to --size bytes to --files files\n"
+           "                straight to a DQmlServer, each frame cut into pieces of at\n"
+           "                most --fragment bytes which are written one at a time, and\n"
+           "                compares what the server wrote with what was sent. The\n"
+           "                changes cycle through adds, removals, compressed frames,\n"
+           "                deltas, streams and changesets, and every eighth is a\n"
+           "                plain change above 256 KB, which is received in pieces.\n"
+           "\n"
+           "Options:\n"
+           "    --files n           Number of QML components in the tree. Defaults to 100.\n"
+           "    --dirs n            Number of directories they're spread over. Defaults to 10.\n"
+           "    --depth n           How deep each directory is nested. Defaults to 1.\n"
+           "    --size bytes        Size of each component file. Defaults to 1024.\n"
+           "    --edits n           Number of edits to time. Defaults to 100.\n"
+           "    --warmup n          Number of edits before timing starts. Defaults to 5.\n"
+           "    --interval ms       Pause between one edit showing and the next. Defaults to 100.\n"
+           "    --timeout ms        Give up on an edit showing after this. Defaults to 5000.\n"
+           "    --port port         Port for the tcp and sync scenarios. Defaults to 7357.\n"
+           "    --coalesce ms       The file tracker's coalesce interval.\n"
+           "    --fragment bytes    Largest piece a frame is cut into. Defaults to 1500.\n"
+           "    --seed n            Seed for the fragment scenario's sizes. Defaults to 1.\n"
+           "    --stats             Print the DQmlMetrics counters and timings as JSON at the end.\n"
+           "\n"
+           );
+}
+
+static QString directoryOf(const Options &o, int leaf)
+{
+    QString dir = QStringLiteral("d") + QString::number(leaf % o.dirs);
+    for (int i = 1; i < o.depth; ++i)
+        dir += QStringLiteral("/n");
+    return dir;
+}
+
+static QString leafPath(const Options &o, int leaf)
+{
+    return directoryOf(o, leaf) + QStringLiteral("/Leaf") + QString::number(leaf) + QStringLiteral(".qml");
+}
+
+// The color changes with every revision, so every edit changes pixels
+static QByteArray leafContent(const Options &o, int leaf, int revision)
+{
+    QByteArray content = "import QtQuick 2.0\n"
+                         "Rectangle {\n"
+                         "    objectName: \"leaf" + QByteArray::number(leaf) + "\"\n"
+                         "    property int revision: " + QByteArray::number(revision) + "\n"
+                         "    width: 8; height: 8\n"
+                         "    color: Qt.hsla(" + QByteArray::number((revision % 16) / 16.0) + ", 0.8, 0.5, 1)\n"
+                         "}\n";
+    while (content.size() < o.size)
+        content += "// " + QByteArray(qMin(76, o.size - content.size()), 'x') + '\n';
+    return content;
+}
+
+static bool writeFile(const QString &fileName, const QByteArray &content)
+{
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QFile f(fileName);
+    if (!f.open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "failed to write" << fileName << f.errorString();
+        return false;
+    }
+    return f.write(content) == content.size();
+}
+
+static bool generateTree(const Options &o, const QString &root)
+{
+    QByteArray main = "import QtQuick 2.0\n";
+    for (int i = 0; i < qMin(o.dirs, o.files); ++i)
+        main += "import \"" + directoryOf(o, i).toUtf8() + "\" as D" + QByteArray::number(i) + '\n';
+    main += "Grid {\n"
+            "    width: 640; height: 480; columns: 64\n";
+    for (int i = 0; i < o.files; ++i) {
+        main += "    D" + QByteArray::number(i % o.dirs) + ".Leaf" + QByteArray::number(i) + " { }\n";
+        if (!writeFile(root + QLatin1Char('/') + leafPath(o, i), leafContent(o, i, 0)))
+            return false;
+    }
+    main += "}\n";
+    return writeFile(root + QStringLiteral("/main.qml"), main);
+}
+
+static qint64 percentile(const QVector<qint64> &sorted, double fraction)
+{
+    if (sorted.isEmpty())
+        return 0;
+    int index = qBound(0, int(fraction * sorted.size() + 0.5) - 1, sorted.size() - 1);
+    return sorted.at(index);
+}
+
+static qint64 cpuUsecs()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+                + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+#endif
+    return 0;
+}
+
+static qint64 maxResidentKBytes()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+class Bench : public QObject
+{
+    Q_OBJECT
+public:
+    Bench(const Options &options) : m_options(options), m_view(0), m_editTime(0), m_leaf(-1),
+        m_revision(0), m_edits(0), m_timeouts(0), m_waiting(false), m_ready(false), m_syncUsecs(-1),
+        m_startCpu(0) { }
+    ~Bench();
+
+    bool setUp();
+    void start();
+
+private Q_SLOTS:
+    void frameSwapped();
+    void edit();
+    void editTimedOut();
+    void checkReady();
+
+private:
+    bool shows(int leaf, int revision) const;
+    void finish();
+
+    Options m_options;
+    QTemporaryDir m_dir;
+    QString m_sourceRoot;
+    QQmlEngine m_engine;
+    QQuickView *m_view;
+    QScopedPointer<DQmlServer> m_server;
+    QScopedPointer<DQmlMonitor> m_monitor;
+
+    QElapsedTimer m_clock;
+    // Runs while waiting for an edit to show
+    QTimer m_editTimer;
+    qint64 m_editTime;
+    int m_leaf;
+    int m_revision;
+    int m_edits;
+    int m_timeouts;
+    bool m_waiting;
+    bool m_ready;
+    qint64 m_syncUsecs;
+    QVector<qint64> m_latencies;
+    QElapsedTimer m_wallClock;
+    qint64 m_startCpu;
+};
+
+Bench::~Bench()
+{
+    m_monitor.reset();
+    m_server.reset();
+    delete m_view;
+}
+
+bool Bench::setUp()
+{
+    const Options &o = m_options;
+    if (!m_dir.isValid()) {
+        qDebug() << "failed to create a temporary directory";
+        return false;
+    }
+    m_sourceRoot = m_dir.path() + QStringLiteral("/monitor");
+    QString serverRoot = m_dir.path() + QStringLiteral("/server");
+    if (!generateTree(o, m_sourceRoot))
+        return false;
+
+    m_view = new QQuickView(&m_engine, 0);
+    m_view->setResizeMode(QQuickView::SizeRootObjectToView);
+    m_view->resize(640, 480);
+    connect(m_view, SIGNAL(frameSwapped()), this, SLOT(frameSwapped()));
+    m_editTimer.setSingleShot(true);
+    connect(&m_editTimer, SIGNAL(timeout()), this, SLOT(editTimedOut()));
+
+    DQmlFileTracker *tracker = 0;
+    if (o.scenario == QStringLiteral("local")) {
+        DQmlLocalServer *server = new DQmlLocalServer(&m_engine, m_view, m_sourceRoot + QStringLiteral("/main.qml"));
+        m_server.reset(server);
+        tracker = server->fileTracker();
+
+    } else if (o.scenario == QStringLiteral("tcp") || o.scenario == QStringLiteral("sync")
+               || o.scenario == QStringLiteral("local-socket")) {
+        bool sync = o.scenario == QStringLiteral("sync");
+        if (sync)
+            QDir().mkpath(serverRoot);
+        else if (!generateTree(o, serverRoot))
+            return false;
+
+        m_server.reset(new DQmlServer(&m_engine, m_view, serverRoot + QStringLiteral("/main.qml")));
+        m_server->addTrackerMapping(QStringLiteral("bench"), serverRoot);
+        m_monitor.reset(new DQmlMonitor());
+        m_monitor->setSyncAllFilesWhenConnected(sync);
+        tracker = m_monitor->fileTracker();
+        if (o.scenario == QStringLiteral("local-socket")) {
+            QString name = QStringLiteral("dqmlbench-") + QString::number(QCoreApplication::applicationPid());
+            m_server->listenLocal(name);
+            m_monitor->connectToLocalServer(name);
+        } else {
+            m_server->listen(o.port);
+            m_monitor->connectToServer(QStringLiteral("127.0.0.1"), o.port);
+        }
+
+    } else {
+        qDebug() << "unknown scenario" << o.scenario;
+        return false;
+    }
+
+    if (o.coalesce >= 0)
+        tracker->setCoalesceInterval(o.coalesce);
+    tracker->track(QStringLiteral("bench"), m_sourceRoot, QStringList(), DQmlFileTracker::Notify);
+    return true;
+}
+
+void Bench::start()
+{
+    m_clock.start();
+    m_server->reloadQml();
+    m_view->show();
+    // The first frames wait for the tree to show, and with sync for it to
+    // arrive, the monitor gets a moment to connect
+    QTimer::singleShot(m_options.timeout * 2, this, SLOT(checkReady()));
+}
+
+void Bench::checkReady()
+{
+    if (!m_ready) {
+        qDebug() << "the tree never showed up";
+        QCoreApplication::exit(1);
+    }
+}
+
+bool Bench::shows(int leaf, int revision) const
+{
+    QObject *root = m_view->rootObject();
+    QObject *item = root ? root->findChild<QObject *>(QStringLiteral("leaf") + QString::number(leaf)) : 0;
+    return item && item->property("revision").toInt() == revision;
+}
+
+void Bench::frameSwapped()
+{
+    if (!m_ready) {
+        if (!shows(m_options.files - 1, 0))
+            return;
+        m_ready = true;
+        if (m_options.scenario == QStringLiteral("sync"))
+            m_syncUsecs = m_clock.nsecsElapsed() / 1000;
+        QTimer::singleShot(m_options.interval, this, SLOT(edit()));
+        return;
+    }
+
+    if (!m_waiting || !shows(m_leaf, m_revision))
+        return;
+    m_waiting = false;
+    m_editTimer.stop();
+    if (m_edits > m_options.warmup)
+        m_latencies << m_clock.nsecsElapsed() / 1000 - m_editTime;
+    if (m_edits == m_options.warmup + m_options.edits)
+        finish();
+    else
+        QTimer::singleShot(m_options.interval, this, SLOT(edit()));
+}
+
+void Bench::edit()
+{
+    if (m_edits == m_options.warmup) {
+        m_wallClock.start();
+        m_startCpu = cpuUsecs();
+    }
+
+    m_leaf = (m_leaf + 1) % m_options.files;
+    if (m_leaf == 0)
+        ++m_revision;
+    ++m_edits;
+    m_waiting = true;
+    m_editTime = m_clock.nsecsElapsed() / 1000;
+    writeFile(m_sourceRoot + QLatin1Char('/') + leafPath(m_options, m_leaf),
+              leafContent(m_options, m_leaf, m_revision));
+    m_editTimer.start(m_options.timeout);
+}
+
+void Bench::editTimedOut()
+{
+    if (!m_waiting)
+        return;
+    qDebug() << "edit" << m_edits << "of leaf" << m_leaf << "never showed";
+    m_waiting = false;
+    ++m_timeouts;
+    if (m_edits == m_options.warmup + m_options.edits)
+        finish();
+    else
+        edit();
+}
+
+void Bench::finish()
+{
+    qint64 wall = qMax<qint64>(1, m_wallClock.nsecsElapsed() / 1000);
+    qint64 cpu = cpuUsecs() - m_startCpu;
+
+    QVector<qint64> sorted = m_latencies;
+    std::sort(sorted.begin(), sorted.end());
+    qint64 sum = 0;
+    foreach (qint64 latency, sorted)
+        sum += latency;
+
+    const Options &o = m_options;
+    printf("scenario: %s, %d files in %d directories %d deep, %d bytes each\n",
+           qPrintable(o.scenario), o.files, qMin(o.dirs, o.files), o.depth, o.size);
+    if (m_syncUsecs >= 0)
+        printf("initial sync: %.2f ms\n", m_syncUsecs / 1000.0);
+    printf("edits: %d, timed out: %d\n", sorted.size(), m_timeouts);
+    if (!sorted.isEmpty()) {
+        printf("edit to pixels: p50 %.2f ms, p99 %.2f ms, mean %.2f ms, max %.2f ms\n",
+               percentile(sorted, 0.5) / 1000.0, percentile(sorted, 0.99) / 1000.0,
+               sum / 1000.0 / sorted.size(), sorted.last() / 1000.0);
+    }
+    printf("cpu: %.1f%% of one core\n", 100.0 * cpu / wall);
+    printf("memory: %lld KB max resident\n", maxResidentKBytes());
+    fflush(stdout);
+
+    if (o.stats)
+        printf("%s\n", DQmlMetrics::instance()->toJson().constData());
+    QCoreApplication::exit(m_timeouts > 0 ? 2 : 0);
+}
+
+// Just enough of the protocol in dqmlprotocol_p.h to act as a monitor
+static const int FRAME_HEADER_SIZE = 16;
+static const int CHANGE_MESSAGE = 1;
+static const int ADD_MESSAGE = 2;
+static const int REMOVE_MESSAGE = 3;
+static const int DELTA_MESSAGE = 4;
+static const int STREAM_BEGIN_MESSAGE = 5;
+static const int STREAM_CHUNK_MESSAGE = 6;
+static const int STREAM_END_MESSAGE = 7;
+static const int HELLO_MESSAGE = 8;
+static const int SESSION_MESSAGE = 9;
+static const int CHANGESET_BEGIN_MESSAGE = 11;
+static const int CHANGESET_COMMIT_MESSAGE = 12;
+static const int COMPRESSED_FRAME = 0x1;
+// Deltas, streams and changesets
+static const int MONITOR_CAPABILITIES = 0x1 | 0x2 | 0x4;
+static const int ACK_REPLY = 4;
+
+// Changes larger than this are taken in pieces by the server
+static const int PIECE_SIZE = 256 * 1024;
+
+static QByteArray makeFrame(int type, const QByteArray &id, const QByteArray &file,
+                            const QByteArray &payload = QByteArray(), int flags = 0)
+{
+    uchar header[FRAME_HEADER_SIZE];
+    qToBigEndian<quint16>(0x4451, header);
+    header[2] = 1;
+    header[3] = uchar(type);
+    qToBigEndian<quint16>(flags, header + 4);
+    qToBigEndian<quint16>(id.size(), header + 6);
+    qToBigEndian<quint16>(file.size(), header + 8);
+    qToBigEndian<quint16>(0, header + 10);
+    qToBigEndian<quint32>(payload.size(), header + 12);
+    return QByteArray(reinterpret_cast<const char *>(header), FRAME_HEADER_SIZE) + id + file + payload;
+}
+
+class FragmentBench : public QObject
+{
+    Q_OBJECT
+public:
+    FragmentBench(const Options &options) : m_options(options), m_offset(0), m_fragments(0),
+        m_frames(0), m_acked(0), m_sendUsecs(0), m_finished(false) { }
+
+    bool setUp();
+    void start();
+
+private Q_SLOTS:
+    void connected();
+    void sendFragment();
+    void readReplies();
+    void timedOut();
+
+private:
+    void addFrame(int type, const QByteArray &file, const QByteArray &payload = QByteArray(), int flags = 0);
+    void finish(bool complete);
+
+    Options m_options;
+    QTemporaryDir m_dir;
+    QString m_serverRoot;
+    QQmlEngine m_engine;
+    QScopedPointer<DQmlServer> m_server;
+    QTcpSocket m_socket;
+
+    // Everything to send, the content each file should end up with and
+    // the files which should be gone
+    QByteArray m_data;
+    int m_offset;
+    int m_fragments;
+    quint64 m_frames;
+    QHash<QString, QByteArray> m_expected;
+    QSet<QString> m_removed;
+
+    QByteArray m_replies;
+    quint64 m_acked;
+    QElapsedTimer m_clock;
+    qint64 m_sendUsecs;
+    bool m_finished;
+};
+
+bool FragmentBench::setUp()
+{
+    const Options &o = m_options;
+    if (!m_dir.isValid()) {
+        qDebug() << "failed to create a temporary directory";
+        return false;
+    }
+    m_serverRoot = m_dir.path() + QStringLiteral("/server");
+    if (!writeFile(m_serverRoot + QStringLiteral("/main.qml"), "import QtQuick 2.0\nItem { }\n"))
+        return false;
+    m_server.reset(new DQmlServer(&m_engine, 0, m_serverRoot + QStringLiteral("/main.qml")));
+    m_server->addTrackerMapping(QStringLiteral("bench"), m_serverRoot);
+    m_server->listen(o.port);
+
+    DQmlCodec *codec = DQmlCodec::codec("zlib");
+    if (!codec) {
+        qDebug() << "no zlib codec";
+        return false;
+    }
+
+    qsrand(o.seed);
+    QByteArray hello;
+    hello.resize(4);
+    qToBigEndian<quint32>(MONITOR_CAPABILITIES, reinterpret_cast<uchar *>(hello.data()));
+    hello += codec->name();
+    m_data += makeFrame(HELLO_MESSAGE, QByteArray(), QByteArray(), hello);
+
+    QByteArray session(8 + 16, 0);
+    for (int i = 8; i < session.size(); ++i)
+        session[i] = char(qrand());
+    m_data += makeFrame(SESSION_MESSAGE, QByteArray(), QByteArray(), session);
+
+    // Every other round of seven goes in a changeset
+    for (int i = 0; i < o.edits; ++i) {
+        if (i % 14 == 7)
+            m_data += makeFrame(CHANGESET_BEGIN_MESSAGE, QByteArray(), QByteArray());
+
+        QString file = QStringLiteral("f") + QString::number(qrand() % o.files) + QStringLiteral(".bin");
+        int size = i % 8 == 0 ? PIECE_SIZE + 1 + qrand() % PIECE_SIZE : qrand() % (o.size + 1);
+        QByteArray content(size, Qt::Uninitialized);
+        for (int j = 0; j < content.size(); ++j)
+            content[j] = char(i + j * 7);
+
+        int kind = i % 8 == 0 ? 0 : i % 7;
+        if (kind == 3 && !m_expected.contains(file))
+            kind = 0;
+        switch (kind) {
+        case 0:
+        case 6:
+            addFrame(CHANGE_MESSAGE, file.toUtf8(), content);
+            break;
+        case 1:
+            addFrame(ADD_MESSAGE, file.toUtf8(), content);
+            break;
+        case 2: {
+            QByteArray payload(4, Qt::Uninitialized);
+            qToBigEndian<quint32>(content.size(), reinterpret_cast<uchar *>(payload.data()));
+            payload += codec->compress(content, -1);
+            addFrame(CHANGE_MESSAGE, file.toUtf8(), payload, COMPRESSED_FRAME);
+            break;
+        }
+        case 3: {
+            // Inserts a run of bytes into what the server has, copying the rest
+            const QByteArray base = m_expected.value(file);
+            int split = base.isEmpty() ? 0 : qrand() % base.size();
+            QByteArray literal = QByteArray::number(i);
+            content = base.left(split) + literal + base.mid(split);
+
+            QByteArray payload(16, Qt::Uninitialized);
+            uchar *hashes = reinterpret_cast<uchar *>(payload.data());
+            qToBigEndian<quint64>(dqml_hash(base.constData(), base.size()), hashes);
+            qToBigEndian<quint64>(dqml_hash(content.constData(), content.size()), hashes + 8);
+            uchar op[9];
+            if (split > 0) {
+                op[0] = 'C';
+                qToLittleEndian<quint32>(0, op + 1);
+                qToLittleEndian<quint32>(split, op + 5);
+                payload.append(reinterpret_cast<const char *>(op), 9);
+            }
+            op[0] = 'L';
+            qToLittleEndian<quint32>(literal.size(), op + 1);
+            payload.append(reinterpret_cast<const char *>(op), 5);
+            payload += literal;
+            if (split < base.size()) {
+                op[0] = 'C';
+                qToLittleEndian<quint32>(split, op + 1);
+                qToLittleEndian<quint32>(base.size() - split, op + 5);
+                payload.append(reinterpret_cast<const char *>(op), 9);
+            }
+            addFrame(DELTA_MESSAGE, file.toUtf8(), payload);
+            break;
+        }
+        case 4: {
+            addFrame(STREAM_BEGIN_MESSAGE, file.toUtf8());
+            int chunk = qMax(1, content.size() / 3);
+            for (int offset = 0; offset < content.size(); offset += chunk)
+                addFrame(STREAM_CHUNK_MESSAGE, file.toUtf8(), content.mid(offset, chunk));
+            addFrame(STREAM_END_MESSAGE, file.toUtf8());
+            break;
+        }
+        case 5:
+            addFrame(REMOVE_MESSAGE, file.toUtf8());
+            m_expected.remove(file);
+            m_removed.insert(file);
+            break;
+        }
+        if (kind != 5) {
+            m_expected.insert(file, content);
+            m_removed.remove(file);
+        }
+
+        if (i % 14 == 13 || (i % 14 >= 7 && i == o.edits - 1))
+            m_data += makeFrame(CHANGESET_COMMIT_MESSAGE, QByteArray(), QByteArray());
+    }
+    return true;
+}
+
+// Adds a frame the server numbers and acknowledges
+void FragmentBench::addFrame(int type, const QByteArray &file, const QByteArray &payload, int flags)
+{
+    m_data += makeFrame(type, "bench", file, payload, flags);
+    ++m_frames;
+}
+
+void FragmentBench::start()
+{
+    connect(&m_socket, SIGNAL(connected()), this, SLOT(connected()));
+    connect(&m_socket, SIGNAL(readyRead()), this, SLOT(readReplies()));
+    m_socket.connectToHost(QStringLiteral("127.0.0.1"), m_options.port);
+}
+
+void FragmentBench::connected()
+{
+    m_clock.start();
+    sendFragment();
+}
+
+// One piece per turn of the event loop, so the server sees each on its own
+void FragmentBench::sendFragment()
+{
+    if (m_offset == m_data.size()) {
+        m_sendUsecs = m_clock.nsecsElapsed() / 1000;
+        QTimer::singleShot(m_options.timeout, this, SLOT(timedOut()));
+        return;
+    }
+    int size = qMin(1 + qrand() % qMax(1, m_options.fragment), m_data.size() - m_offset);
+    m_socket.write(m_data.constData() + m_offset, size);
+    m_socket.flush();
+    m_offset += size;
+    ++m_fragments;
+    QTimer::singleShot(0, this, SLOT(sendFragment()));
+}
+
+void FragmentBench::timedOut()
+{
+    finish(false);
+}
+
+void FragmentBench::readReplies()
+{
+    m_replies += m_socket.readAll();
+    const uchar *data = reinterpret_cast<const uchar *>(m_replies.constData());
+    int offset = 0;
+    while (m_replies.size() - offset >= FRAME_HEADER_SIZE) {
+        const uchar *header = data + offset;
+        int size = FRAME_HEADER_SIZE + qFromBigEndian<quint16>(header + 6) + qFromBigEndian<quint16>(header + 8)
+                + qFromBigEndian<quint32>(header + 12);
+        if (m_replies.size() - offset < size)
+            break;
+        if (header[3] == ACK_REPLY && size - FRAME_HEADER_SIZE >= 8)
+            m_acked = qFromBigEndian<quint64>(data + offset + size - 8);
+        offset += size;
+    }
+    m_replies.remove(0, offset);
+    if (m_acked == m_frames)
+        finish(true);
+}
+
+void FragmentBench::finish(bool complete)
+{
+    if (m_finished)
+        return;
+    m_finished = true;
+
+    int mismatches = 0;
+    for (QHash<QString, QByteArray>::const_iterator it = m_expected.constBegin(); it != m_expected.constEnd(); ++it) {
+        QFile f(m_serverRoot + QLatin1Char('/') + it.key());
+        if (!f.open(QFile::ReadOnly) || f.readAll() != it.value()) {
+            qDebug() << "server has the wrong content in" << it.key();
+            ++mismatches;
+        }
+    }
+    foreach (const QString &file, m_removed) {
+        if (QFile::exists(m_serverRoot + QLatin1Char('/') + file)) {
+            qDebug() << "server did not remove" << file;
+            ++mismatches;
+        }
+    }
+
+    qint64 usecs = qMax<qint64>(1, m_clock.nsecsElapsed() / 1000);
+    printf("scenario: fragment, %d changes to %d files of up to %d bytes, pieces of up to %d bytes\n",
+           m_options.edits, m_options.files, m_options.size, m_options.fragment);
+    printf("sent: %d bytes in %d pieces in %.2f ms\n", m_data.size(), m_fragments, m_sendUsecs / 1000.0);
+    printf("acknowledged: %llu of %llu frames in %.2f ms, %.1f MB/s\n", m_acked, m_frames,
+           usecs / 1000.0, m_data.size() / double(usecs));
+    printf("files: %d, removed: %d, wrong: %d\n", m_expected.size(), m_removed.size(), mismatches);
+    printf("memory: %lld KB max resident\n", maxResidentKBytes());
+    fflush(stdout);
+
+    if (m_options.stats)
+        printf("%s\n", DQmlMetrics::instance()->toJson().constData());
+    QCoreApplication::exit(complete && mismatches == 0 ? 0 : 2);
+}
+
+int main(int argc, char **argv)
+{
+    // Headless unless asked otherwise
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    if (qEnvironmentVariableIsEmpty("QT_QUICK_BACKEND"))
+        qputenv("QT_QUICK_BACKEND", "software");
+
+    QGuiApplication app(argc, argv);
+
+    Options o;
+    QStringList args = app.arguments();
+    for (int i=1; i<args.size(); ++i) {
+        const QString &a = args.at(i);
+        int *number = 0;
+        if (a == QStringLiteral("--files"))
+            number = &o.files;
+        else if (a == QStringLiteral("--dirs"))
+            number = &o.dirs;
+        else if (a == QStringLiteral("--depth"))
+            number = &o.depth;
+        else if (a == QStringLiteral("--size"))
+            number = &o.size;
+        else if (a == QStringLiteral("--edits"))
+            number = &o.edits;
+        else if (a == QStringLiteral("--warmup"))
+            number = &o.warmup;
+        else if (a == QStringLiteral("--interval"))
+            number = &o.interval;
+        else if (a == QStringLiteral("--timeout"))
+            number = &o.timeout;
+        else if (a == QStringLiteral("--port"))
+            number = &o.port;
+        else if (a == QStringLiteral("--coalesce"))
+            number = &o.coalesce;
+        else if (a == QStringLiteral("--fragment"))
+            number = &o.fragment;
+        else if (a == QStringLiteral("--seed"))
+            number = &o.seed;
+
+        if (number) {
+            bool ok = false;
+            if (i + 1 < args.size())
+                *number = args.at(i+1).toInt(&ok);
+            if (!ok || *number < 0) {
+                qDebug() << "Malformed" << a << "command: requires a number";
+                return 1;
+            }
+            i += 1;
+
+        } else if (a == QStringLiteral("--scenario")) {
+            if (args.size() < i + 2) {
+                qDebug() << "Malformed --scenario command: requires a name";
+                return 1;
+            }
+            o.scenario = args.at(i+1);
+            i += 1;
+
+        } else if (a == QStringLiteral("--stats")) {
+            o.stats = true;
+
+        } else if (a == QStringLiteral("-h") || a == QStringLiteral("--help")) {
+            printHelp();
+            return 0;
+
+        } else {
+            qDebug() << "Unknown argument" << a;
+            printHelp();
+            return 1;
+        }
+    }
+    if (o.files < 1 || o.dirs < 1 || o.depth < 1 || o.edits < 1) {
+        qDebug() << "--files, --dirs, --depth and --edits must be at least 1";
+        return 1;
+    }
+
+    if (o.scenario == QStringLiteral("fragment")) {
+        FragmentBench bench(o);
+        if (!bench.setUp())
+            return 1;
+        bench.start();
+        return app.exec();
+    }
+
+    Bench bench(o);
+    if (!bench.setUp())
+        return 1;
+    bench.start();
+    return app.exec();
+}
+
+#include "dqmlbench.moc"
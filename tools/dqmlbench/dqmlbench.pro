@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET   = dqmlbench
+QT 	 += dqml
+# The fragment scenario hashes its deltas like the monitor does
+INCLUDEPATH += ../../src/dqml
+SOURCES  += dqmlbench.cpp \
+            ../../src/dqml/dqmlhash.cpp
+
+# 'make check' feeds a server every kind of frame and checks what it wrote
+check.commands = $$shell_path($$OUT_PWD/dqmlbench) --scenario fragment
+check.depends = $(TARGET)
+QMAKE_EXTRA_TARGETS += check
+
+load(qt_tool)
@@ -37,19 +37,84 @@
 
 #include <QFileInfo>
 #include <QFileSystemWatcher>
+#include <QSocketNotifier>
 
 #include <dqml/dqmlserver.h>
 #include <dqml/dqmllocalserver.h>
 #include <dqml/dqmlmonitor.h>
+#include <dqml/dqmlcodec.h>
 #include <dqml/dqmlfiletracker.h>
+#include <dqml/dqmlmetrics.h>
+
+#ifdef Q_OS_UNIX
+#include <signal.h>
+#include <unistd.h>
+
+// Signals are forwarded through a pipe so they are handled in the event loop
+static int signalPipe[2];
+
+static void forwardSignal(int sig)
+{
+    char c = char(sig);
+    if (::write(signalPipe[1], &c, 1) != 1)
+        return;
+}
+#endif
+
+// Prints the stats whenever they're dumped and handles the signals
+// forwarded through signalPipe
+class StatsPrinter : public QObject
+{
+    Q_OBJECT
+public:
+    StatsPrinter(QObject *parent) : QObject(parent) { }
+
+public Q_SLOTS:
+    void print(const QByteArray &json)
+    {
+        fwrite(json.constData(), 1, json.size(), stdout);
+        fflush(stdout);
+    }
+
+    void readSignal(int fd)
+    {
+#ifdef Q_OS_UNIX
+        char sig;
+        if (::read(fd, &sig, 1) != 1)
+            return;
+        if (sig == SIGUSR1)
+            DQmlMetrics::instance()->dump();
+        else
+            QCoreApplication::quit();
+#else
+        Q_UNUSED(fd);
+#endif
+    }
+};
+
+struct Tracking
+{
+    Tracking(const QString &i, const QString &p) : id(i), path(p), poll(false) { }
+    QString id;
+    QString path;
+    QStringList rules;
+    bool poll;
+};
 
 void printHelp()
 {
     printf("Usage: \n"
            " > dqml file.qml               (same as --local)\n"
-           " > dqml --local [--track path] file.qml\n"
-           " > dqml --server port [--track id path] file.qml\n"
-           " > dqml --monitor addr port [--track id path] [--sync]\n"
+           " > dqml --local [--track path [--ignore pattern] [--poll]] [--hash] [--coalesce ms]\n"
+           "                             [--manifest file] [--stats] file.qml\n"
+           " > dqml --server port [--track id path] [--overlay] [--stats] file.qml\n"
+           " > dqml --monitor addr port [--monitor addr port ...] [--track id path [--ignore pattern]\n"
+           "                             [--poll]] [--sync]\n"
+           "                             [--hash] [--coalesce ms] [--manifest file] [--stats]\n"
+           "                             [--compress codec[:level]] [--compress-threshold bytes]\n"
+           "                             [--stream-threshold bytes]\n"
+           " > dqml --monitor-local name [--shm bytes] ...  (the same as --monitor)\n"
+           " > dqml --server-local name [--server port] ... (the same as --server)\n"
            "\n"
            "Application modes:\n"
            "    --local     The application runs locally and functions like qmlscene, except\n"
@@ -59,20 +124,69 @@ void printHelp()
            "\n"
            "    --monitor   The application runs as a non-gui application, monitoring requested\n"
            "                files. The --monitor mode is followed by the address and port to the\n"
-           "                server.\n"
+           "                server. Give it several times to send the changes to several\n"
+           "                servers, each file is only read and compressed once for all of\n"
+           "                them.\n"
+           "\n"
+           "    --monitor-local\n"
+           "                Like --monitor, for a server on the same machine, connecting\n"
+           "                to the local socket 'name' instead of going through TCP. Can\n"
+           "                be combined with --monitor.\n"
            "\n"
            "    --server    The application runs in server mode with 'file.qml' as the main qml\n"
            "                file. The --server mode is followed by the port to accept connections\n"
            "                on.\n"
            "\n"
+           "    --server-local\n"
+           "                Like --server, accepting monitors on the same machine on the\n"
+           "                local socket 'name'. Can be combined with --server.\n"
+           "\n"
            "Options:\n"
            "    --track id path     The application will track the given path and name it 'id'.\n"
            "                        In server/monitor mode the path is used to map paths between\n"
-           "                        monitor and server. The tracking is not recursive, but\n"
+           "                        monitor and server. The tracking is recursive and\n"
            "                        multiple --track arguments can be specified. When no\n"
            "                        arguments are specified, the current directory is tracked\n"
+           "    --ignore pattern    Don't track files or directories matching 'pattern' in the\n"
+           "                        preceding --track, or in all of them when given first.\n"
+           "                        Patterns follow the .gitignore syntax, so '!*.svg' tracks\n"
+           "                        SVG files and 'build/' skips directories named 'build'.\n"
+           "                        Rules are also read from a .dqmlignore file in the\n"
+           "                        tracked directory.\n"
+           "    --poll              Poll the preceding --track, or all of them when given first,\n"
+           "                        instead of relying on change notifications. Needed on NFS,\n"
+           "                        sshfs and container volumes which don't deliver them.\n"
            "    --sync              Sync all files from the monitor to the server when connected.\n"
-           "                        Useful to keep files in sync."
+           "                        Useful to keep files in sync. Only files the server lacks\n"
+           "                        or has another version of are sent, and tracked files the\n"
+           "                        monitor doesn't have are removed on the server.\n"
+           "    --hash              Compare file content when a file's timestamp changes and\n"
+           "                        ignore files which were touched without being changed.\n"
+           "    --coalesce ms       Collect file changes until nothing has changed for 'ms'\n"
+           "                        milliseconds and handle them as one. Defaults to 50.\n"
+           "    --manifest file     Remember the state of the tracked files in 'file'. On the\n"
+           "                        next start, only files which changed in the meantime are\n"
+           "                        reported instead of treating everything as new.\n"
+           "    --compress codec[:level]\n"
+           "                        Compress what is sent to the server with 'codec', 'zlib'\n"
+           "                        or, when available, 'lz4', at 'level' from 0 to 9. 'none'\n"
+           "                        turns compression off. Images are never compressed.\n"
+           "    --compress-threshold bytes\n"
+           "                        Don't compress messages smaller than 'bytes'. Defaults\n"
+           "                        to 512.\n"
+           "    --stream-threshold bytes\n"
+           "                        Stream files of 'bytes' or more to the server in chunks\n"
+           "                        instead of sending them in one go. 0 turns it off.\n"
+           "                        Defaults to 1048576.\n"
+           "    --shm bytes         Hand large files to servers connected with --monitor-local\n"
+           "                        over a shared memory ring buffer of 'bytes' instead of\n"
+           "                        the socket.\n"
+           "    --overlay           In server mode, load what was received from memory rather\n"
+           "                        than from disk, which is still written in the background.\n"
+           "                        Lets --track map an id to a resource path like ':/qml' to\n"
+           "                        override files compiled into the application.\n"
+           "    --stats             Print counters and timings as JSON when exiting and, on\n"
+           "                        Unix, when receiving SIGUSR1.\n"
            "\n"
            );
 }
@@ -89,11 +203,24 @@ int main(int argc, char **argv)
         Local_Mode,
     } mode = Local_Mode;
 
-    QList<QPair<QString,QString> > tracking;
+    QList<Tracking> tracking;
+    QStringList rules;
+    bool poll = false;
     QString file;
     int port = -1;
-    QString host;
+    QList<QPair<QString, quint16> > servers;
+    QStringList localServers;
+    QString localName;
+    int sharedMemorySize = -1;
     bool sync = false;
+    bool hash = false;
+    int coalesce = -1;
+    QString manifest;
+    bool stats = false;
+    bool overlay = false;
+    QString compress;
+    int compressThreshold = -1;
+    qint64 streamThreshold = -1;
 
     QStringList args = app.arguments();
     for (int i=1; i<args.size(); ++i) {
@@ -105,7 +232,7 @@ int main(int argc, char **argv)
                 qDebug() << "Malformed --monitor command: requires host and port";
                 return 1;
             }
-            host = args.at(i+1);
+            QString host = args.at(i+1);
             if (host.startsWith(QStringLiteral("--"))) {
                 qDebug() << "Malformed --monitor command: invalid host" << host;
                 return 1;
@@ -116,8 +243,37 @@ int main(int argc, char **argv)
                 qDebug() << "Malformed --monitor command: bad port number";
                 return 1;
             }
+            servers << qMakePair(host, quint16(port));
             i += 2;
 
+        } else if (a == QStringLiteral("--monitor-local")) {
+            mode = Monitor_Mode;
+            if (args.size() < i + 2 || args.at(i+1).startsWith(QStringLiteral("--"))) {
+                qDebug() << "Malformed --monitor-local command: requires a name";
+                return 1;
+            }
+            localServers << args.at(i+1);
+            i += 1;
+
+        } else if (a == QStringLiteral("--server-local")) {
+            mode = Server_Mode;
+            if (args.size() < i + 2 || args.at(i+1).startsWith(QStringLiteral("--"))) {
+                qDebug() << "Malformed --server-local command: requires a name";
+                return 1;
+            }
+            localName = args.at(i+1);
+            i += 1;
+
+        } else if (a == QStringLiteral("--shm")) {
+            bool ok = false;
+            if (i + 1 < args.size())
+                sharedMemorySize = args.at(i+1).toInt(&ok);
+            if (!ok || sharedMemorySize < 0) {
+                qDebug() << "Malformed --shm command: requires a number of bytes";
+                return 1;
+            }
+            i += 1;
+
         } else if (a == QStringLiteral("--server")) {
             mode = Server_Mode;
             if (args.size() < i + 1) {
@@ -138,6 +294,61 @@ int main(int argc, char **argv)
         } else if (a == QStringLiteral("--sync")) {
             sync = true;
 
+        } else if (a == QStringLiteral("--compress")) {
+            if (args.size() < i + 2) {
+                qDebug() << "Malformed --compress command: requires a 'codec'";
+                return 1;
+            }
+            compress = args.at(i+1);
+            i += 1;
+
+        } else if (a == QStringLiteral("--compress-threshold")) {
+            bool ok = false;
+            if (i + 1 < args.size())
+                compressThreshold = args.at(i+1).toInt(&ok);
+            if (!ok || compressThreshold < 0) {
+                qDebug() << "Malformed --compress-threshold command: requires a number of bytes";
+                return 1;
+            }
+            i += 1;
+
+        } else if (a == QStringLiteral("--stream-threshold")) {
+            bool ok = false;
+            if (i + 1 < args.size())
+                streamThreshold = args.at(i+1).toLongLong(&ok);
+            if (!ok || streamThreshold < 0) {
+                qDebug() << "Malformed --stream-threshold command: requires a number of bytes";
+                return 1;
+            }
+            i += 1;
+
+        } else if (a == QStringLiteral("--stats")) {
+            stats = true;
+
+        } else if (a == QStringLiteral("--overlay")) {
+            overlay = true;
+
+        } else if (a == QStringLiteral("--hash")) {
+            hash = true;
+
+        } else if (a == QStringLiteral("--coalesce")) {
+            bool ok = false;
+            if (i + 1 < args.size())
+                coalesce = args.at(i+1).toInt(&ok);
+            if (!ok || coalesce < 0) {
+                qDebug() << "Malformed --coalesce command: requires a number of milliseconds";
+                return 1;
+            }
+            i += 1;
+
+        } else if (a == QStringLiteral("--manifest")) {
+            if (args.size() < i + 2) {
+                qDebug() << "Malformed --manifest command: requires a 'file'";
+                return 1;
+            }
+            manifest = args.at(i+1);
+            i += 1;
+
         } else if (a == QStringLiteral("--track")) {
             if (mode == Local_Mode) {
                 if (args.size() < i + 1) {
@@ -145,8 +356,7 @@ int main(int argc, char **argv)
                     return 1;
                 }
                 // Just given them all a unique id, it isn't so it doesn't matter...
-                tracking << QPair<QString, QString>(QString::number(tracking.size()),
-                                                    args.at(i+1));
+                tracking << Tracking(QString::number(tracking.size()), args.at(i+1));
                 i += 1;
             } else {
                 if (args.size() < i + 2) {
@@ -154,10 +364,29 @@ int main(int argc, char **argv)
                     return 1;
                 }
                 // Just given them all a unique id, it isn't so it doesn't matter...
-                tracking << QPair<QString, QString>(args.at(i+1), args.at(i+2));
+                tracking << Tracking(args.at(i+1), args.at(i+2));
                 i += 2;
             }
 
+        } else if (a == QStringLiteral("--ignore")) {
+            if (args.size() < i + 2) {
+                qDebug() << "Malformed --ignore command: requires a 'pattern'";
+                return 1;
+            }
+            // Applies to the last --track, or to all of them when given first
+            if (tracking.isEmpty())
+                rules << args.at(i+1);
+            else
+                tracking.last().rules << args.at(i+1);
+            i += 1;
+
+        } else if (a == QStringLiteral("--poll")) {
+            // Applies to the last --track, or to all of them when given first
+            if (tracking.isEmpty())
+                poll = true;
+            else
+                tracking.last().poll = true;
+
         } else if (a == QStringLiteral("-h") || a == QStringLiteral("--help")) {
             printHelp();
             return 0;
@@ -167,10 +396,11 @@ int main(int argc, char **argv)
         }
     }
 
+    // The servers use the engine, so it goes last
+    QScopedPointer<QQmlEngine> engine;
     QScopedPointer<DQmlServer> server;
     QScopedPointer<DQmlMonitor> monitor;
     QScopedPointer<DQmlLocalServer> localServer;
-    QScopedPointer<QQmlEngine> engine;
     DQmlFileTracker *tracker = 0;
 
     if (mode == Local_Mode) {
@@ -193,15 +423,42 @@ int main(int argc, char **argv)
         monitor.reset(new DQmlMonitor());
         tracker = monitor->fileTracker();
         monitor->setSyncAllFilesWhenConnected(sync);
-        monitor->connectToServer(host, port);
+        if (!compress.isEmpty()) {
+            QString codec = compress.section(QLatin1Char(':'), 0, 0);
+            bool ok = true;
+            int level = compress.contains(QLatin1Char(':')) ? compress.section(QLatin1Char(':'), 1).toInt(&ok) : -1;
+            if (!ok || level < -1 || level > 9) {
+                qDebug() << "Malformed --compress command: bad level" << compress;
+                return 1;
+            }
+            if (codec == QStringLiteral("none"))
+                codec.clear();
+            else if (!DQmlCodec::codec(codec.toLatin1()))
+                qDebug() << "Unknown codec" << codec << "available are" << DQmlCodec::codecNames();
+            monitor->setCompression(codec.toLatin1(), level);
+        }
+        if (compressThreshold >= 0)
+            monitor->setCompressionThreshold(compressThreshold);
+        if (streamThreshold >= 0)
+            monitor->setStreamThreshold(streamThreshold);
+        if (sharedMemorySize >= 0)
+            monitor->setSharedMemorySize(sharedMemorySize);
+        for (int i=0; i<servers.size(); ++i)
+            monitor->connectToServer(servers.at(i).first, servers.at(i).second);
+        foreach (const QString &name, localServers)
+            monitor->connectToLocalServer(name);
 
     } else if (mode == Server_Mode) {
         qDebug() << "running server mode with" << file;
         engine.reset(new QQmlEngine());
         server.reset(new DQmlServer(engine.data(), 0, file));
         server->setCreateViewIfNeeded(true);
+        server->setOverlayEnabled(overlay);
         server->reloadQml();
-        server->listen(port);
+        if (port >= 0)
+            server->listen(port);
+        if (!localName.isEmpty())
+            server->listenLocal(localName);
     }
 
     QString current = QStringLiteral(".");
@@ -210,12 +467,18 @@ int main(int argc, char **argv)
 
     if (mode == Local_Mode || mode == Monitor_Mode) {
         Q_ASSERT(tracker);
+        tracker->setContentHashing(hash);
+        if (coalesce >= 0)
+            tracker->setCoalesceInterval(coalesce);
+        tracker->setManifestFile(manifest);
         if (tracking.size() == 0) {
-            tracker->track(QStringLiteral("current-directory"), current);
+            tracker->track(QStringLiteral("current-directory"), current, rules,
+                           poll ? DQmlFileTracker::Poll : DQmlFileTracker::Notify);
         } else {
             for (int i=0; i<tracking.size(); ++i) {
-                const QPair<QString,QString> &pair = tracking.at(i);
-                tracker->track(pair.first, pair.second);
+                const Tracking &t = tracking.at(i);
+                tracker->track(t.id, t.path, rules + t.rules,
+                               poll || t.poll ? DQmlFileTracker::Poll : DQmlFileTracker::Notify);
             }
         }
 
@@ -224,11 +487,32 @@ int main(int argc, char **argv)
             server->addTrackerMapping(QStringLiteral("current-directory"), current);
         } else {
             for (int i=0; i<tracking.size(); ++i) {
-                const QPair<QString,QString> &pair = tracking.at(i);
-                server->addTrackerMapping(pair.first, pair.second);
+                const Tracking &t = tracking.at(i);
+                server->addTrackerMapping(t.id, t.path);
             }
         }
     }
 
-    return app.exec();
+    if (stats) {
+        StatsPrinter *printer = new StatsPrinter(&app);
+        QObject::connect(DQmlMetrics::instance(), SIGNAL(dumped(QByteArray)), printer, SLOT(print(QByteArray)));
+#ifdef Q_OS_UNIX
+        // SIGUSR1 prints the current stats, SIGINT and SIGTERM quit cleanly
+        // so that the final stats are printed.
+        if (::pipe(signalPipe) == 0) {
+            QSocketNotifier *notifier = new QSocketNotifier(signalPipe[0], QSocketNotifier::Read, &app);
+            QObject::connect(notifier, SIGNAL(activated(int)), printer, SLOT(readSignal(int)));
+            signal(SIGUSR1, forwardSignal);
+            signal(SIGINT, forwardSignal);
+            signal(SIGTERM, forwardSignal);
+        }
+#endif
+    }
+
+    int result = app.exec();
+    if (stats)
+        DQmlMetrics::instance()->dump();
+    return result;
 }
+
+#include "dqmlmain.moc"
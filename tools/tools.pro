@@ -1,2 +1,3 @@
 TEMPLATE = subdirs
-SUBDIRS  = dqmltool
+SUBDIRS  = dqmltool \
+           dqmlbench